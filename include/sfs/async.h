@@ -0,0 +1,83 @@
+/* async.h: SimpleFS asynchronous requests */
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include "sfs/fs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Async Constants */
+
+#define ASYNC_WORKERS       (4)                 /* Default number of worker threads */
+
+/* Request Types */
+
+#define ASYNC_READ          (0)
+#define ASYNC_WRITE         (1)
+#define ASYNC_CREATE        (2)
+#define ASYNC_REMOVE        (3)
+
+/* Async Structures */
+
+typedef struct AsyncQueue AsyncQueue;
+typedef struct AsyncRequest AsyncRequest;
+typedef struct AsyncWorker AsyncWorker;
+
+typedef void (*AsyncCallback)(AsyncRequest *request, void *arg);
+
+struct AsyncRequest {
+    AsyncQueue     *queue;                      /* Queue the request was submitted to */
+    int             type;                       /* ASYNC_* request type */
+    size_t          inode_number;               /* Inode to operate on (ASYNC_CREATE: none) */
+    char           *data;                       /* Caller buffer (valid until completion) */
+    size_t          length;                     /* Number of bytes to transfer */
+    size_t          offset;                     /* Byte offset of the transfer */
+    ssize_t         result;                     /* Return value of the blocking call */
+    AsyncCallback   callback;                   /* Called on completion (NULL: completion queue) */
+    void           *arg;                        /* Argument passed to callback */
+    AsyncRequest   *next;                       /* Next request in pending or completion queue */
+};
+
+struct AsyncWorker {
+    AsyncQueue     *queue;                      /* Queue the worker takes requests from */
+    pthread_t       thread;                     /* Worker thread */
+    ssize_t         inode_number;               /* Inode of the running request (-1 if none) */
+};
+
+struct AsyncQueue {
+    FileSystem     *fs;                         /* File system requests run on */
+    pthread_mutex_t lock;                       /* Protects queues and worker state */
+    pthread_cond_t  work_cond;                  /* Signaled when a request may be runnable */
+    pthread_cond_t  done_cond;                  /* Signaled when a request completes */
+    AsyncRequest   *pending;                    /* Submitted requests in submission order */
+    AsyncRequest   *completed;                  /* Completed requests without callback */
+    AsyncRequest  **completed_tail;             /* Where to append the next completion */
+    size_t          inflight;                   /* Number of submitted requests not yet completed */
+    AsyncWorker    *workers;                    /* Worker pool */
+    size_t          nworkers;                   /* Number of worker threads */
+    int             event_fd;                   /* Readable while completions are queued */
+    bool            stop;                       /* Ask workers to exit once pending is empty */
+};
+
+/* Async Functions */
+
+AsyncQueue *    async_open(FileSystem *fs, size_t workers);
+void            async_close(AsyncQueue *queue);
+
+AsyncRequest *  async_read(AsyncQueue *queue, size_t inode_number, char *data, size_t length, size_t offset,
+                           AsyncCallback callback, void *arg);
+AsyncRequest *  async_write(AsyncQueue *queue, size_t inode_number, char *data, size_t length, size_t offset,
+                            AsyncCallback callback, void *arg);
+AsyncRequest *  async_create(AsyncQueue *queue, AsyncCallback callback, void *arg);
+AsyncRequest *  async_remove(AsyncQueue *queue, size_t inode_number, AsyncCallback callback, void *arg);
+
+int             async_fd(AsyncQueue *queue);
+AsyncRequest *  async_poll(AsyncQueue *queue, bool wait);
+void            async_release(AsyncRequest *request);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
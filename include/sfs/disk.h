@@ -20,6 +20,7 @@ struct Disk {
     size_t  blocks;     /* Number of blocks in disk image	*/
     size_t  reads;      /* Number of reads to disk image	*/
     size_t  writes;     /* Number of writes to disk image	*/
+    size_t  syncs;      /* Number of flushes of disk image	*/
 }; 
 
 /* Disk Functions */
@@ -29,6 +30,10 @@ void	disk_close(Disk *disk);
 
 ssize_t	disk_read(Disk *disk, size_t block, char *data);
 ssize_t	disk_write(Disk *disk, size_t block, char *data);
+ssize_t	disk_read_blocks(Disk *disk, size_t block, size_t count, char *data);
+ssize_t	disk_write_blocks(Disk *disk, size_t block, size_t count, char *data);
+ssize_t	disk_copy_blocks(Disk *disk, size_t src, size_t dst, size_t count);
+bool	disk_sync(Disk *disk);
 
 #endif
 
@@ -5,10 +5,12 @@
 
 #include "sfs/disk.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* File System Constants */
 
@@ -16,6 +18,69 @@
 #define INODES_PER_BLOCK    (128)               /* Number of inodes per block */
 #define POINTERS_PER_INODE  (5)                 /* Number of direct pointers per inode */
 #define POINTERS_PER_BLOCK  (1024)              /* Number of pointers per block */
+#define DIRECT_POINTERS_LARGE (3)               /* Number of direct pointers with INODE_INDIRECT3 */
+#define BLOCKS_PER_GROUP    (8192)              /* Number of blocks per block group */
+#define POINTER_UNWRITTEN   (1u<<31)            /* Pointer flag: preallocated, never written */
+#define POINTER_BLOCK(p)    ((p) & ~POINTER_UNWRITTEN)
+#define ARENA_BLOCKS        (64)                /* Number of blocks reserved by an arena */
+#define ARENA_RANGES        (8)                 /* Number of free ranges held by an arena */
+#define DELALLOC_BLOCKS     (1024)              /* Number of blocks buffered before writeback */
+#define POINTER_CACHE_BLOCKS (64)               /* Number of cached indirect blocks */
+#define INODE_CACHE_BLOCKS  (64)                /* Number of cached inode table blocks */
+#define INODE_LOCKS         (256)               /* Number of inode reader-writer locks (by inode number) */
+#define TABLE_LOCKS         (64)                /* Number of inode table block locks (by block number) */
+#define IOV_BATCH_BLOCKS    (64)                /* Blocks gathered per fs_readv/fs_writev batch */
+#define EXTENTS_PER_INODE   (2)                 /* Number of extents held by an inode */
+#define INDEXES_PER_INODE   (3)                 /* Number of extent tree roots held by an inode */
+#define EXTENTS_PER_BLOCK   ((BLOCK_SIZE - 8) / 12) /* Number of extents per extent tree leaf */
+#define INDEXES_PER_BLOCK   ((BLOCK_SIZE - 8) / 8)  /* Number of entries per extent tree index block */
+#define EXTENT_UNWRITTEN    (1u<<31)            /* Extent length flag: preallocated, never written */
+#define EXTENT_LENGTH(l)    ((l) & ~EXTENT_UNWRITTEN)
+#define INLINE_SLOTS        (3)                 /* Number of inode slots an inline file may borrow */
+#define INLINE_INODE_BYTES  (24)                /* Inline data held by the inode itself */
+#define INLINE_SLOT_BYTES   (28)                /* Inline data held by a borrowed inode slot */
+#define INLINE_MAX          (INLINE_INODE_BYTES + INLINE_SLOTS * INLINE_SLOT_BYTES)
+#define SNAPSHOT_NAME_LENGTH (24)               /* Longest snapshot name (with terminating NUL) */
+#define SNAPSHOTS_PER_BLOCK (BLOCK_SIZE / 32)   /* Number of snapshots in the snapshot directory */
+#define JOURNAL_MAGIC       (0x4a4e4c31)        /* Journal header and descriptor magic number */
+#define JOURNAL_BLOCKS      (256)               /* Number of blocks reserved for the journal */
+#define JOURNAL_ENTRIES     ((BLOCK_SIZE - 16) / 4) /* Number of blocks one transaction may log */
+#define JOURNAL_SLOTS       (2048)              /* Hash slots of a transaction (> 2 * JOURNAL_ENTRIES) */
+#define LOG_SEGMENT_BLOCKS  (64)                /* Number of blocks per log segment (FS_MOUNT_LOG) */
+
+/* Inode Flags (stored in Inode.valid) */
+
+#define INODE_VALID         (1<<0)              /* Inode is in use */
+#define INODE_EXTENTS       (1<<1)              /* Blocks are mapped by extents */
+#define INODE_INDIRECT3     (1<<2)              /* Pointers with double and triple indirect blocks */
+#define INODE_INLINE        (1<<3)              /* Data is stored in the inode and its slots */
+#define INODE_SLOT          (1<<4)              /* Slot holds inline data of another inode */
+#define INODE_DEPTH_SHIFT   (8)
+#define INODE_DEPTH(v)      (((v) >> INODE_DEPTH_SHIFT) & 0xff) /* Extent tree depth */
+#define INODE_SIZE_SHIFT    (16)                /* Bits 16-31 hold bits 32-47 of the size */
+#define INODE_SLOT_SHIFT(k) (8 + 8 * (k))       /* Bits 8-31 of an inline inode link its slots */
+#define INODE_SLOT_LINK(v, k) (((v) >> INODE_SLOT_SHIFT(k)) & 0xff) /* Slot index + 1 (0 if none) */
+
+/* File System Features */
+
+#define FS_FEATURE_GROUPS   (1<<0)              /* Disk is split into block groups */
+#define FS_FEATURE_EXTENTS  (1<<1)              /* New files map blocks with extents */
+#define FS_FEATURE_LARGE_FILES (1<<2)           /* Some files use double/triple indirect blocks */
+#define FS_FEATURE_INLINE_DATA (1<<3)           /* Tiny files keep their data in the inode table */
+#define FS_FEATURE_REFLINK  (1<<4)              /* Cloned or deduplicated files may share data blocks */
+#define FS_FEATURE_SNAPSHOTS (1<<5)            /* SuperBlock points at a snapshot directory */
+#define FS_FEATURE_JOURNAL  (1<<6)              /* Metadata updates go through a write-ahead journal */
+#define FS_FEATURE_ALL      (FS_FEATURE_GROUPS | FS_FEATURE_EXTENTS | FS_FEATURE_LARGE_FILES | \
+                             FS_FEATURE_INLINE_DATA | FS_FEATURE_REFLINK | FS_FEATURE_SNAPSHOTS | \
+                             FS_FEATURE_JOURNAL)
+
+/* Mount Options */
+
+#define FS_MOUNT_DELALLOC   (1<<0)              /* Allocate blocks at writeback */
+#define FS_MOUNT_READONLY   (1<<1)              /* Refuse every change (snapshots are always read-only) */
+#define FS_MOUNT_LOG        (1<<2)              /* Append new and overwritten blocks at the log head */
+#define FS_MOUNT_WRITEBACK  (1<<3)              /* Keep changed inode table blocks cached until sync */
+#define FS_MOUNT_ALL        (FS_MOUNT_DELALLOC | FS_MOUNT_READONLY | FS_MOUNT_LOG | FS_MOUNT_WRITEBACK)
 
 /* File System Structures */
 
@@ -25,38 +90,253 @@ struct SuperBlock {
     uint32_t    blocks;                         /* Number of blocks in file system */
     uint32_t    inode_blocks;                   /* Number of blocks reserved for inodes */
     uint32_t    inodes;                         /* Number of inodes in file system */
+    uint32_t    features;                       /* Format feature flags */
+    uint32_t    groups;                         /* Number of block groups */
+    uint32_t    group_blocks;                   /* Number of blocks per block group */
+    uint32_t    group_inode_blocks;             /* Number of inode blocks per block group */
+    uint32_t    snapshots;                      /* Snapshot directory block (FS_FEATURE_SNAPSHOTS) */
+    uint32_t    journal;                        /* First journal block (FS_FEATURE_JOURNAL) */
+    uint32_t    journal_blocks;                 /* Number of journal blocks */
+};
+
+typedef struct Snapshot   Snapshot;
+struct Snapshot {
+    char        name[SNAPSHOT_NAME_LENGTH];     /* Snapshot name */
+    uint32_t    table;                          /* First block of its Inode table index (0 if unused) */
+    uint32_t    zero;                           /* Block standing in for empty Inode table blocks */
+};
+
+typedef struct JournalBlock JournalBlock;
+struct JournalBlock {
+    uint32_t    magic;                          /* JOURNAL_MAGIC */
+    uint32_t    sequence;                       /* Next transaction (header) or this transaction (descriptor) */
+    uint32_t    count;                          /* Number of logged blocks (descriptor) */
+    uint32_t    checksum;                       /* Checksum of the logged blocks (descriptor) */
+    uint32_t    blocks[JOURNAL_ENTRIES];        /* Home block of each logged block (descriptor) */
+};
+
+typedef struct Extent     Extent;
+struct Extent {
+    uint32_t    logical;                        /* First file block */
+    uint32_t    start;                          /* First disk block */
+    uint32_t    length;                         /* Number of blocks (and EXTENT_UNWRITTEN) */
+};
+
+typedef struct ExtentIndex ExtentIndex;
+struct ExtentIndex {
+    uint32_t    logical;                        /* First file block below this node */
+    uint32_t    block;                          /* Extent tree node */
+};
+
+typedef struct ExtentNode ExtentNode;
+struct ExtentNode {
+    uint32_t    entries;                        /* Number of entries in node */
+    uint32_t    depth;                          /* Height above the leaves (0 for a leaf) */
+    union {
+        Extent      extents[EXTENTS_PER_BLOCK]; /* Leaf entries */
+        ExtentIndex index[INDEXES_PER_BLOCK];   /* Index entries */
+    };
 };
 
 typedef struct Inode      Inode;
 struct Inode {
-    uint32_t    valid;                          /* Whether or not inode is valid */
+    uint32_t    valid;                          /* Whether or not inode is valid (and INODE_* flags) */
     uint32_t    size;                           /* Size of file */
-    uint32_t    direct[POINTERS_PER_INODE];     /* Direct pointers */
-    uint32_t    indirect;                       /* Indirect pointers */
+    union {
+        struct {
+            uint32_t    direct[POINTERS_PER_INODE]; /* Direct pointers */
+            uint32_t    indirect;                   /* Indirect pointers */
+        };
+        struct {
+            uint32_t    direct_large[DIRECT_POINTERS_LARGE]; /* Same as direct[0..2] */
+            uint32_t    double_indirect;            /* Double indirect pointer (INODE_INDIRECT3) */
+            uint32_t    triple_indirect;            /* Triple indirect pointer (INODE_INDIRECT3) */
+        };
+        Extent      extents[EXTENTS_PER_INODE]; /* Extents (INODE_EXTENTS, depth 0) */
+        ExtentIndex index[INDEXES_PER_INODE];   /* Extent tree roots (INODE_EXTENTS, depth > 0) */
+        char        inline_data[INLINE_INODE_BYTES]; /* File data (INODE_INLINE) */
+    };
+};
+
+typedef struct InodeSlot  InodeSlot;
+struct InodeSlot {
+    uint32_t    valid;                          /* INODE_SLOT */
+    char        data[INLINE_SLOT_BYTES];        /* Inline data of the inode linking this slot */
 };
 
 typedef union  Block      Block;
 union Block {
     SuperBlock  super;                          /* View block as superblock */
     Inode       inodes[INODES_PER_BLOCK];       /* View block as inode */
+    InodeSlot   slots[INODES_PER_BLOCK];        /* View block as inline data slots */
     uint32_t    pointers[POINTERS_PER_BLOCK];   /* View block as pointers */
+    ExtentNode  node;                           /* View block as extent tree node */
+    Snapshot    snapshots[SNAPSHOTS_PER_BLOCK]; /* View block as snapshot directory */
+    JournalBlock journal;                       /* View block as journal header or descriptor */
     char        data[BLOCK_SIZE];               /* View block as data */
 };
 
+typedef struct BlockGroup BlockGroup;
+struct BlockGroup {
+    size_t      inode_hint;                     /* No free inode below this number (inode_lock) */
+    size_t      block_hint;                     /* No free data block below this number */
+    size_t      free_count;                     /* Number of free data blocks */
+};
+
 typedef struct FileSystem FileSystem;
+
+typedef struct Arena Arena;
+struct Arena {
+    FileSystem     *fs;                         /* File system the reservation belongs to */
+    pthread_mutex_t lock;                       /* Owner lock (only contended on reclaim) */
+    size_t          group;                      /* Block group the ranges were taken from */
+    size_t          start[ARENA_RANGES];        /* First block of each reserved range */
+    size_t          length[ARENA_RANGES];       /* Number of blocks left in each range */
+    size_t          ranges;                     /* Number of reserved ranges */
+    Arena          *next;                       /* Next arena of the file system */
+};
+
+typedef struct DirtyFile DirtyFile;
+struct DirtyFile {
+    size_t      inode_number;                   /* Inode the buffered data belongs to */
+    size_t      size;                           /* Size of file including buffered data */
+    size_t      first;                          /* First block without a disk block */
+    char      **pages;                          /* Buffered blocks from first on (NULL reads as zeros) */
+    size_t      npages;                         /* Number of buffered block slots */
+    DirtyFile  *next;                           /* Next file with buffered data */
+};
+
+typedef struct PointerCache PointerCache;
+struct PointerCache {
+    uint32_t    block;                          /* Cached indirect block (0 if empty) */
+    Block       data;                           /* Contents of the block */
+};
+
+typedef struct InodeCache InodeCache;
+struct InodeCache {
+    uint32_t    block;                          /* Cached inode table block (0 if empty) */
+    bool        dirty;                          /* Whether or not the block must be written back */
+    Block       data;                           /* Contents of the block */
+};
+
+typedef struct Transaction Transaction;
+struct Transaction {
+    Block      *blocks;                         /* Descriptor followed by the logged block images */
+    uint32_t   *slots;                          /* Hash of home block to image position + 1 */
+    size_t      count;                          /* Number of logged blocks */
+    uint32_t   *frees;                          /* Blocks freed by the transaction (released after commit) */
+    size_t      nfrees;                         /* Number of freed blocks */
+    size_t      free_capacity;                  /* Number of freed blocks allocated */
+};
+
+typedef struct DedupEntry DedupEntry;
+struct DedupEntry {
+    uint64_t    hash;                           /* Hash of the block contents */
+    uint32_t    block;                          /* Block holding the contents (0 if empty) */
+};
+
+typedef struct FileMap FileMap;
+struct FileMap {
+    FileSystem *fs;                             /* File system the file lives on */
+    Inode      *inode;                          /* Inode being mapped */
+    size_t      group;                          /* Block group for new metadata blocks */
+    Block       indirect;                       /* Indirect block (pointer mapped inodes) */
+    bool        indirect_loaded;                /* Whether or not indirect holds the block */
+    bool        indirect_dirty;                 /* Whether or not indirect must be written */
+    Block      *path;                           /* Cached double/triple indirect path (by height) */
+    uint32_t    path_block[3];                  /* Block held by each path level */
+    bool        path_dirty[3];                  /* Whether or not a path level must be written */
+    Extent     *extents;                        /* Sorted extents (extent mapped inodes) */
+    size_t      nextents;                       /* Number of extents */
+    size_t      capacity;                       /* Number of extents allocated */
+    size_t      dirty_from;                     /* First extent changed since loading */
+    uint32_t   *nodes;                          /* Extent tree blocks (leaves first) */
+    size_t      nnodes;                         /* Number of extent tree blocks */
+};
+
 struct FileSystem {
     Disk        *disk;                          /* Disk file system is mounted on */
     bool        *free_blocks;                   /* Free block bitmap */
+    bool        *free_inodes;                   /* Free inode bitmap */
+    uint32_t    *block_shares;                  /* Extra references to shared data blocks (NULL until cloned) */
+    BlockGroup  *groups;                        /* Per block group allocation state */
+    size_t       group_rotor;                   /* Next block group for new files */
+    pthread_mutex_t alloc_lock;                 /* Protects free blocks bitmap and groups */
+    pthread_mutex_t inode_lock;                 /* Protects free inodes bitmap and inode hints */
+    pthread_mutex_t super_lock;                 /* Serializes SuperBlock and snapshot directory updates */
+    pthread_mutex_t *table_locks;               /* Serialize inode block read-modify-write */
+    pthread_rwlock_t *inode_locks;              /* Shared by readers, exclusive for changes of a file */
+    size_t         *inode_generations;          /* Exclusive locks taken of each inode lock */
+    pthread_key_t   arena_key;                  /* Per-thread allocation arena */
+    pthread_mutex_t arena_lock;                 /* Protects arenas list */
+    Arena          *arenas;                     /* All arenas of the file system */
+    size_t          writers;                    /* Number of fs_write calls in progress */
+    size_t          log_head;                   /* Next block to append at (FS_MOUNT_LOG) */
     SuperBlock   meta_data;                     /* File system meta data */
+    uint32_t     options;                       /* FS_MOUNT_* flags */
+    uint32_t    *snapshot_table;                /* Inode table blocks of a mounted snapshot (NULL if live) */
+
+    pthread_mutex_t pointer_lock;               /* Protects pointer cache */
+    PointerCache   *pointer_cache;              /* Direct mapped cache of indirect blocks */
+
+    pthread_mutex_t inode_cache_lock;           /* Protects inode cache */
+    InodeCache     *inode_cache;                /* Direct mapped write-back cache of inode table blocks */
+
+    pthread_mutex_t dirty_lock;                 /* Protects the dirty list and dirty_blocks */
+    DirtyFile      *dirty;                      /* Files with buffered data */
+    size_t          dirty_blocks;               /* Number of buffered blocks */
+
+    pthread_mutex_t journal_lock;               /* Protects transactions */
+    pthread_cond_t  journal_cond;               /* Signaled when a commit finishes */
+    Transaction    *running;                    /* Transaction collecting updates (NULL without journal) */
+    Transaction    *committing;                 /* Transaction being committed (empty if none) */
+    bool            journal_busy;               /* Whether or not a commit is in progress */
+    size_t          handles;                    /* Number of operations updating metadata */
+    uint32_t        sequence;                   /* Sequence number of the next commit */
+
+    pthread_mutex_t sync_lock;                  /* Protects disk flush state */
+    pthread_cond_t  sync_cond;                  /* Signaled when a disk flush finishes */
+    bool            sync_busy;                  /* Whether or not a disk flush is in progress */
+    size_t          sync_requested;             /* Number of disk flushes asked for */
+    size_t          sync_done;                  /* Requests covered by finished disk flushes */
+
+    pthread_t       scanner;                    /* Background bitmap scanner */
+    bool            scanner_running;            /* Whether or not the scanner thread was started */
+    pthread_mutex_t scan_lock;                  /* Protects scan progress */
+    pthread_cond_t  scan_cond;                  /* Signaled as scan progresses */
+    size_t          scanned;                    /* Number of inode blocks scanned */
+    bool            scan_cancel;                /* Ask scanner to stop early */
+};
+
+typedef struct File File;
+struct File {
+    FileSystem *fs;                             /* File system the file lives on */
+    size_t      inode_number;                   /* Inode of the open file */
+    Inode       inode;                          /* Pinned copy of the Inode */
+    FileMap     map;                            /* Pinned block map of the Inode */
+    size_t      generation;                     /* Generation of its inode lock the copies match */
+};
+
+typedef struct FileView FileView;
+struct FileView {
+    struct iovec *iov;                          /* Read-only views of the range, in file order */
+    size_t        iovcnt;                       /* Number of views */
+    char         *blocks;                       /* Block buffer the views point into */
 };
 
 /* File System Functions */
 
 void    fs_debug(Disk *disk);
 bool    fs_format(FileSystem *fs, Disk *disk);
+bool    fs_format_features(FileSystem *fs, Disk *disk, uint32_t features);
 
 bool    fs_mount(FileSystem *fs, Disk *disk);
+bool    fs_mount_options(FileSystem *fs, Disk *disk, uint32_t options);
+bool    fs_mount_snapshot(FileSystem *fs, Disk *disk, const char *name);
 void    fs_unmount(FileSystem *fs);
+void    fs_wait_ready(FileSystem *fs);
+bool    fs_sync(FileSystem *fs);
+bool    fs_fsync(FileSystem *fs, size_t inode_number, bool data_only);
 
 ssize_t fs_create(FileSystem *fs);
 bool    fs_remove(FileSystem *fs, size_t inode_number);
@@ -64,6 +344,24 @@ ssize_t fs_stat(FileSystem *fs, size_t inode_number);
 
 ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
 ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
+bool    fs_fallocate(FileSystem *fs, size_t inode_number, size_t offset, size_t length);
+bool    fs_truncate(FileSystem *fs, size_t inode_number, size_t size);
+ssize_t fs_clone(FileSystem *fs, size_t inode_number);
+ssize_t fs_copy_range(FileSystem *fs, size_t src_inode, size_t src_offset, size_t dst_inode, size_t dst_offset,
+                      size_t length);
+ssize_t fs_dedup(FileSystem *fs);
+ssize_t fs_clean(FileSystem *fs);
+bool    fs_snapshot(FileSystem *fs, const char *name);
+bool    fs_delete_snapshot(FileSystem *fs, const char *name);
+ssize_t fs_readv(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt, size_t offset);
+ssize_t fs_writev(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt, size_t offset);
+
+File *  fs_open(FileSystem *fs, size_t inode_number);
+bool    fs_close(File *file);
+ssize_t fs_pread(File *file, char *data, size_t length, size_t offset);
+ssize_t fs_pwrite(File *file, char *data, size_t length, size_t offset);
+ssize_t fs_read_view(File *file, size_t length, size_t offset, FileView *view);
+void    fs_release_view(FileView *view);
 
 #endif
 
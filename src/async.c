@@ -0,0 +1,390 @@
+/* async.c: SimpleFS asynchronous requests */
+
+#include "sfs/async.h"
+#include "sfs/logging.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Internal Prototyes */
+
+static AsyncRequest *async_submit(AsyncQueue *queue, int type, size_t inode_number, char *data, size_t length,
+                                  size_t offset, AsyncCallback callback, void *arg);
+static AsyncRequest *async_next(AsyncQueue *queue);
+static void          async_run(AsyncRequest *request);
+static void *        async_worker(void *arg);
+
+/* External Functions */
+
+/**
+ * Start a worker pool that runs requests on the FileSystem by doing the
+ * following:
+ *
+ *  1. Allocate AsyncQueue structure and the completion event descriptor.
+ *
+ *  2. Start the worker threads (at least one, ASYNC_WORKERS if 0).
+ *
+ * Note: The FileSystem must stay mounted until async_close returns.
+ *
+ * @param       fs          Pointer to mounted FileSystem structure.
+ * @param       workers     Number of worker threads.
+ *
+ * @return      Pointer to AsyncQueue structure (NULL on failure).
+ **/
+AsyncQueue *async_open(FileSystem *fs, size_t workers) {
+    if (!fs || !fs->disk)
+        return NULL;
+
+    AsyncQueue *queue = (AsyncQueue *)calloc(1, sizeof(AsyncQueue));
+    if (!queue)
+        return NULL;
+
+    queue->fs             = fs;
+    queue->nworkers       = workers ? workers : ASYNC_WORKERS;
+    queue->completed_tail = &queue->completed;
+    queue->workers        = (AsyncWorker *)calloc(queue->nworkers, sizeof(AsyncWorker));
+    queue->event_fd       = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+    if (!queue->workers || queue->event_fd < 0)
+    {
+        debug("Fail to allocate async queue\n");
+        if (queue->event_fd >= 0)
+            close(queue->event_fd);
+        free(queue->workers);
+        free(queue);
+        return NULL;
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->work_cond, NULL);
+    pthread_cond_init(&queue->done_cond, NULL);
+
+    for (size_t w = 0; w < queue->nworkers; ++w)
+    {
+        queue->workers[w].queue        = queue;
+        queue->workers[w].inode_number = -1;
+    }
+
+    size_t started = 0;
+    while (started < queue->nworkers &&
+           pthread_create(&queue->workers[started].thread, NULL, async_worker, &queue->workers[started]) == 0)
+        ++started;
+
+    // 一个线程都起不来就没法运行请求
+    pthread_mutex_lock(&queue->lock);
+    queue->nworkers = started;
+    pthread_mutex_unlock(&queue->lock);
+    if (!started)
+    {
+        debug("Fail to start async workers\n");
+        async_close(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+/**
+ * Stop the worker pool by doing the following:
+ *
+ *  1. Let the workers run every submitted request, then join them.
+ *
+ *  2. Release the completed requests nobody polled and the queue itself.
+ *
+ * @param       queue       Pointer to AsyncQueue structure.
+ **/
+void    async_close(AsyncQueue *queue) {
+    if (!queue)
+        return;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->stop = true;
+    pthread_cond_broadcast(&queue->work_cond);
+    pthread_mutex_unlock(&queue->lock);
+
+    for (size_t w = 0; w < queue->nworkers; ++w)
+        pthread_join(queue->workers[w].thread, NULL);
+
+    while (queue->completed)
+    {
+        AsyncRequest *request = queue->completed;
+        queue->completed      = request->next;
+        free(request);
+    }
+
+    pthread_cond_destroy(&queue->done_cond);
+    pthread_cond_destroy(&queue->work_cond);
+    pthread_mutex_destroy(&queue->lock);
+    close(queue->event_fd);
+    free(queue->workers);
+    free(queue);
+}
+
+/**
+ * Submit a non-blocking fs_read of the specified Inode.
+ *
+ * Note: Requests on the same Inode run one at a time in submission order;
+ * data must stay valid until the request completes.
+ *
+ * @param       queue           Pointer to AsyncQueue structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read.
+ * @param       offset          Byte offset from which to begin reading.
+ * @param       callback        Called on a worker thread when the request
+ *                              completes (NULL to queue it for async_poll).
+ * @param       arg             Argument passed to callback.
+ *
+ * @return      Request handle (NULL on failure).
+ **/
+AsyncRequest *async_read(AsyncQueue *queue, size_t inode_number, char *data, size_t length, size_t offset,
+                         AsyncCallback callback, void *arg) {
+    return async_submit(queue, ASYNC_READ, inode_number, data, length, offset, callback, arg);
+}
+
+/**
+ * Submit a non-blocking fs_write to the specified Inode (see async_read).
+ *
+ * @return      Request handle (NULL on failure).
+ **/
+AsyncRequest *async_write(AsyncQueue *queue, size_t inode_number, char *data, size_t length, size_t offset,
+                          AsyncCallback callback, void *arg) {
+    return async_submit(queue, ASYNC_WRITE, inode_number, data, length, offset, callback, arg);
+}
+
+/**
+ * Submit a non-blocking fs_create; the request result is the new Inode
+ * number (-1 on failure).
+ *
+ * @return      Request handle (NULL on failure).
+ **/
+AsyncRequest *async_create(AsyncQueue *queue, AsyncCallback callback, void *arg) {
+    return async_submit(queue, ASYNC_CREATE, 0, NULL, 0, 0, callback, arg);
+}
+
+/**
+ * Submit a non-blocking fs_remove; the request result is 1 if the Inode was
+ * removed and 0 otherwise.
+ *
+ * @return      Request handle (NULL on failure).
+ **/
+AsyncRequest *async_remove(AsyncQueue *queue, size_t inode_number, AsyncCallback callback, void *arg) {
+    return async_submit(queue, ASYNC_REMOVE, inode_number, NULL, 0, 0, callback, arg);
+}
+
+/**
+ * Return a descriptor that polls readable while completed requests wait in
+ * the completion queue, for use with poll/epoll in an event loop.
+ *
+ * @param       queue       Pointer to AsyncQueue structure.
+ *
+ * @return      Event descriptor (owned by the queue).
+ **/
+int     async_fd(AsyncQueue *queue) {
+    return queue ? queue->event_fd : -1;
+}
+
+/**
+ * Take the oldest request from the completion queue by doing the following:
+ *
+ *  1. If wait is set, block until a request completes (or none of the
+ *  submitted requests is left to complete).
+ *
+ *  2. Unlink the request and consume its event on the event descriptor.
+ *
+ * Note: Requests submitted with a callback never reach the completion queue.
+ *
+ * @param       queue       Pointer to AsyncQueue structure.
+ * @param       wait        Whether or not to block for a completion.
+ *
+ * @return      Completed request, to be freed with async_release (NULL if
+ *              there is none).
+ **/
+AsyncRequest *async_poll(AsyncQueue *queue, bool wait) {
+    if (!queue)
+        return NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (wait && !queue->completed && queue->inflight)
+        pthread_cond_wait(&queue->done_cond, &queue->lock);
+
+    AsyncRequest *request = queue->completed;
+    if (request)
+    {
+        queue->completed = request->next;
+        if (!queue->completed)
+            queue->completed_tail = &queue->completed;
+
+        uint64_t value;
+        if (read(queue->event_fd, &value, sizeof(value)) != sizeof(value))
+            debug("Fail to consume async completion event\n");
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return request;
+}
+
+/**
+ * Free a request taken from the completion queue.
+ *
+ * @param       request     Pointer to AsyncRequest structure.
+ **/
+void    async_release(AsyncRequest *request) {
+    free(request);
+}
+
+/* Internal Functions */
+
+/**
+ * Allocate a request and append it to the pending queue.
+ **/
+static AsyncRequest *async_submit(AsyncQueue *queue, int type, size_t inode_number, char *data, size_t length,
+                                  size_t offset, AsyncCallback callback, void *arg)
+{
+    if (!queue)
+        return NULL;
+
+    AsyncRequest *request = (AsyncRequest *)calloc(1, sizeof(AsyncRequest));
+    if (!request)
+        return NULL;
+
+    request->queue        = queue;
+    request->type         = type;
+    request->inode_number = inode_number;
+    request->data         = data;
+    request->length       = length;
+    request->offset       = offset;
+    request->result       = -1;
+    request->callback     = callback;
+    request->arg          = arg;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->stop)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        free(request);
+        return NULL;
+    }
+
+    AsyncRequest **tail = &queue->pending;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = request;
+    ++queue->inflight;
+    pthread_cond_signal(&queue->work_cond);
+    pthread_mutex_unlock(&queue->lock);
+    return request;
+}
+
+/**
+ * Unlink the oldest pending request whose Inode no worker is running and
+ * no earlier request is waiting for, so requests on one Inode keep their
+ * submission order.
+ *
+ * Note: The caller must hold the queue lock.
+ **/
+static AsyncRequest *async_next(AsyncQueue *queue)
+{
+    for (AsyncRequest **r = &queue->pending; *r; r = &(*r)->next)
+    {
+        AsyncRequest *request = *r;
+        bool          blocked = false;
+
+        // 同一个inode上的请求按提交顺序一个一个做
+        if (request->type != ASYNC_CREATE)
+        {
+            for (size_t w = 0; w < queue->nworkers && !blocked; ++w)
+                blocked = queue->workers[w].inode_number == (ssize_t)request->inode_number;
+            for (AsyncRequest *p = queue->pending; p != request && !blocked; p = p->next)
+                blocked = p->type != ASYNC_CREATE && p->inode_number == request->inode_number;
+        }
+
+        if (!blocked)
+        {
+            *r = request->next;
+            request->next = NULL;
+            return request;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run the blocking call of a request.
+ **/
+static void    async_run(AsyncRequest *request)
+{
+    FileSystem *fs = request->queue->fs;
+
+    switch (request->type)
+    {
+        case ASYNC_READ:
+            request->result = fs_read(fs, request->inode_number, request->data, request->length, request->offset);
+            break;
+        case ASYNC_WRITE:
+            request->result = fs_write(fs, request->inode_number, request->data, request->length, request->offset);
+            break;
+        case ASYNC_CREATE:
+            request->result = fs_create(fs);
+            break;
+        case ASYNC_REMOVE:
+            request->result = fs_remove(fs, request->inode_number);
+            break;
+    }
+}
+
+/**
+ * Worker thread: run pending requests until the queue is closed and empty,
+ * then hand each one to its callback or the completion queue.
+ **/
+static void *  async_worker(void *arg)
+{
+    AsyncWorker *worker = (AsyncWorker *)arg;
+    AsyncQueue  *queue  = worker->queue;
+
+    pthread_mutex_lock(&queue->lock);
+    while (true)
+    {
+        AsyncRequest *request = async_next(queue);
+        if (!request)
+        {
+            if (queue->stop && !queue->pending)
+                break;
+            pthread_cond_wait(&queue->work_cond, &queue->lock);
+            continue;
+        }
+
+        worker->inode_number = request->type == ASYNC_CREATE ? -1 : (ssize_t)request->inode_number;
+        pthread_mutex_unlock(&queue->lock);
+
+        async_run(request);
+
+        pthread_mutex_lock(&queue->lock);
+        worker->inode_number = -1;
+        if (request->callback)
+        {
+            // 回调里可以提交新请求, 不能拿着锁
+            pthread_mutex_unlock(&queue->lock);
+            request->callback(request, request->arg);
+            free(request);
+            pthread_mutex_lock(&queue->lock);
+        }
+        else
+        {
+            *queue->completed_tail = request;
+            queue->completed_tail  = &request->next;
+
+            uint64_t one = 1;
+            if (write(queue->event_fd, &one, sizeof(one)) != sizeof(one))
+                debug("Fail to signal async completion event\n");
+        }
+        --queue->inflight;
+
+        // 后面同一个inode的请求现在可以运行了
+        pthread_cond_broadcast(&queue->work_cond);
+        pthread_cond_broadcast(&queue->done_cond);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,5 +1,7 @@
 /* disk.c: SimpleFS disk emulator */
 
+#define _GNU_SOURCE
+
 #include "sfs/disk.h"
 #include "sfs/logging.h"
 
@@ -54,7 +56,7 @@ Disk *	disk_open(const char *path, size_t blocks) {
         }
 
         disk->blocks = blocks;
-        disk->reads = disk->writes = 0;
+        disk->reads = disk->writes = disk->syncs = 0;
     }
 
     return disk;
@@ -88,9 +90,10 @@ void	disk_close(Disk *disk) {
  *
  *  1. Perform sanity check.
  *
- *  2. Seek to specified block.
+ *  2. Read from block offset to data buffer (must be BLOCK_SIZE).
  *
- *  3. Read from block to data buffer (must be BLOCK_SIZE).
+ * Note: pread is used so that several threads may share the same Disk
+ * without racing on the file offset.
  *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
@@ -102,17 +105,12 @@ void	disk_close(Disk *disk) {
 ssize_t disk_read(Disk *disk, size_t block, char *data) {
     if (disk_sanity_check(disk, block, data))
     {
-        ++disk->reads;
+        __sync_fetch_and_add(&disk->reads, 1);
         ssize_t x;
 
-        if ((x = lseek(disk->fd, block * BLOCK_SIZE, SEEK_SET)) != block * BLOCK_SIZE)
-        {
-            debug("It should return %d but return %d\n", block * BLOCK_SIZE, x);
-            perror("Fail to read block: ");
-        }
-        if ((x = read(disk->fd, data, BLOCK_SIZE)) != BLOCK_SIZE)
+        if ((x = pread(disk->fd, data, BLOCK_SIZE, block * BLOCK_SIZE)) != BLOCK_SIZE)
         {
-            debug("It should return BLOCK_SIZE but return %d\n", x);
+            debug("It should return BLOCK_SIZE but return %ld\n", x);
             perror("Fail to read block: ");
         }
         return BLOCK_SIZE;
@@ -127,9 +125,7 @@ ssize_t disk_read(Disk *disk, size_t block, char *data) {
  *
  *  1. Perform sanity check.
  *
- *  2. Seek to specified block.
- *
- *  3. Write data buffer (must be BLOCK_SIZE) to disk block.
+ *  2. Write data buffer (must be BLOCK_SIZE) to block offset.
  *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
@@ -141,26 +137,179 @@ ssize_t disk_read(Disk *disk, size_t block, char *data) {
 ssize_t disk_write(Disk *disk, size_t block, char *data) {
     if (disk_sanity_check(disk, block, data))
     {
-        ++disk->writes;
-        off_t x;
-        if ((x = lseek(disk->fd, block * BLOCK_SIZE, SEEK_SET)) != block * BLOCK_SIZE)
+        __sync_fetch_and_add(&disk->writes, 1);
+        ssize_t x;
+        if ((x = pwrite(disk->fd, data, BLOCK_SIZE, block * BLOCK_SIZE)) != BLOCK_SIZE)
         {
-            debug("lseek should return %d but it return %d\n", block * BLOCK_SIZE, x);
-            perror("Fail to seek: ");
+            debug("write should return %d but it return %ld\n",  BLOCK_SIZE, x);
+            perror("Fail to write: ");
             exit(1);
         }
-        if ((x = write(disk->fd, data, BLOCK_SIZE)) != BLOCK_SIZE)
+        return BLOCK_SIZE;
+    }
+    else
+        return DISK_FAILURE;
+}
+
+/**
+ * Read count consecutive blocks from disk starting at the specified block
+ * into data buffer with a single request by doing the following:
+ *
+ *  1. Perform sanity check on the first and last block.
+ *
+ *  2. Read from block offset to data buffer (must be count * BLOCK_SIZE).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number to perform operation on.
+ * @param       count       Number of blocks to read.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes read.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_read_blocks(Disk *disk, size_t block, size_t count, char *data) {
+    if (count && disk_sanity_check(disk, block, data) && disk_sanity_check(disk, block + count - 1, data))
+    {
+        __sync_fetch_and_add(&disk->reads, 1);
+        ssize_t x;
+
+        if ((x = pread(disk->fd, data, count * BLOCK_SIZE, block * BLOCK_SIZE)) != (ssize_t)(count * BLOCK_SIZE))
         {
-            debug("write should return %d but it return %d\n",  BLOCK_SIZE, x);
-            perror("Fail to write: ");
+            debug("It should return %lu but return %ld\n", count * BLOCK_SIZE, x);
+            perror("Fail to read blocks: ");
+        }
+        return count * BLOCK_SIZE;
+    }
+    else
+        return DISK_FAILURE;
+}
+
+/**
+ * Write count consecutive blocks to disk starting at the specified block
+ * from data buffer with a single request by doing the following:
+ *
+ *  1. Perform sanity check on the first and last block.
+ *
+ *  2. Write data buffer (must be count * BLOCK_SIZE) to block offset.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block number to perform operation on.
+ * @param       count       Number of blocks to write.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes written.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_write_blocks(Disk *disk, size_t block, size_t count, char *data) {
+    if (count && disk_sanity_check(disk, block, data) && disk_sanity_check(disk, block + count - 1, data))
+    {
+        __sync_fetch_and_add(&disk->writes, 1);
+        ssize_t x;
+
+        if ((x = pwrite(disk->fd, data, count * BLOCK_SIZE, block * BLOCK_SIZE)) != (ssize_t)(count * BLOCK_SIZE))
+        {
+            debug("write should return %lu but it return %ld\n", count * BLOCK_SIZE, x);
+            perror("Fail to write blocks: ");
             exit(1);
         }
-        return BLOCK_SIZE;
+        return count * BLOCK_SIZE;
     }
     else
         return DISK_FAILURE;
 }
 
+/**
+ * Copy count consecutive blocks starting at block src to the blocks starting
+ * at block dst without passing them through a caller buffer by doing the
+ * following:
+ *
+ *  1. Perform sanity check on the first and last block of both ranges.
+ *
+ *  2. Let the kernel copy the range inside the image file
+ *  (copy_file_range), falling back to pread/pwrite through a bounce buffer
+ *  where it is not supported.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       src         First block number to copy from.
+ * @param       dst         First block number to copy to.
+ * @param       count       Number of blocks to copy.
+ *
+ * @return      Number of bytes copied.
+ *              (count * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_copy_blocks(Disk *disk, size_t src, size_t dst, size_t count) {
+    const char *check = "";
+    if (!count || !disk_sanity_check(disk, src, check) || !disk_sanity_check(disk, src + count - 1, check) ||
+        !disk_sanity_check(disk, dst, check) || !disk_sanity_check(disk, dst + count - 1, check))
+        return DISK_FAILURE;
+
+    __sync_fetch_and_add(&disk->reads, 1);
+    __sync_fetch_and_add(&disk->writes, 1);
+
+    loff_t  in     = src * BLOCK_SIZE;
+    loff_t  out    = dst * BLOCK_SIZE;
+    size_t  copied = 0;
+    ssize_t x;
+
+    while (copied < count * BLOCK_SIZE &&
+           (x = copy_file_range(disk->fd, &in, disk->fd, &out, count * BLOCK_SIZE - copied, 0)) > 0)
+        copied += x;
+
+    // 内核不支持时用buffer复制
+    if (copied < count * BLOCK_SIZE)
+    {
+        size_t left   = count * BLOCK_SIZE - copied;
+        size_t batch  = left < 64 * BLOCK_SIZE ? left : 64 * BLOCK_SIZE;
+        char  *buffer = (char *)malloc(batch);
+        while (buffer && copied < count * BLOCK_SIZE)
+        {
+            size_t n = count * BLOCK_SIZE - copied < batch ? count * BLOCK_SIZE - copied : batch;
+            if (pread(disk->fd, buffer, n, src * BLOCK_SIZE + copied) != (ssize_t)n ||
+                pwrite(disk->fd, buffer, n, dst * BLOCK_SIZE + copied) != (ssize_t)n)
+                break;
+            copied += n;
+        }
+        free(buffer);
+    }
+
+    if (copied < count * BLOCK_SIZE)
+    {
+        debug("copy should return %lu but it return %lu\n", count * BLOCK_SIZE, copied);
+        perror("Fail to copy blocks: ");
+        exit(1);
+    }
+    return count * BLOCK_SIZE;
+}
+
+/**
+ * Flush the data written to the disk image to stable storage by doing the
+ * following:
+ *
+ *  1. Check for valid disk.
+ *
+ *  2. Wait for the kernel to write back the image data (fdatasync; the
+ *  image size never changes after disk_open).
+ *
+ * Note: Writes issued before the call are durable when it returns; writes
+ * racing with it may or may not be.
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Whether or not the flush succeeded.
+ **/
+bool    disk_sync(Disk *disk) {
+    if (!disk || disk->fd < 0)
+        return false;
+
+    __sync_fetch_and_add(&disk->syncs, 1);
+    if (fdatasync(disk->fd) == -1)
+    {
+        perror("Fail to sync disk: ");
+        return false;
+    }
+    return true;
+}
+
 /* Internal Functions */
 
 /**
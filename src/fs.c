@@ -8,13 +8,173 @@
 #include <string.h>
 #include <assert.h>
 
+/* Internal Constants */
+static const char ZERO_BLOCK[BLOCK_SIZE];      /* Shared by every view of a hole */
+
 /* Internal Functions */
+static void    fs_group_geometry(SuperBlock *sb);
+static uint32_t fs_features(const SuperBlock *sb);
+static size_t  fs_group_count(const SuperBlock *sb);
+static size_t  fs_group_inode_blocks(const SuperBlock *sb);
+static size_t  fs_group_data_start(const SuperBlock *sb, size_t group);
+static size_t  fs_group_data_end(const SuperBlock *sb, size_t group);
+static size_t  fs_inode_group(const SuperBlock *sb, size_t inode_number);
+static size_t  fs_block_group(const SuperBlock *sb, size_t block_number);
+static size_t  fs_inode_table_block(const SuperBlock *sb, size_t index);
+static size_t  fs_table_block(FileSystem *fs, size_t index);
 static bool    fs_load_inode(FileSystem *fs, size_t inode_number, Inode *node);
+static bool    fs_load_inode_block(FileSystem *fs, size_t inode_number, Block *block);
 static bool    fs_save_inode(FileSystem *fs, size_t inode_number, Inode *node);
+static pthread_mutex_t *fs_table_lock(FileSystem *fs, size_t inode_number);
+static void    fs_lock_inode(FileSystem *fs, size_t inode_number, bool write);
+static void    fs_unlock_inode(FileSystem *fs, size_t inode_number);
+static void    fs_lock_pair(FileSystem *fs, size_t src_inode, size_t dst_inode);
+static void    fs_unlock_pair(FileSystem *fs, size_t src_inode, size_t dst_inode);
+static void    fs_lock_pair_flushed(FileSystem *fs, size_t src_inode, size_t dst_inode);
+static void    fs_lock_inode_block(FileSystem *fs, size_t block_index);
+static void    fs_unlock_inode_block(FileSystem *fs, size_t block_index);
+static void    fs_lock_all(FileSystem *fs);
+static void    fs_unlock_all(FileSystem *fs);
+static ssize_t fs_read_inode(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
+static ssize_t fs_write_inode(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
 static void    fs_initialize_free_block_bitmap(FileSystem *fs);
-static ssize_t fs_allocate_free_block(FileSystem *fs);
+static void *  fs_scan_inode_table(void *arg);
+static void    fs_scan_pointer_tree(FileSystem *fs, uint32_t block_number, size_t height);
+static void    fs_scan_mark(FileSystem *fs, size_t start, size_t count);
+static void    fs_wait_scanned(FileSystem *fs, size_t inode_blocks);
+static ssize_t fs_pool_allocate(FileSystem *fs, size_t group);
+static void    fs_pool_release(FileSystem *fs, size_t block_number);
+static ssize_t fs_arena_allocate(FileSystem *fs, size_t group);
+static void    fs_arena_refill(FileSystem *fs, Arena *arena, size_t group);
+static bool    fs_arena_return(FileSystem *fs, Arena *arena);
+static void    fs_arena_destroy(void *arg);
+static bool    fs_arenas_reclaim(FileSystem *fs);
+static void    fs_writer_enter(FileSystem *fs);
+static void    fs_writer_exit(FileSystem *fs);
+static ssize_t fs_allocate_free_block(FileSystem *fs, size_t group);
+static size_t  fs_allocate_free_run(FileSystem *fs, size_t group, size_t wanted, size_t *start);
+static ssize_t fs_read_block(FileSystem *fs, uint32_t pointer, char *data);
 static void fs_release_free_block(FileSystem *fs, size_t block_number);
-static void fs_expand_file(FileSystem * fs, Inode * node, size_t new_size);
+static void fs_release_free_run(FileSystem *fs, size_t start, size_t count);
+static void fs_release_collect(FileSystem *fs, size_t *start, size_t *count, size_t block_number);
+static void fs_expand_file(FileSystem * fs, FileMap * map, size_t offset, size_t end);
+static ssize_t fs_read_mapped(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
+static ssize_t fs_write_mapped(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
+static DirtyFile *fs_delalloc_find(FileSystem *fs, size_t inode_number);
+static void    fs_delalloc_discard(FileSystem *fs, DirtyFile *df);
+static bool    fs_delalloc_flush(FileSystem *fs, DirtyFile *df);
+static bool    fs_delalloc_flush_all(FileSystem *fs);
+static bool    fs_delalloc_sync(FileSystem *fs);
+static void    fs_delalloc_reclaim(FileSystem *fs, size_t held);
+static ssize_t fs_delalloc_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
+static ssize_t fs_delalloc_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
+static size_t  fs_inode_max_blocks(const Inode *inode);
+static bool    fs_map_open(FileSystem *fs, FileMap *map, Inode *inode, size_t group);
+static bool    fs_map_close(FileMap *map);
+static bool    fs_map_flush(FileMap *map);
+static ssize_t fs_map_read(FileMap *map, char *data, size_t length, size_t offset);
+static ssize_t fs_map_write(FileMap *map, char *data, size_t length, size_t offset);
+static bool    fs_map_load_indirect(FileMap *map);
+static uint32_t fs_map_get(FileMap *map, size_t index, size_t *run);
+static uint32_t fs_map_pointer(FileMap *map, size_t index);
+static bool    fs_map_reserve(FileMap *map, size_t index);
+static bool    fs_map_set(FileMap *map, size_t index, uint32_t pointer, size_t count);
+static void    fs_map_release(FileMap *map, size_t from);
+static size_t  fs_map_unshare(FileMap *map, size_t offset, size_t end);
+static bool    fs_map_zero_tail(FileMap *map, size_t size);
+static void    fs_map_free(FileMap *map);
+static void    fs_inline_gather(const Block *block, const Inode *inode, char *data);
+static void    fs_inline_scatter(Block *block, Inode *inode, const char *data);
+static bool    fs_inline_reserve(FileSystem *fs, Block *block, size_t inode_number, size_t size);
+static void    fs_inline_release(FileSystem *fs, Block *block, size_t inode_number);
+static bool    fs_inline_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset,
+                               ssize_t *result);
+static bool    fs_inline_truncate(FileSystem *fs, size_t inode_number, size_t size, bool *result);
+static bool    fs_inline_convert(FileSystem *fs, size_t inode_number);
+static bool    fs_inline_remove(FileSystem *fs, size_t inode_number);
+static bool    fs_file_load(File *file);
+static bool    fs_file_refresh(File *file, bool write);
+static void    fs_view_append(FileView *view, char *base, size_t length);
+static ssize_t fs_iov_transfer(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt,
+                               size_t offset, bool write);
+static void    fs_iov_copy(const struct iovec *iov, int iovcnt, size_t skip, char *buffer, size_t length,
+                           bool gather);
+static ssize_t fs_copy_buffered(FileSystem *fs, size_t src_inode, size_t src_offset, size_t dst_inode,
+                                size_t dst_offset, size_t length);
+static size_t  fs_map_copy(FileMap *from, size_t src_offset, FileMap *to, size_t dst_offset, size_t length);
+static size_t  fs_inode_size(const Inode *inode);
+static void    fs_inode_set_size(Inode *inode, size_t size);
+static size_t  fs_inode_direct(const Inode *inode);
+static bool    fs_read_pointers(FileSystem *fs, uint32_t block_number, Block *block);
+static bool    fs_write_pointers(FileSystem *fs, uint32_t block_number, Block *block);
+static void    fs_forget_pointers(FileSystem *fs, size_t start, size_t count);
+static InodeCache *fs_table_entry(FileSystem *fs, uint32_t block_number);
+static bool    fs_read_table(FileSystem *fs, uint32_t block_number, Block *block);
+static bool    fs_read_table_range(FileSystem *fs, uint32_t block_number, size_t offset, char *data, size_t length);
+static bool    fs_write_table(FileSystem *fs, uint32_t block_number, Block *block);
+static int     fs_table_compare(const void *a, const void *b);
+static bool    fs_flush_table(FileSystem *fs);
+static bool    fs_flush_table_block(FileSystem *fs, uint32_t block_number);
+static bool    fs_disk_sync(FileSystem *fs);
+static bool    fs_map_path_flush(FileMap *map);
+static Block * fs_map_path_load(FileMap *map, size_t level, uint32_t block_number, bool fresh);
+static uint32_t *fs_map_tree_slot(FileMap *map, size_t index, bool allocate);
+static bool    fs_map_upgrade(FileMap *map);
+static bool    fs_add_feature(FileSystem *fs, uint32_t feature);
+static bool    fs_write_super(FileSystem *fs);
+static bool    fs_remove_inode(FileSystem *fs, size_t inode_number);
+static bool    fs_fallocate_range(FileSystem *fs, size_t inode_number, size_t offset, size_t length);
+static bool    fs_truncate_inode(FileSystem *fs, size_t inode_number, size_t size);
+static bool    fs_clone_inode(FileSystem *fs, size_t inode_number, size_t clone);
+static ssize_t fs_dedup_all(FileSystem *fs);
+static ssize_t fs_clean_all(FileSystem *fs);
+static bool    fs_snapshot_delete(FileSystem *fs, const char *name);
+static ssize_t fs_copy_inode(FileSystem *fs, size_t src_inode, size_t src_offset, size_t dst_inode,
+                             size_t dst_offset, size_t length);
+static bool    fs_journaled(FileSystem *fs);
+static size_t  fs_journal_limit(FileSystem *fs);
+static bool    fs_journal_open(FileSystem *fs);
+static void    fs_journal_close(FileSystem *fs);
+static Transaction *fs_transaction_alloc(FileSystem *fs);
+static void    fs_transaction_free(Transaction *tx);
+static ssize_t fs_transaction_find(const Transaction *tx, uint32_t block_number);
+static uint32_t fs_journal_checksum(const Block *blocks, size_t count);
+static void    fs_journal_start(FileSystem *fs);
+static void    fs_journal_stop(FileSystem *fs);
+static bool    fs_journal_commit(FileSystem *fs);
+static bool    fs_journal_defer(FileSystem *fs, size_t block_number);
+static bool    fs_journal_reclaim(FileSystem *fs);
+static bool    fs_meta_read(FileSystem *fs, size_t block_number, char *data);
+static bool    fs_meta_write(FileSystem *fs, size_t block_number, char *data);
+static bool    fs_mount_table(FileSystem *fs, Disk *disk, uint32_t options, const char *name);
+static size_t  fs_map_share(FileMap *from, FileMap *to, size_t blocks);
+static bool    fs_snapshot_load(Disk *disk, const SuperBlock *sb, Block *directory);
+static uint32_t *fs_snapshot_index(Disk *disk, const SuperBlock *sb, uint32_t table);
+static ssize_t fs_snapshot_find(const Block *directory, const char *name);
+static bool    fs_snapshot_inode(FileSystem *fs, size_t inode_number, Inode *inode);
+static void    fs_snapshot_drop(FileSystem *fs, uint32_t *index, uint32_t table, uint32_t zero);
+static void    fs_scan_inode(FileSystem *fs, size_t inode_number, Inode *pi);
+static void    fs_scan_snapshots(FileSystem *fs);
+static bool    fs_enable_shares(FileSystem *fs);
+static uint64_t fs_block_hash(const char *data);
+static size_t  fs_dedup_file(FileSystem *fs, FileMap *map, DedupEntry *index, size_t mask, char *buffer);
+static size_t  fs_log_append(FileSystem *fs, size_t wanted, size_t *start);
+static size_t  fs_log_segment(const SuperBlock *sb, size_t block_number);
+static bool    fs_clean_movable(FileSystem *fs, const bool *victims, size_t block_number);
+static size_t  fs_clean_file(FileSystem *fs, FileMap *map, const bool *victims, char *buffer);
+static bool    fs_map_release_tree(FileMap *map, uint32_t block_number, size_t height, size_t from);
+static size_t  fs_extent_end(const Extent *e);
+static size_t  fs_extent_search(FileMap *map, size_t index);
+static bool    fs_extent_insert(FileMap *map, size_t position, Extent extent);
+static void    fs_extent_remove(FileMap *map, size_t from, size_t to);
+static void    fs_extent_merge(FileMap *map, size_t position);
+static bool    fs_extent_set(FileMap *map, size_t index, uint32_t pointer, size_t count);
+static bool    fs_append_block(uint32_t **array, size_t *count, uint32_t block_number);
+static bool    fs_extent_load_node(Disk *disk, FileMap *map, uint32_t block_number, uint32_t depth,
+                                   uint32_t **indexes, size_t *nindexes);
+static bool    fs_extent_load(Disk *disk, FileMap *map);
+static ssize_t fs_extent_node_block(FileMap *map, size_t *used, bool *fresh);
+static bool    fs_extent_store(FileMap *map);
 
 /* External Functions */
 
@@ -42,6 +202,22 @@ void    fs_debug(Disk *disk) {
     printf("    %u blocks\n"         , block.super.blocks);
     printf("    %u inode blocks\n"   , block.super.inode_blocks);
     printf("    %u inodes\n"         , block.super.inodes);
+    if (block.super.features & FS_FEATURE_GROUPS)
+        printf("    %u block groups of %u blocks\n", block.super.groups, block.super.group_blocks);
+    if (block.super.features & FS_FEATURE_JOURNAL)
+        printf("    journal at blocks %u-%u\n", block.super.journal, block.super.journal + block.super.journal_blocks - 1);
+
+    /* Read Snapshot Directory */
+    Block directory;
+    if (!fs_snapshot_load(disk, &block.super, &directory))
+    {
+        fprintf(stderr, "Fail to read snapshot directory %u\n", block.super.snapshots);
+        return;
+    }
+    for (size_t k = 0; k < SNAPSHOTS_PER_BLOCK; ++k)
+        if (directory.snapshots[k].table)
+            printf("    snapshot %.*s: inode table index at block %u\n", SNAPSHOT_NAME_LENGTH,
+                   directory.snapshots[k].name, directory.snapshots[k].table);
 
     /* Read Inodes */
     size_t nums = block.super.inode_blocks;
@@ -50,9 +226,10 @@ void    fs_debug(Disk *disk) {
     for (size_t i = 0; i < block.super.inode_blocks; ++i)
     {
         Block inode_block;
-        if (disk_read(disk, i + 1, inode_block.data) == DISK_FAILURE)
+        size_t inode_block_number = fs_inode_table_block(&block.super, i);
+        if (disk_read(disk, inode_block_number, inode_block.data) == DISK_FAILURE)
         {
-            fprintf(stderr, "Fail to read block %d\n", i + 1);
+            fprintf(stderr, "Fail to read block %lu\n", inode_block_number);
             return;
         }
         
@@ -60,16 +237,46 @@ void    fs_debug(Disk *disk) {
         {
             Inode * pi = &inode_block.inodes[j];
             // print valid inode的信息
-            if (pi->valid)
+            if (pi->valid & INODE_VALID)
             {
                 printf("Inode %d:\n", i * INODES_PER_BLOCK + j);
-                printf("    size: %d bytes\n", pi->size);
-                printf("    direct blocks:");
-                if (pi->direct[0])
+                printf("    size: %lu bytes\n", fs_inode_size(pi));
+                if (pi->valid & INODE_INLINE)
+                {
+                    printf("    inline data slots:");
+                    for (size_t k = 0; k < INLINE_SLOTS && INODE_SLOT_LINK(pi->valid, k); ++k)
+                        printf(" %lu", i * INODES_PER_BLOCK + INODE_SLOT_LINK(pi->valid, k) - 1);
+                    printf("\n");
+                    --nums;
+                    continue;
+                }
+                if (pi->valid & INODE_EXTENTS)
                 {
-                    for (size_t k = 0; k < POINTERS_PER_INODE && pi->direct[k]; ++k)
-                        printf(" %d", pi->direct[k]);
+                    FileMap map = {.inode = pi};
+                    if (!fs_extent_load(disk, &map))
+                    {
+                        fprintf(stderr, "Fail to read extent tree of inode %lu\n", i * INODES_PER_BLOCK + j);
+                        return;
+                    }
+                    printf("    extents:");
+                    for (size_t k = 0; k < map.nextents; ++k)
+                        printf(" %u-%u", map.extents[k].start, map.extents[k].start + EXTENT_LENGTH(map.extents[k].length) - 1);
+                    printf("\n");
+                    if (map.nnodes)
+                    {
+                        printf("    extent tree blocks:");
+                        for (size_t k = 0; k < map.nnodes; ++k)
+                            printf(" %u", map.nodes[k]);
+                        printf("\n");
+                    }
+                    fs_map_free(&map);
+                    --nums;
+                    continue;
                 }
+                printf("    direct blocks:");
+                for (size_t k = 0; k < fs_inode_direct(pi); ++k)
+                    if (pi->direct[k])
+                        printf(" %d", POINTER_BLOCK(pi->direct[k]));
                 printf("\n");
                 
                 // 存在indirect inode
@@ -84,10 +291,15 @@ void    fs_debug(Disk *disk) {
                         return;
                     }
                     printf("    indirect data blocks:");
-                    for (size_t k = 0; k < POINTERS_PER_BLOCK && indirect_block.pointers[k]; ++k)
-                        printf(" %d", indirect_block.pointers[k]);
+                    for (size_t k = 0; k < POINTERS_PER_BLOCK; ++k)
+                        if (indirect_block.pointers[k])
+                            printf(" %d", POINTER_BLOCK(indirect_block.pointers[k]));
                     printf("\n");
                 }
+                if (pi->valid & INODE_INDIRECT3 && pi->double_indirect)
+                    printf("    double indirect block: %d\n", pi->double_indirect);
+                if (pi->valid & INODE_INDIRECT3 && pi->triple_indirect)
+                    printf("    triple indirect block: %d\n", pi->triple_indirect);
                 --nums;
             }
         }
@@ -113,45 +325,93 @@ void    fs_debug(Disk *disk) {
  * @return      Whether or not all disk operations were successful.
  **/
 bool    fs_format(FileSystem *fs, Disk *disk) {
-    if (fs->disk == NULL && disk)
+    return fs_format_features(fs, disk, 0);
+}
+
+/**
+ * Format Disk with the given feature flags by doing the following:
+ *
+ *  1. Compute the layout (a single inode table for the original format, or
+ *  one inode slice per block group with FS_FEATURE_GROUPS).
+ *
+ *  2. Clear all inode blocks.
+ *
+ *  3. Reserve and initialize the journal (FS_FEATURE_JOURNAL).
+ *
+ *  4. Write SuperBlock.
+ *
+ * Note: Do not format a mounted Disk!
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       features    FS_FEATURE_* flags.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool    fs_format_features(FileSystem *fs, Disk *disk, uint32_t features) {
+    if (fs->disk == NULL && disk && !(features & ~FS_FEATURE_ALL) && disk->blocks > 2)
     {
-        size_t inodes_size = (disk->blocks + 9) / 10;
-        
-        // check whether the disk has been formatted
+        // compute layout
         Block block;
-        
-        if (disk_read(disk, 0, block.data) == DISK_FAILURE)
+        memset(&block, 0, sizeof(block));
+        block.super.magic_number = MAGIC_NUMBER;
+        block.super.blocks       = disk->blocks;
+        block.super.features     = features;
+        if (features & FS_FEATURE_GROUPS)
+            fs_group_geometry(&block.super);
+        else
         {
-            debug("Fail to read super block\n");
-            return false;
+            block.super.inode_blocks = (disk->blocks + 9) / 10;
+            block.super.inodes       = block.super.inode_blocks * INODES_PER_BLOCK;
         }
 
-        // do nothing
-        // if (block.super.magic_number == MAGIC_NUMBER)
-        //     return true;
-
         // clear inode blocks
         char * data = (char *)calloc(BLOCK_SIZE, sizeof(char));
-        for (size_t i = 0; i < inodes_size; ++i)
-            if (disk_write(disk, i + 1, data) == DISK_FAILURE)
+        for (size_t i = 0; i < block.super.inode_blocks; ++i)
+        {
+            size_t inode_block_number = fs_inode_table_block(&block.super, i);
+            if (disk_write(disk, inode_block_number, data) == DISK_FAILURE)
+            {
+                debug("Fail to clear inode block %lu\n", inode_block_number);
+                free(data);
+                return false;
+            }
+        }
+        free(data);
+
+        // 日志放在第一个组的数据区开头
+        if (features & FS_FEATURE_JOURNAL)
+        {
+            size_t room = fs_group_data_end(&block.super, 0) - fs_group_data_start(&block.super, 0);
+            block.super.journal        = fs_group_data_start(&block.super, 0);
+            block.super.journal_blocks = min((size_t)JOURNAL_BLOCKS, room / 4);
+            if (block.super.journal_blocks < 8)
+            {
+                debug("Disk too small for a journal\n");
+                return false;
+            }
+
+            Block header;
+            memset(header.data, 0, BLOCK_SIZE);
+            if (disk_write(disk, block.super.journal + 1, header.data) == DISK_FAILURE)
+            {
+                debug("Fail to clear journal descriptor\n");
+                return false;
+            }
+            header.journal.magic    = JOURNAL_MAGIC;
+            header.journal.sequence = 1;
+            if (disk_write(disk, block.super.journal, header.data) == DISK_FAILURE)
             {
-                debug("Fail to clear inode block %d\n", i + 1);
+                debug("Fail to write journal header\n");
                 return false;
             }
+        }
 
         // Write SuperBlock
-        uint32_t * ptr = (uint32_t *)data;
-        ptr[0] = MAGIC_NUMBER;
-        ptr[1] = disk->blocks;
-        ptr[2] = inodes_size;
-        ptr[3] = inodes_size * INODES_PER_BLOCK;
-        if (disk_write(disk, 0, data) == DISK_FAILURE)
+        if (disk_write(disk, 0, block.data) == DISK_FAILURE)
         {
             error("Fail to init super block\n");
-            free(data);
             exit(1);
         }
-        free(data);
         return true;
     }
 
@@ -167,15 +427,69 @@ bool    fs_format(FileSystem *fs, Disk *disk) {
  *
  *  3. Copy SuperBlock to FileSystem meta data attribute
  *
- *  4. Initialize FileSystem free blocks bitmap.
+ *  4. Replay the journal (FS_FEATURE_JOURNAL) if the last commit did not
+ *  finish.
+ *
+ *  5. Initialize FileSystem free blocks and free inodes bitmaps and start
+ *  the background scanner that marks the inodes and blocks in use.
  *
  * Note: Do not mount a Disk that has already been mounted!
  *
+ * Note: The mount returns as soon as the SuperBlock is validated.  Reads
+ * are served right away, while anything that allocates or releases blocks
+ * waits until the scanner has finished (see fs_wait_ready).
+ *
  * @param       fs      Pointer to FileSystem structure.
  * @param       disk    Pointer to Disk structure.
  * @return      Whether or not the mount operation was successful.
  **/
 bool    fs_mount(FileSystem *fs, Disk *disk) {
+    return fs_mount_options(fs, disk, 0);
+}
+
+/**
+ * Mount specified FileSystem to given Disk with the given mount options
+ * (see fs_mount for the steps).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       options     FS_MOUNT_* flags.
+ * @return      Whether or not the mount operation was successful.
+ **/
+bool    fs_mount_options(FileSystem *fs, Disk *disk, uint32_t options) {
+    return fs_mount_table(fs, disk, options, NULL);
+}
+
+/**
+ * Mount the named snapshot of the FileSystem on the given Disk read-only
+ * (see fs_mount for the steps).  Inodes are looked up in the snapshot's
+ * copy of the Inode table, so files read back as they were when the
+ * snapshot was taken.
+ *
+ * Note: The live FileSystem may stay mounted (on its own FileSystem
+ * structure) next to any number of its snapshots, but the snapshot must
+ * not be deleted while it is mounted.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       name        Name of the snapshot.
+ * @return      Whether or not the mount operation was successful.
+ **/
+bool    fs_mount_snapshot(FileSystem *fs, Disk *disk, const char *name) {
+    return name && fs_mount_table(fs, disk, FS_MOUNT_READONLY, name);
+}
+
+/**
+ * Mount the live Inode table, or the one of the named snapshot.
+ **/
+static bool    fs_mount_table(FileSystem *fs, Disk *disk, uint32_t options, const char *name)
+{
+    if (options & ~FS_MOUNT_ALL)
+    {
+        debug("Unknown mount options 0x%x\n", options);
+        return false;
+    }
+
     if (disk && fs->disk == NULL)
     {
         fs->disk = disk;
@@ -188,26 +502,147 @@ bool    fs_mount(FileSystem *fs, Disk *disk) {
         }
 
         memcpy(&fs->meta_data, &block.super, sizeof(SuperBlock));
+        SuperBlock geometry = fs->meta_data;
+        if (geometry.features & FS_FEATURE_GROUPS && geometry.blocks > 2)
+            fs_group_geometry(&geometry);
+
         // check magic number
         if (fs->meta_data.magic_number != MAGIC_NUMBER)
         {
             debug("Magic number 0x%x is invalid\n", fs->meta_data.magic_number);
             return false;
         }
+        else if (fs->meta_data.features & ~FS_FEATURE_ALL)
+        {
+            debug("Unknown features 0x%x\n", fs->meta_data.features);
+            return false;
+        }
+        else if (fs->meta_data.blocks > disk->blocks)
+        {
+            debug("blocks and disk blocks Error\n");
+            return false;
+        }
         else if (fs->meta_data.inode_blocks * INODES_PER_BLOCK != fs->meta_data.inodes)
         {
             debug("Inodes and inode_blocks Error\n");
             return false;
         }
+        else if (fs->meta_data.features & FS_FEATURE_GROUPS)
+        {
+            if (memcmp(&geometry, &fs->meta_data, sizeof(SuperBlock)))
+            {
+                debug("Block group geometry Error\n");
+                return false;
+            }
+        }
         else if (fs->meta_data.inode_blocks != (fs->meta_data.blocks + 9) / 10)
         {
             debug("blocks and inode_blocks Error\n");
             return false;
         } 
 
-        // initialize free bitmap
+        if (fs->meta_data.features & FS_FEATURE_JOURNAL &&
+            (fs->meta_data.journal != fs_group_data_start(&fs->meta_data, 0) || fs->meta_data.journal_blocks < 8 ||
+             fs->meta_data.journal + fs->meta_data.journal_blocks > fs_group_data_end(&fs->meta_data, 0)))
+        {
+            debug("Journal location Error\n");
+            return false;
+        }
+
+        // snapshot只读, 从它的inode table查找inode
+        fs->snapshot_table = NULL;
+        if (name)
+        {
+            Block   directory;
+            ssize_t k;
+            if (!fs_snapshot_load(disk, &fs->meta_data, &directory) || (k = fs_snapshot_find(&directory, name)) < 0)
+            {
+                debug("Snapshot %s not found\n", name);
+                return false;
+            }
+            if (!(fs->snapshot_table = fs_snapshot_index(disk, &fs->meta_data, directory.snapshots[k].table)))
+            {
+                debug("Fail to read inode table index of snapshot %s\n", name);
+                return false;
+            }
+        }
+
+        fs->table_locks = (pthread_mutex_t *)malloc(TABLE_LOCKS * sizeof(pthread_mutex_t));
+        fs->inode_locks = (pthread_rwlock_t *)malloc(INODE_LOCKS * sizeof(pthread_rwlock_t));
+        fs->inode_generations = (size_t *)calloc(INODE_LOCKS, sizeof(size_t));
+        if (!fs->table_locks || !fs->inode_locks || !fs->inode_generations)
+        {
+            debug("Fail to allocate inode locks\n");
+            free(fs->table_locks);
+            free(fs->inode_locks);
+            free(fs->inode_generations);
+            fs->table_locks       = NULL;
+            fs->inode_locks       = NULL;
+            fs->inode_generations = NULL;
+            return false;
+        }
+
+        pthread_mutex_init(&fs->sync_lock, NULL);
+        pthread_cond_init(&fs->sync_cond, NULL);
+        fs->sync_busy      = false;
+        fs->sync_requested = 0;
+        fs->sync_done      = 0;
+
+        // 先重放日志, scanner才能看到提交过的inode table
+        fs->running = fs->committing = NULL;
+        if (fs->meta_data.features & FS_FEATURE_JOURNAL && !(options & FS_MOUNT_READONLY) &&
+            !fs_journal_open(fs))
+        {
+            debug("Fail to open journal\n");
+            pthread_cond_destroy(&fs->sync_cond);
+            pthread_mutex_destroy(&fs->sync_lock);
+            free(fs->table_locks);
+            free(fs->inode_locks);
+            free(fs->inode_generations);
+            fs->table_locks       = NULL;
+            fs->inode_locks       = NULL;
+            fs->inode_generations = NULL;
+            fs->disk              = NULL;
+            return false;
+        }
+
+        // initialize free bitmap and scan inode table in the background
         fs_initialize_free_block_bitmap(fs);
 
+        pthread_mutex_init(&fs->alloc_lock, NULL);
+        pthread_mutex_init(&fs->inode_lock, NULL);
+        pthread_mutex_init(&fs->super_lock, NULL);
+        for (size_t k = 0; k < TABLE_LOCKS; ++k)
+            pthread_mutex_init(&fs->table_locks[k], NULL);
+        for (size_t k = 0; k < INODE_LOCKS; ++k)
+            pthread_rwlock_init(&fs->inode_locks[k], NULL);
+        pthread_mutex_init(&fs->arena_lock, NULL);
+        pthread_key_create(&fs->arena_key, fs_arena_destroy);
+        fs->arenas   = NULL;
+        fs->writers  = 0;
+        fs->log_head = 0;
+
+        pthread_mutex_init(&fs->pointer_lock, NULL);
+        fs->pointer_cache = (PointerCache *)calloc(POINTER_CACHE_BLOCKS, sizeof(PointerCache));
+        pthread_mutex_init(&fs->inode_cache_lock, NULL);
+        fs->inode_cache   = (InodeCache *)calloc(INODE_CACHE_BLOCKS, sizeof(InodeCache));
+
+        pthread_mutex_init(&fs->dirty_lock, NULL);
+        fs->options      = options;
+        fs->dirty        = NULL;
+        fs->dirty_blocks = 0;
+
+        pthread_mutex_init(&fs->scan_lock, NULL);
+        pthread_cond_init(&fs->scan_cond, NULL);
+        fs->scanned     = 0;
+        fs->scan_cancel = false;
+        fs->scanner_running = pthread_create(&fs->scanner, NULL, fs_scan_inode_table, fs) == 0;
+        if (!fs->scanner_running)
+        {
+            debug("Fail to start scanner, scanning inline\n");
+            fs_scan_inode_table(fs);
+        }
+
         return true;
     }
 
@@ -217,65 +652,286 @@ bool    fs_mount(FileSystem *fs, Disk *disk) {
 /**
  * Unmount FileSystem from internal Disk by doing the following:
  *
- *  1. Set FileSystem disk attribute.
+ *  1. Write back data buffered by delayed allocation and cached Inode
+ *  table blocks.
+ *
+ *  2. Stop and join the background scanner (if any), then commit the
+ *  journal and flush the disk image.
+ *
+ *  3. Release allocation arenas.
  *
- *  2. Release free blocks bitmap.
+ *  4. Set FileSystem disk attribute.
+ *
+ *  5. Release free blocks and free inodes bitmaps.
  *
  * @param       fs      Pointer to FileSystem structure.
  **/
 void    fs_unmount(FileSystem *fs) {
     if (fs)
     {
+        if (fs->free_blocks)
+        {
+            fs_delalloc_flush_all(fs);
+            pthread_mutex_destroy(&fs->dirty_lock);
+            if (!fs_flush_table(fs))
+                error("Fail to write back inode table\n");
+
+            // scanner还在通过journal读inode表, 先停下再关journal
+            pthread_mutex_lock(&fs->scan_lock);
+            fs->scan_cancel = true;
+            pthread_mutex_unlock(&fs->scan_lock);
+
+            if (fs->scanner_running)
+                pthread_join(fs->scanner, NULL);
+            fs->scanner_running = false;
+            pthread_cond_destroy(&fs->scan_cond);
+            pthread_mutex_destroy(&fs->scan_lock);
+
+            fs_journal_close(fs);
+            if (!(fs->options & FS_MOUNT_READONLY) && !disk_sync(fs->disk))
+                error("Fail to flush disk\n");
+            pthread_cond_destroy(&fs->sync_cond);
+            pthread_mutex_destroy(&fs->sync_lock);
+
+            // 释放所有arena (bitmap马上就会被释放, 不需要归还)
+            pthread_key_delete(fs->arena_key);
+            while (fs->arenas)
+            {
+                Arena *arena = fs->arenas;
+                fs->arenas   = arena->next;
+                pthread_mutex_destroy(&arena->lock);
+                free(arena);
+            }
+            pthread_mutex_destroy(&fs->arena_lock);
+            pthread_mutex_destroy(&fs->pointer_lock);
+            free(fs->pointer_cache);
+            fs->pointer_cache = NULL;
+            pthread_mutex_destroy(&fs->inode_cache_lock);
+            free(fs->inode_cache);
+            fs->inode_cache = NULL;
+            for (size_t k = 0; k < TABLE_LOCKS; ++k)
+                pthread_mutex_destroy(&fs->table_locks[k]);
+            for (size_t k = 0; k < INODE_LOCKS; ++k)
+                pthread_rwlock_destroy(&fs->inode_locks[k]);
+            pthread_mutex_destroy(&fs->super_lock);
+            pthread_mutex_destroy(&fs->inode_lock);
+            pthread_mutex_destroy(&fs->alloc_lock);
+        }
+
         fs->disk = NULL;
         free(fs->free_blocks);
         fs->free_blocks = NULL;
+        free(fs->snapshot_table);
+        fs->snapshot_table = NULL;
+        free(fs->table_locks);
+        fs->table_locks = NULL;
+        free(fs->inode_locks);
+        fs->inode_locks = NULL;
+        free(fs->inode_generations);
+        fs->inode_generations = NULL;
+        free(fs->block_shares);
+        fs->block_shares = NULL;
+        free(fs->free_inodes);
+        fs->free_inodes = NULL;
+        free(fs->groups);
+        fs->groups = NULL;
+    }
+}
+
+/**
+ * Block until the background scanner has built the whole free block bitmap.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ **/
+void    fs_wait_ready(FileSystem *fs) {
+    if (fs && fs->free_blocks)
+        fs_wait_scanned(fs, fs->meta_data.inode_blocks);
+}
+
+/**
+ * Write back everything the FileSystem holds in memory by doing the
+ * following:
+ *
+ *  1. Write back data buffered by delayed allocation.
+ *
+ *  2. Write back dirty cached Inode table blocks (fs_flush_table).
+ *
+ *  3. Commit the journal.
+ *
+ *  4. Flush the disk image, sharing the flush with concurrent callers.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool    fs_sync(FileSystem *fs) {
+    if (!fs || !fs->free_blocks)
+        return false;
+
+    bool ok = true;
+    if (fs->options & FS_MOUNT_DELALLOC)
+    {
+        ok = fs_delalloc_sync(fs);
+    }
+    ok = fs_flush_table(fs) && ok;
+    ok = fs_journal_commit(fs) && ok;
+    return fs_disk_sync(fs) && ok;
+}
+
+/**
+ * Make the specified Inode durable by doing the following:
+ *
+ *  1. Write back the data of the file buffered by delayed allocation.
+ *
+ *  2. Unless data_only is set, write back the cached Inode table block that
+ *  holds the Inode and commit the journal (inline files always, since their
+ *  data lives in the Inode table).
+ *
+ *  3. Flush the disk image once; callers arriving while a flush runs share
+ *  the next one.
+ *
+ * Note: With data_only a grown file or newly mapped blocks may still be
+ * lost on a crash until the next fs_sync or full fs_fsync.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to make durable.
+ * @param       data_only       Whether or not to skip the Inode itself.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool    fs_fsync(FileSystem *fs, size_t inode_number, bool data_only) {
+    Inode inode;
+    if (!fs || !fs->free_blocks)
+        return false;
+
+    // 写回缓存的数据要独占这个文件
+    bool delalloc = fs->options & FS_MOUNT_DELALLOC;
+    bool ok       = true;
+    fs_lock_inode(fs, inode_number, delalloc);
+    bool loaded = fs_load_inode(fs, inode_number, &inode);
+    if (loaded && delalloc)
+    {
+        DirtyFile *df = fs_delalloc_find(fs, inode_number);
+        if (df)
+            ok = fs_delalloc_flush(fs, df);
+    }
+    fs_unlock_inode(fs, inode_number);
+    if (!loaded)
+        return false;
+
+    if (!data_only || inode.valid & INODE_INLINE)
+    {
+        ok = fs_flush_table_block(fs, fs_table_block(fs, inode_number / INODES_PER_BLOCK)) && ok;
+        ok = fs_journal_commit(fs) && ok;
     }
+    return fs_disk_sync(fs) && ok;
 }
 
 /**
  * Allocate an Inode in the FileSystem Inode table by doing the following:
  *
- *  1. Search Inode table for free inode.
+ *  1. Search free inode bitmap for free inode, starting at the free hint.
  *
  *  2. Reserve free inode in Inode table.
  *
  * Note: Be sure to record updates to Inode table to Disk.
  *
+ * Note: The search only waits for the scanner to cover the inode block that
+ * holds the candidate, so creates do not wait for a full mount scan.
+ *
  * @param       fs      Pointer to FileSystem structure.
  * @return      Inode number of allocated Inode.
  **/
 ssize_t fs_create(FileSystem *fs) {
-    Block block;
+    if (!fs->free_inodes || fs->options & FS_MOUNT_READONLY)
+        return -1;
 
-    // 访问每一个inode块
-    for (size_t i = 0; i < fs->meta_data.inode_blocks; ++i)
+    // 轮流选择block group, 优先选择还有空闲数据块的group
+    size_t groups      = fs_group_count(&fs->meta_data);
+    size_t group_nodes = fs_group_inode_blocks(&fs->meta_data) * INODES_PER_BLOCK;
+    bool   scan_done   = __atomic_load_n(&fs->scanned, __ATOMIC_ACQUIRE) >= fs->meta_data.inode_blocks;
+    size_t inode_number = fs->meta_data.inodes;
+
+    pthread_mutex_lock(&fs->inode_lock);
+    for (size_t pass = 0; pass < 2 && inode_number >= fs->meta_data.inodes; ++pass)
     {
-        // 读入inode 块
-        if (disk_read(fs->disk, i + 1, block.data) == DISK_FAILURE)
-        {
-            debug("Fail to read inode block %d\n", i);
-            return -1;
-        }
-        
-        // 访问每一个inode
-        for (size_t j = 0; j < INODES_PER_BLOCK; ++j)
+        for (size_t k = 0; k < groups; ++k)
         {
-            if (!block.inodes[j].valid)
+            size_t      g  = (fs->group_rotor + k) % groups;
+            BlockGroup *bg = &fs->groups[g];
+            if (!pass && scan_done && groups > 1)
             {
-                block.inodes[j].valid = 1;
-                // write back
-                if (disk_write(fs->disk, i + 1, block.data) == DISK_FAILURE)
-                {
-                    error("Fail to write inode block back\n");
-                    return -1;
-                }
+                pthread_mutex_lock(&fs->alloc_lock);
+                bool full = !bg->free_count;
+                pthread_mutex_unlock(&fs->alloc_lock);
+                if (full)
+                    continue;
+            }
+
+            // 从hint开始查找空闲inode
+            size_t end = (g + 1) * group_nodes;
+            size_t i   = bg->inode_hint;
+            while (i < end)
+            {
+                fs_wait_scanned(fs, i / INODES_PER_BLOCK + 1);
+                if (fs->free_inodes[i])
+                    break;
+                ++i;
+            }
+            bg->inode_hint = i;
 
-                return i * INODES_PER_BLOCK + j;
+            if (i < end)
+            {
+                inode_number    = i;
+                fs->group_rotor = (g + 1) % groups;
+                break;
             }
         }
     }
 
-    return -1;
+    // 先在bitmap里占住, 再写inode块
+    if (inode_number < fs->meta_data.inodes)
+    {
+        fs->free_inodes[inode_number] = false;
+        fs->groups[fs_inode_group(&fs->meta_data, inode_number)].inode_hint = inode_number + 1;
+    }
+    pthread_mutex_unlock(&fs->inode_lock);
+
+    if (inode_number >= fs->meta_data.inodes)
+        return -1;
+
+    // 读入inode 块, 只需要一次read-modify-write
+    size_t           inode_block_number = fs_table_block(fs, inode_number / INODES_PER_BLOCK);
+    pthread_mutex_t *table_lock         = fs_table_lock(fs, inode_number);
+    Block            block;
+
+    pthread_mutex_lock(table_lock);
+    bool ok = fs_read_table(fs, inode_block_number, &block);
+    if (ok)
+    {
+        Inode *node = &block.inodes[inode_number % INODES_PER_BLOCK];
+        memset(node, 0, sizeof(Inode));
+        if (fs_features(&fs->meta_data) & FS_FEATURE_INLINE_DATA)
+            node->valid = INODE_VALID | INODE_INLINE;
+        else
+            node->valid = INODE_VALID | (fs_features(&fs->meta_data) & FS_FEATURE_EXTENTS ? INODE_EXTENTS : 0);
+
+        // write back
+        if (!(ok = fs_write_table(fs, inode_block_number, &block)))
+            error("Fail to write inode block back\n");
+    }
+    else
+        debug("Fail to read inode block %lu\n", inode_block_number);
+    pthread_mutex_unlock(table_lock);
+
+    if (!ok)
+    {
+        pthread_mutex_lock(&fs->inode_lock);
+        fs->free_inodes[inode_number] = true;
+        BlockGroup *bg = &fs->groups[fs_inode_group(&fs->meta_data, inode_number)];
+        bg->inode_hint = min(bg->inode_hint, inode_number);
+        pthread_mutex_unlock(&fs->inode_lock);
+        return -1;
+    }
+    return inode_number;
 }
 
 /**
@@ -294,42 +950,81 @@ ssize_t fs_create(FileSystem *fs) {
  * @return      Whether or not removing the specified Inode was successful.
  **/
 bool    fs_remove(FileSystem *fs, size_t inode_number) {
+    fs_lock_inode(fs, inode_number, true);
+    fs_journal_start(fs);
+    bool removed = fs_remove_inode(fs, inode_number);
+    fs_journal_stop(fs);
+    fs_unlock_inode(fs, inode_number);
+    return removed;
+}
+
+/**
+ * Body of fs_remove, run inside one journal handle so its metadata updates
+ * commit together.
+ **/
+static bool    fs_remove_inode(FileSystem *fs, size_t inode_number)
+{
     // load and check status of Inode
     Inode inode;
     size_t i;
 
+    if (fs->options & FS_MOUNT_READONLY)
+        return false;
+
+    // the scanner must be past this inode before its bitmap bit may change
+    fs_wait_scanned(fs, inode_number / INODES_PER_BLOCK + 1);
+
     if (!fs_load_inode(fs, inode_number, &inode) || !inode.valid)
     {
         error("Fail to load inode %u or %u inode is invalid\n", inode_number, inode_number);
         return false;
     }
 
-
-    // release direct blocks
-    for (i = 0; i < POINTERS_PER_INODE && inode.direct[i]; ++i)
-        fs_release_free_block(fs, inode.direct[i]);
-
-    // release indirect blocks
-    if (inode.indirect)
+    // 还没写回的数据直接丢弃, 不需要分配块
+    if (fs->options & FS_MOUNT_DELALLOC)
     {
-        // read indirect block
-        Block block;
-        disk_read(fs->disk, inode.indirect, block.pointers);
-
-        for (i = 0; i < POINTERS_PER_BLOCK && block.pointers[i]; ++i)
-            fs_release_free_block(fs, block.pointers[i]);
-        fs_release_free_block(fs, inode.indirect);
+        DirtyFile *df = fs_delalloc_find(fs, inode_number);
+        if (df)
+            fs_delalloc_discard(fs, df);
     }
 
-    
-    // mark inode as free and save
-    memset(&inode, 0, sizeof(inode));
-    if (!fs_save_inode(fs, inode_number, &inode))
+    // inline数据和slot随inode一起清掉
+    if (inode.valid & INODE_INLINE)
     {
-        error("Fail to save inode %d\n", inode_number);
-        return false;
+        if (!fs_inline_remove(fs, inode_number))
+        {
+            error("Fail to save inode %d\n", inode_number);
+            return false;
+        }
+    }
+    else
+    {
+        // release data blocks, indirect block and extent tree
+        FileMap map;
+        if (!fs_map_open(fs, &map, &inode, fs_inode_group(&fs->meta_data, inode_number)))
+        {
+            error("Fail to load block map of inode %lu\n", inode_number);
+            return false;
+        }
+        fs_map_release(&map, 0);
+        for (i = 0; i < map.nnodes; ++i)
+            fs_release_free_block(fs, map.nodes[i]);
+        fs_map_free(&map);
+
+        // mark inode as free and save
+        memset(&inode, 0, sizeof(inode));
+        if (!fs_save_inode(fs, inode_number, &inode))
+        {
+            error("Fail to save inode %d\n", inode_number);
+            return false;
+        }
     }
 
+    pthread_mutex_lock(&fs->inode_lock);
+    fs->free_inodes[inode_number] = true;
+    BlockGroup *bg = &fs->groups[fs_inode_group(&fs->meta_data, inode_number)];
+    bg->inode_hint = min(bg->inode_hint, inode_number);
+    pthread_mutex_unlock(&fs->inode_lock);
     return true;
 }
 
@@ -341,19 +1036,26 @@ bool    fs_remove(FileSystem *fs, size_t inode_number) {
  * @return      Size of specified Inode (-1 if does not exist).
  **/
 ssize_t fs_stat(FileSystem *fs, size_t inode_number) {
-    Inode inode;
-    return fs_load_inode(fs, inode_number, &inode) ? inode.size : (-1l); 
+    Inode   inode;
+    ssize_t size = -1;
+
+    fs_lock_inode(fs, inode_number, false);
+    DirtyFile *df = fs->options & FS_MOUNT_DELALLOC ? fs_delalloc_find(fs, inode_number) : NULL;
+    if (df)
+        size = df->size;
+    else if (fs_load_inode(fs, inode_number, &inode))
+        size = fs_inode_size(&inode);
+    fs_unlock_inode(fs, inode_number);
+    return size;
 }
 
 /**
  * Read from the specified Inode into the data buffer exactly length bytes
  * beginning from the specified offset by doing the following:
  *
- *  1. Load Inode information.
- *
- *  2. Continuously read blocks and copy data to buffer.
+ *  1. Read the part of the range that is backed by disk blocks.
  *
- *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ *  2. With delayed allocation, copy the rest from the buffered blocks.
  *
  * @param       fs              Pointer to FileSystem structure.
  * @param       inode_number    Inode to read data from.
@@ -363,367 +1065,5623 @@ ssize_t fs_stat(FileSystem *fs, size_t inode_number) {
  * @return      Number of bytes read (-1 on error).
  **/
 ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
-    Inode inode;
-
-    if (fs_load_inode(fs, inode_number, &inode))
-    {
-        // set length
-        length = min(length, inode.size - offset);
-
-        // 暂存数据块
-        Block block;
-        size_t bytes_read = 0;
+    fs_lock_inode(fs, inode_number, false);
+    ssize_t bytes_read = fs_read_inode(fs, inode_number, data, length, offset);
+    fs_unlock_inode(fs, inode_number);
+    return bytes_read;
+}
 
-        // 读取direct block
-        size_t i = offset / BLOCK_SIZE;
-        offset %= BLOCK_SIZE;
+/**
+ * Body of fs_read, for callers that already hold the Inode lock.
+ **/
+static ssize_t fs_read_inode(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset)
+{
+    if (!(fs->options & FS_MOUNT_DELALLOC))
+        return fs_read_mapped(fs, inode_number, data, length, offset);
 
-        // 开始的块是否是直接块
-        while (i < POINTERS_PER_INODE && inode.direct[i] && bytes_read < length)
-        {
-            if (!disk_read(fs->disk, inode.direct[i], block.data))
-            {
-                error("Fail to read block %d\n", inode.direct[i]);
-                return -1;
-            }
-            // 拷贝数据
-            size_t sz = min(BLOCK_SIZE - offset, length - bytes_read);
-            memcpy(data + bytes_read, block.data + offset % BLOCK_SIZE, sz);
-            bytes_read += sz;
+    return fs_delalloc_read(fs, inode_number, data, length, offset);
+}
 
-            ++i;
-            offset = 0;
+/**
+ * Write to the specified Inode from the data buffer exactly length bytes
+ * beginning from the specified offset by doing the following:
+ *
+ *  1. Update inline files in the Inode table while they stay small
+ *  enough, otherwise move their data out to data blocks.
+ *
+ *  2. Write the part of the range that is backed by disk blocks.
+ *
+ *  3. Allocate blocks for the rest, or with delayed allocation buffer it in
+ *  memory until writeback.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes write (-1 on error).
+ **/
+ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+    fs_lock_inode(fs, inode_number, true);
+    ssize_t bytes_write = fs_write_inode(fs, inode_number, data, length, offset);
+    fs_unlock_inode(fs, inode_number);
+    return bytes_write;
+}
+
+/**
+ * Body of fs_write, for callers that already hold the Inode lock.
+ **/
+static ssize_t fs_write_inode(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset)
+{
+    if (fs->options & FS_MOUNT_READONLY)
+        return -1;
+
+    // 小文件直接写在inode块里
+    ssize_t result;
+    if (fs_features(&fs->meta_data) & FS_FEATURE_INLINE_DATA &&
+        fs_inline_write(fs, inode_number, data, length, offset, &result))
+        return result;
+
+    if (!(fs->options & FS_MOUNT_DELALLOC))
+    {
+        fs_journal_start(fs);
+        result = fs_write_mapped(fs, inode_number, data, length, offset);
+        fs_journal_stop(fs);
+        return result;
+    }
+
+    return fs_delalloc_write(fs, inode_number, data, length, offset);
+}
+
+/**
+ * Preallocate blocks for the specified Inode so that the byte range
+ * [offset, offset + length) is backed by disk blocks, by doing the following:
+ *
+ *  1. Load Inode information.
+ *
+ *  2. Allocate the missing blocks (holes in the range and blocks past the
+ *  end of file) in runs that are as long as possible (indirect block first,
+ *  so it sits in front of the data it maps).
+ *
+ *  3. Record the new pointers flagged as unwritten and grow the file size.
+ *
+ *  Note: No data is written; unwritten blocks read back as zeros until
+ *  fs_write stores data in them.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to preallocate blocks for.
+ * @param       offset          Byte offset at which the range starts.
+ * @param       length          Number of bytes in the range.
+ * @return      Whether or not the whole range was preallocated.
+ **/
+bool    fs_fallocate(FileSystem *fs, size_t inode_number, size_t offset, size_t length) {
+    fs_lock_inode(fs, inode_number, true);
+    fs_journal_start(fs);
+    bool allocated = fs_fallocate_range(fs, inode_number, offset, length);
+    fs_journal_stop(fs);
+    fs_unlock_inode(fs, inode_number);
+    return allocated;
+}
+
+/**
+ * Body of fs_fallocate (see fs_remove_inode).
+ **/
+static bool    fs_fallocate_range(FileSystem *fs, size_t inode_number, size_t offset, size_t length)
+{
+    Inode inode;
+
+    if (fs->options & FS_MOUNT_READONLY)
+        return false;
+
+    // inline文件先转换成普通文件
+    if (fs_features(&fs->meta_data) & FS_FEATURE_INLINE_DATA && !fs_inline_convert(fs, inode_number))
+        return false;
+
+    // 先写回缓存的数据, 预分配的块接在它们后面
+    if (fs->options & FS_MOUNT_DELALLOC)
+    {
+        DirtyFile *df = fs_delalloc_find(fs, inode_number);
+        if (df)
+            fs_delalloc_flush(fs, df);
+    }
+
+    if (!fs_load_inode(fs, inode_number, &inode))
+        return false;
+
+    size_t  end        = offset + length;
+    size_t  size       = fs_inode_size(&inode);
+    size_t  old_blocks = UPPER_ROUND(size, BLOCK_SIZE);
+    size_t  new_blocks = min(UPPER_ROUND(end, BLOCK_SIZE), fs_inode_max_blocks(&inode));
+    FileMap map;
+
+    if (!fs_map_open(fs, &map, &inode, fs_inode_group(&fs->meta_data, inode_number)))
+        return false;
+
+    // 原来最后一个块的尾部在文件变大后要读出0
+    if (end > size && !fs_map_zero_tail(&map, size))
+    {
+        fs_map_free(&map);
+        return false;
+    }
+
+    // 先分配indirect block
+    if (new_blocks > old_blocks && !fs_map_reserve(&map, new_blocks - 1))
+        new_blocks = POINTERS_PER_INODE;
+
+    // 空洞和EOF之后的部分, 尽量分配连续的块
+    size_t idx = offset / BLOCK_SIZE;
+    while (idx < new_blocks)
+    {
+        size_t run = new_blocks - idx;
+        if (fs_map_get(&map, idx, &run))
+        {
+            idx += run;
+            continue;
+        }
+
+        size_t start;
+        size_t got = fs_allocate_free_run(fs, map.group, run, &start);
+        if (!got)
+            break;
+
+        fs_map_set(&map, idx, start | POINTER_UNWRITTEN, got);
+        idx += got;
+    }
+
+    bool ok = fs_map_close(&map);
+    if (idx < UPPER_ROUND(end, BLOCK_SIZE))
+        size = max(size, idx * BLOCK_SIZE > offset ? idx * BLOCK_SIZE : 0);
+    else
+        size = max(size, end);
+    fs_inode_set_size(&inode, size);
+    if (!fs_save_inode(fs, inode_number, &inode) || !ok)
+        return false;
+
+    return size >= end;
+}
+
+/**
+ * Change the size of the specified Inode by doing the following:
+ *
+ *  1. Resize inline files in the Inode table while they stay small enough
+ *  (their unused slots are freed), otherwise move their data out first.
+ *
+ *  2. When shrinking, release every block past the new end of file in
+ *  contiguous runs, together with indirect blocks and extent tree nodes
+ *  that are no longer needed.
+ *
+ *  3. Zero the tail of the block that holds the new (or, when growing, the
+ *  old) end of file, and record the new size.
+ *
+ *  Note: Growing a file does not allocate blocks; the new range is a hole
+ *  that reads back as zeros.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to resize.
+ * @param       size            New size in bytes.
+ * @return      Whether or not the Inode was resized.
+ **/
+bool    fs_truncate(FileSystem *fs, size_t inode_number, size_t size) {
+    fs_lock_inode(fs, inode_number, true);
+    fs_journal_start(fs);
+    bool resized = fs_truncate_inode(fs, inode_number, size);
+    fs_journal_stop(fs);
+    fs_unlock_inode(fs, inode_number);
+    return resized;
+}
+
+/**
+ * Body of fs_truncate (see fs_remove_inode).
+ **/
+static bool    fs_truncate_inode(FileSystem *fs, size_t inode_number, size_t size)
+{
+    Inode inode;
+
+    if (fs->options & FS_MOUNT_READONLY)
+        return false;
+
+    // inline文件在inode块里直接改
+    bool ok;
+    if (fs_features(&fs->meta_data) & FS_FEATURE_INLINE_DATA &&
+        fs_inline_truncate(fs, inode_number, size, &ok))
+        return ok;
+
+    // 先写回缓存的数据, 再释放多出来的块
+    if (fs->options & FS_MOUNT_DELALLOC)
+    {
+        DirtyFile *df = fs_delalloc_find(fs, inode_number);
+        if (df)
+            fs_delalloc_flush(fs, df);
+    }
+
+    if (!fs_load_inode(fs, inode_number, &inode) || size > fs_inode_max_blocks(&inode) * BLOCK_SIZE)
+        return false;
+
+    size_t  old_size = fs_inode_size(&inode);
+    FileMap map;
+
+    if (size == old_size)
+        return true;
+    if (!fs_map_open(fs, &map, &inode, fs_inode_group(&fs->meta_data, inode_number)))
+        return false;
+
+    if (size < old_size)
+        fs_map_release(&map, UPPER_ROUND(size, BLOCK_SIZE));
+    ok = fs_map_zero_tail(&map, min(size, old_size));
+
+    fs_inode_set_size(&inode, size);
+    ok = fs_map_close(&map) && ok;
+    return fs_save_inode(fs, inode_number, &inode) && ok;
+}
+
+/**
+ * Create a new Inode that shares every data block with the specified one by
+ * doing the following:
+ *
+ *  1. Record FS_FEATURE_REFLINK in the SuperBlock and start counting the
+ *  extra references to shared blocks (the first clone only).
+ *
+ *  2. Copy inline files, which have no data blocks to share.
+ *
+ *  3. Map the same data blocks (in runs) in a new Inode, counting one more
+ *  reference for each, and write the new mapping and Inode.
+ *
+ *  Note: Only metadata is written.  A shared block is copied the first time
+ *  either file writes to it (see fs_map_unshare), and is freed once no file
+ *  maps it any more.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to clone.
+ * @return      Inode number of the clone (-1 on error).
+ **/
+ssize_t fs_clone(FileSystem *fs, size_t inode_number) {
+    if (fs->options & FS_MOUNT_READONLY)
+        return -1;
+
+    // 先分配clone的inode, 才能按顺序锁住源文件(读)和clone(写)
+    fs_journal_start(fs);
+    ssize_t clone = fs_create(fs);
+    if (clone >= 0)
+    {
+        fs_lock_pair_flushed(fs, inode_number, clone);
+        if (!fs_clone_inode(fs, inode_number, clone))
+        {
+            fs_remove_inode(fs, clone);
+            fs_unlock_pair(fs, inode_number, clone);
+            clone = -1;
+        }
+        else
+            fs_unlock_pair(fs, inode_number, clone);
+    }
+    fs_journal_stop(fs);
+    return clone;
+}
+
+/**
+ * Body of fs_clone, run with the source locked shared (and written back,
+ * see fs_lock_pair_flushed) and the new clone exclusive.  On failure the caller removes the clone, which also returns
+ * the references already added.
+ **/
+static bool    fs_clone_inode(FileSystem *fs, size_t inode_number, size_t clone)
+{
+    Inode source;
+    Inode inode;
+
+    if (!fs_load_inode(fs, inode_number, &source))
+        return false;
+
+    if (!fs_enable_shares(fs))
+        return false;
+
+    // inline文件直接复制
+    if (source.valid & INODE_INLINE)
+    {
+        char   buffer[INLINE_MAX];
+        size_t size = fs_inode_size(&source);
+        return fs_read_inode(fs, inode_number, buffer, size, 0) == (ssize_t)size &&
+               (!size || fs_write_inode(fs, clone, buffer, size, 0) == (ssize_t)size);
+    }
+
+    memset(&inode, 0, sizeof(Inode));
+    inode.valid = INODE_VALID | (fs_features(&fs->meta_data) & FS_FEATURE_EXTENTS ? INODE_EXTENTS : 0);
+
+    FileMap from;
+    FileMap to;
+    if (!fs_map_open(fs, &from, &source, fs_inode_group(&fs->meta_data, inode_number)))
+        return false;
+    if (!fs_map_open(fs, &to, &inode, fs_inode_group(&fs->meta_data, clone)))
+    {
+        fs_map_free(&from);
+        return false;
+    }
+
+    // 按段共享数据块, 每个块多一个引用
+    size_t blocks = UPPER_ROUND(fs_inode_size(&source), BLOCK_SIZE);
+    size_t idx    = fs_map_share(&from, &to, blocks);
+    fs_map_free(&from);
+
+    // 没能映射所有的块时, 删除clone会还回已经加上的引用
+    fs_inode_set_size(&inode, fs_inode_size(&source));
+    bool ok = fs_map_close(&to) && idx >= blocks;
+    return fs_save_inode(fs, clone, &inode) && ok;
+}
+
+/**
+ * Copy length bytes from one Inode to another inside the file system by
+ * doing the following:
+ *
+ *  1. Load and map both Inodes once (inline files, delayed allocation and
+ *  copies inside one file go through fs_read/fs_write in batches of
+ *  IOV_BATCH_BLOCKS blocks instead).
+ *
+ *  2. Copy whole blocks disk to disk in runs (see fs_map_copy), and only
+ *  the partial blocks at either end through a block buffer.
+ *
+ *  3. Write back the target mapping and Inode once.
+ *
+ *  Note: The copy stops at the end of the source file.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       src_inode       Inode to copy data from.
+ * @param       src_offset      Byte offset in the source to begin copying from.
+ * @param       dst_inode       Inode to copy data to.
+ * @param       dst_offset      Byte offset in the target to begin copying to.
+ * @param       length          Number of bytes to copy.
+ * @return      Number of bytes copied (-1 on error).
+ **/
+ssize_t fs_copy_range(FileSystem *fs, size_t src_inode, size_t src_offset, size_t dst_inode, size_t dst_offset,
+                      size_t length) {
+    fs_lock_pair_flushed(fs, src_inode, dst_inode);
+    ssize_t copied = fs_copy_inode(fs, src_inode, src_offset, dst_inode, dst_offset, length);
+    fs_unlock_pair(fs, src_inode, dst_inode);
+    return copied;
+}
+
+/**
+ * Body of fs_copy_range, run with the source locked shared (and written
+ * back, see fs_lock_pair_flushed) and the target exclusive.
+ **/
+static ssize_t fs_copy_inode(FileSystem *fs, size_t src_inode, size_t src_offset, size_t dst_inode,
+                             size_t dst_offset, size_t length)
+{
+    Inode source;
+    Inode target;
+
+    if (fs->options & FS_MOUNT_READONLY)
+        return -1;
+
+    if (!fs_load_inode(fs, src_inode, &source) || !fs_load_inode(fs, dst_inode, &target))
+        return -1;
+
+    size_t size = fs_inode_size(&source);
+    if (src_offset >= size || !length)
+        return 0;
+    length = min(length, size - src_offset);
+
+    if (source.valid & INODE_INLINE || target.valid & INODE_INLINE || fs->options & FS_MOUNT_DELALLOC ||
+        src_inode == dst_inode)
+        return fs_copy_buffered(fs, src_inode, src_offset, dst_inode, dst_offset, length);
+
+    FileMap from;
+    FileMap to;
+    if (!fs_map_open(fs, &from, &source, fs_inode_group(&fs->meta_data, src_inode)))
+        return -1;
+    if (!fs_map_open(fs, &to, &target, fs_inode_group(&fs->meta_data, dst_inode)))
+    {
+        fs_map_free(&from);
+        return -1;
+    }
+
+    fs_journal_start(fs);
+    fs_writer_enter(fs);
+    ssize_t copied = fs_map_copy(&from, src_offset, &to, dst_offset, length);
+
+    fs_map_free(&from);
+    bool ok = fs_map_close(&to);
+    ok      = fs_save_inode(fs, dst_inode, &target) && ok;
+    fs_writer_exit(fs);
+    fs_journal_stop(fs);
+    return ok ? copied : -1;
+}
+
+/**
+ * Deduplicate the data blocks of the whole file system by doing the
+ * following:
+ *
+ *  1. Write back data buffered by delayed allocation and start counting
+ *  shared blocks (as fs_clone does).
+ *
+ *  2. Walk every block mapped file, reading its written blocks in runs of
+ *  up to IOV_BATCH_BLOCKS blocks and hashing each one (fs_block_hash).
+ *
+ *  3. Look the hash up in an index of blocks seen so far.  A block whose
+ *  contents match an indexed block is remapped to it (one more reference)
+ *  and released; otherwise it is added to the index.
+ *
+ *  4. Write back the changed mappings and Inodes.
+ *
+ *  Note: Every file is locked for the whole pass, so other calls wait for
+ *  it, and handles from fs_open reload their block maps afterwards.  Files
+ *  that later write a deduplicated block get a private copy (see
+ *  fs_map_unshare).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @return      Number of blocks remapped to an identical block (-1 on error).
+ **/
+ssize_t fs_dedup(FileSystem *fs) {
+    fs_lock_all(fs);
+    ssize_t deduped = fs_dedup_all(fs);
+    fs_unlock_all(fs);
+    return deduped;
+}
+
+/**
+ * Body of fs_dedup, run with every file locked.
+ **/
+static ssize_t fs_dedup_all(FileSystem *fs)
+{
+    if (fs->options & FS_MOUNT_READONLY)
+        return -1;
+    if (fs->options & FS_MOUNT_DELALLOC)
+    {
+        fs_delalloc_flush_all(fs);
+    }
+    if (!fs_enable_shares(fs))
+        return -1;
+
+    // 开放寻址的hash表, 至少一半是空的
+    size_t slots = 1;
+    while (slots < 2 * fs->meta_data.blocks)
+        slots <<= 1;
+    DedupEntry *index  = (DedupEntry *)calloc(slots, sizeof(DedupEntry));
+    char       *buffer = (char *)malloc(IOV_BATCH_BLOCKS * BLOCK_SIZE);
+    if (!index || !buffer)
+    {
+        free(index);
+        free(buffer);
+        return -1;
+    }
+
+    ssize_t remapped = 0;
+    Block   table;
+    for (size_t i = 0; i < fs->meta_data.inode_blocks && remapped >= 0; ++i)
+    {
+        if (!fs_read_table(fs, fs_table_block(fs, i), &table))
+        {
+            remapped = -1;
+            break;
+        }
+
+        for (size_t j = 0; j < INODES_PER_BLOCK; ++j)
+        {
+            Inode   inode = table.inodes[j];
+            size_t  inode_number = i * INODES_PER_BLOCK + j;
+            FileMap map;
+            if (!(inode.valid & INODE_VALID) || inode.valid & (INODE_INLINE | INODE_SLOT))
+                continue;
+            if (!fs_map_open(fs, &map, &inode, fs_inode_group(&fs->meta_data, inode_number)))
+            {
+                remapped = -1;
+                break;
+            }
+
+            fs_journal_start(fs);
+            size_t n  = fs_dedup_file(fs, &map, index, slots - 1, buffer);
+            bool   ok = fs_map_close(&map) && (!n || fs_save_inode(fs, inode_number, &inode));
+            fs_journal_stop(fs);
+            if (!ok)
+            {
+                remapped = -1;
+                break;
+            }
+            remapped += n;
+        }
+    }
+
+    free(index);
+    free(buffer);
+    return remapped;
+}
+
+/**
+ * Compact the log (FS_MOUNT_LOG) by doing the following:
+ *
+ *  1. Write back data buffered by delayed allocation and commit the journal,
+ *  so every freed block is back in the free block bitmap.
+ *
+ *  2. Count the blocks in use in each segment.  Segments at most half full
+ *  (other than the one of the log head) are cleaned.
+ *
+ *  3. Walk every block mapped file and move its data blocks out of those
+ *  segments, in runs, to the log head (fs_clean_file).  Blocks shared with
+ *  clones or snapshots stay where they are.
+ *
+ *  4. Write back the changed mappings and Inodes.
+ *
+ *  Note: Like fs_dedup this locks every file for the whole pass.  Metadata
+ *  blocks (indirect blocks, extent tree nodes) are not moved.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @return      Number of blocks moved (-1 on error).
+ **/
+ssize_t fs_clean(FileSystem *fs) {
+    fs_lock_all(fs);
+    ssize_t moved = fs_clean_all(fs);
+    fs_unlock_all(fs);
+    return moved;
+}
+
+/**
+ * Body of fs_clean, run with every file locked.
+ **/
+static ssize_t fs_clean_all(FileSystem *fs)
+{
+    if (fs->options & FS_MOUNT_READONLY || !(fs->options & FS_MOUNT_LOG))
+        return -1;
+    if (fs->options & FS_MOUNT_DELALLOC)
+    {
+        fs_delalloc_flush_all(fs);
+    }
+    fs_wait_scanned(fs, fs->meta_data.inode_blocks);
+    if (!fs_journal_commit(fs))
+        return -1;
+
+    SuperBlock *sb       = &fs->meta_data;
+    size_t      segments = UPPER_ROUND(sb->blocks - fs_group_data_start(sb, 0), LOG_SEGMENT_BLOCKS);
+    size_t     *used     = (size_t *)calloc(segments, sizeof(size_t));
+    size_t     *data     = (size_t *)calloc(segments, sizeof(size_t));
+    bool       *victims  = (bool *)calloc(segments, sizeof(bool));
+    char       *buffer   = (char *)malloc(IOV_BATCH_BLOCKS * BLOCK_SIZE);
+    if (!used || !data || !victims || !buffer)
+    {
+        free(used);
+        free(data);
+        free(victims);
+        free(buffer);
+        return -1;
+    }
+
+    // 只有整段都是数据块的segment才可能清空
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (size_t g = 0; g < fs_group_count(sb); ++g)
+        for (size_t b = fs_group_data_start(sb, g); b < fs_group_data_end(sb, g); ++b)
+        {
+            if (fs_features(sb) & FS_FEATURE_JOURNAL && b >= sb->journal && b < sb->journal + sb->journal_blocks)
+                continue;
+            ++data[fs_log_segment(sb, b)];
+            used[fs_log_segment(sb, b)] += !fs->free_blocks[b];
+        }
+    size_t head = fs->log_head;
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    size_t nvictims = 0;
+    for (size_t s = 0; s < segments; ++s)
+    {
+        victims[s] = data[s] == LOG_SEGMENT_BLOCKS && used[s] && used[s] <= LOG_SEGMENT_BLOCKS / 2 &&
+                     !(head >= fs_group_data_start(sb, 0) && s == fs_log_segment(sb, head));
+        nvictims += victims[s];
+    }
+
+    ssize_t moved = 0;
+    Block   table;
+    for (size_t i = 0; i < sb->inode_blocks && nvictims && moved >= 0; ++i)
+    {
+        if (!fs_read_table(fs, fs_table_block(fs, i), &table))
+        {
+            moved = -1;
+            break;
+        }
+
+        for (size_t j = 0; j < INODES_PER_BLOCK; ++j)
+        {
+            Inode   inode = table.inodes[j];
+            size_t  inode_number = i * INODES_PER_BLOCK + j;
+            FileMap map;
+            if (!(inode.valid & INODE_VALID) || inode.valid & (INODE_INLINE | INODE_SLOT))
+                continue;
+            if (!fs_map_open(fs, &map, &inode, fs_inode_group(sb, inode_number)))
+            {
+                moved = -1;
+                break;
+            }
+
+            fs_journal_start(fs);
+            size_t n  = fs_clean_file(fs, &map, victims, buffer);
+            bool   ok = fs_map_close(&map) && (!n || fs_save_inode(fs, inode_number, &inode));
+            fs_journal_stop(fs);
+            if (!ok)
+            {
+                moved = -1;
+                break;
+            }
+            moved += n;
+        }
+    }
+
+    free(used);
+    free(data);
+    free(victims);
+    free(buffer);
+    return moved;
+}
+
+/**
+ * Take a named, read-only snapshot of the whole file system by doing the
+ * following:
+ *
+ *  1. Start counting shared blocks (as fs_clone does).
+ *
+ *  2. Allocate the snapshot directory (the first snapshot only), an index
+ *  of the snapshot's Inode table blocks, and one zero block that stands in
+ *  for every empty Inode table block.
+ *
+ *  3. Copy each Inode table block that holds an Inode, after writing back
+ *  the data its files buffered by delayed allocation.  Inline files are
+ *  copied along with the block; block mapped files get their own copy of
+ *  the mapping (indirect blocks, extent tree) that shares every data block
+ *  with the live file (see fs_snapshot_inode).
+ *
+ *  4. Write the index and record the snapshot in the directory.
+ *
+ *  Note: No data block is copied.  The live files copy a shared block the
+ *  first time they write to it (see fs_map_unshare), so the snapshot keeps
+ *  reading the old contents.  The cost grows with the number of files and
+ *  the size of their mappings, not with the amount of data.
+ *
+ *  Note: Writes are not stopped for the pass.  Only the files of the Inode
+ *  table block being copied are locked, so calls on those files wait for
+ *  one block, and the snapshot holds each file as it was when its block was
+ *  copied.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       name            Name of the snapshot.
+ * @return      Whether or not the snapshot was taken.
+ **/
+bool    fs_snapshot(FileSystem *fs, const char *name) {
+    Block directory;
+    Block block;
+
+    if (fs->options & FS_MOUNT_READONLY || !name || !*name || strlen(name) >= SNAPSHOT_NAME_LENGTH)
+        return false;
+
+    if (!fs_enable_shares(fs))
+        return false;
+
+    // 其他snapshot可能同时在改目录
+    pthread_mutex_lock(&fs->super_lock);
+    bool free_slot = fs_snapshot_load(fs->disk, &fs->meta_data, &directory) &&
+                     fs_snapshot_find(&directory, name) < 0 && fs_snapshot_find(&directory, NULL) >= 0;
+    bool first     = !fs->meta_data.snapshots;
+    pthread_mutex_unlock(&fs->super_lock);
+    if (!free_slot)
+        return false;
+
+    // 第一个snapshot时分配目录块, 记在super block里
+    if (first)
+    {
+        ssize_t directory_block = fs_allocate_free_block(fs, 0);
+        if (directory_block < 0)
+            return false;
+        memset(block.data, 0, BLOCK_SIZE);
+        if (disk_write(fs->disk, directory_block, block.data) == DISK_FAILURE)
+        {
+            fs_release_free_block(fs, directory_block);
+            return false;
+        }
+
+        pthread_mutex_lock(&fs->super_lock);
+        bool ok = true;
+        if (fs->meta_data.snapshots)
+            fs_release_free_block(fs, directory_block);
+        else
+        {
+            fs->meta_data.snapshots = directory_block;
+            __atomic_or_fetch(&fs->meta_data.features, FS_FEATURE_SNAPSHOTS, __ATOMIC_RELAXED);
+            ok = fs_write_super(fs);
+        }
+        pthread_mutex_unlock(&fs->super_lock);
+        if (!ok)
+            return false;
+    }
+
+    // inode table的索引放在连续的块里
+    size_t    nindex = UPPER_ROUND(fs->meta_data.inode_blocks, POINTERS_PER_BLOCK);
+    size_t    table;
+    size_t    got    = fs_allocate_free_run(fs, 0, nindex, &table);
+    ssize_t   zero   = got < nindex ? -1 : fs_allocate_free_block(fs, 0);
+    uint32_t *index  = zero < 0 ? NULL : (uint32_t *)calloc(nindex, BLOCK_SIZE);
+    if (!index)
+    {
+        if (got)
+            fs_release_free_run(fs, table, got);
+        if (zero >= 0)
+            fs_release_free_block(fs, zero);
+        return false;
+    }
+
+    memset(block.data, 0, BLOCK_SIZE);
+    bool ok = disk_write(fs->disk, zero, block.data) != DISK_FAILURE;
+
+    // 复制有inode的块, 空的块都指向全0块
+    for (size_t i = 0; ok && i < fs->meta_data.inode_blocks; ++i)
+    {
+        // 只锁这个块里的文件, 其他文件的写不用停
+        fs_lock_inode_block(fs, i);
+
+        // 先写回缓存的数据, snapshot才能共享它们
+        for (size_t j = 0; fs->options & FS_MOUNT_DELALLOC && j < INODES_PER_BLOCK; ++j)
+        {
+            DirtyFile *df = fs_delalloc_find(fs, i * INODES_PER_BLOCK + j);
+            if (df)
+                fs_delalloc_flush(fs, df);
+        }
+
+        pthread_mutex_lock(fs_table_lock(fs, i * INODES_PER_BLOCK));
+        ok = fs_read_table(fs, fs_table_block(fs, i), &block);
+        pthread_mutex_unlock(fs_table_lock(fs, i * INODES_PER_BLOCK));
+
+        bool empty = true;
+        for (size_t j = 0; ok && j < INODES_PER_BLOCK; ++j)
+            empty = empty && !block.inodes[j].valid;
+        if (!ok || empty)
+        {
+            fs_unlock_inode_block(fs, i);
+            index[i] = zero;
+            continue;
+        }
+
+        ssize_t copy = fs_allocate_free_block(fs, fs_inode_group(&fs->meta_data, i * INODES_PER_BLOCK));
+        if (copy < 0)
+        {
+            fs_unlock_inode_block(fs, i);
+            ok = false;
+            break;
+        }
+        for (size_t j = 0; ok && j < INODES_PER_BLOCK; ++j)
+        {
+            Inode *pi = &block.inodes[j];
+            if (pi->valid & INODE_VALID && !(pi->valid & INODE_INLINE))
+                ok = fs_snapshot_inode(fs, i * INODES_PER_BLOCK + j, pi);
+        }
+        fs_unlock_inode_block(fs, i);
+
+        // 失败时也写下来, 删除时才能还回共享的块
+        index[i] = copy;
+        ok = disk_write(fs->disk, copy, block.data) != DISK_FAILURE && ok;
+    }
+
+    for (size_t i = 0; ok && i < nindex; ++i)
+        ok = disk_write(fs->disk, table + i, (char *)index + i * BLOCK_SIZE) != DISK_FAILURE;
+
+    // 先提交日志, 记下snapshot时live文件系统已经在磁盘上了
+    ok = ok && fs_journal_commit(fs);
+
+    // 在目录里记下snapshot (同名的snapshot可能同时被创建)
+    if (ok)
+    {
+        pthread_mutex_lock(&fs->super_lock);
+        ssize_t k = -1;
+        ok = fs_snapshot_load(fs->disk, &fs->meta_data, &directory) && fs_snapshot_find(&directory, name) < 0 &&
+             (k = fs_snapshot_find(&directory, NULL)) >= 0;
+        if (ok)
+        {
+            memset(&directory.snapshots[k], 0, sizeof(Snapshot));
+            strcpy(directory.snapshots[k].name, name);
+            directory.snapshots[k].table = table;
+            directory.snapshots[k].zero  = zero;
+            ok = disk_write(fs->disk, fs->meta_data.snapshots, directory.data) != DISK_FAILURE;
+        }
+        pthread_mutex_unlock(&fs->super_lock);
+    }
+
+    if (!ok)
+        fs_snapshot_drop(fs, index, table, zero);
+    free(index);
+    return ok;
+}
+
+/**
+ * Delete the named snapshot by doing the following:
+ *
+ *  1. Remove it from the snapshot directory.
+ *
+ *  2. Release the mappings of its Inodes (data blocks still used by the
+ *  live files or other snapshots only lose a reference), its copies of the
+ *  Inode table blocks, its zero block and its index.
+ *
+ *  Note: The snapshot must not be mounted.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       name            Name of the snapshot.
+ * @return      Whether or not the snapshot was deleted.
+ **/
+bool    fs_delete_snapshot(FileSystem *fs, const char *name) {
+    fs_lock_all(fs);
+    bool deleted = fs_snapshot_delete(fs, name);
+    fs_unlock_all(fs);
+    return deleted;
+}
+
+/**
+ * Body of fs_delete_snapshot, run with every file locked.
+ **/
+static bool    fs_snapshot_delete(FileSystem *fs, const char *name)
+{
+    Block    directory;
+    Snapshot snap;
+
+    if (fs->options & FS_MOUNT_READONLY || !name)
+        return false;
+
+    // 共享的块要先数完引用
+    fs_wait_scanned(fs, fs->meta_data.inode_blocks);
+
+    pthread_mutex_lock(&fs->super_lock);
+    ssize_t k  = -1;
+    bool    ok = fs_snapshot_load(fs->disk, &fs->meta_data, &directory) &&
+                 (k = fs_snapshot_find(&directory, name)) >= 0;
+    if (ok)
+    {
+        snap = directory.snapshots[k];
+        memset(&directory.snapshots[k], 0, sizeof(Snapshot));
+        ok = disk_write(fs->disk, fs->meta_data.snapshots, directory.data) != DISK_FAILURE;
+    }
+    pthread_mutex_unlock(&fs->super_lock);
+    if (!ok)
+        return false;
+
+    uint32_t *index = fs_snapshot_index(fs->disk, &fs->meta_data, snap.table);
+    if (!index)
+    {
+        error("Fail to read inode table index of snapshot %s\n", name);
+        return false;
+    }
+    fs_snapshot_drop(fs, index, snap.table, snap.zero);
+    free(index);
+    return true;
+}
+
+/**
+ * Read from the specified Inode into several buffers, filling them in order
+ * with the bytes beginning from the specified offset.
+ *
+ *  Note: The Inode is loaded and mapped once, and the blocks are read in
+ *  batches of IOV_BATCH_BLOCKS blocks (see fs_iov_transfer).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       iov             Buffers to copy data to.
+ * @param       iovcnt          Number of buffers.
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_readv(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt, size_t offset) {
+    fs_lock_inode(fs, inode_number, false);
+    ssize_t bytes_read = fs_iov_transfer(fs, inode_number, iov, iovcnt, offset, false);
+    fs_unlock_inode(fs, inode_number);
+    return bytes_read;
+}
+
+/**
+ * Write to the specified Inode from several buffers, draining them in order
+ * into the bytes beginning from the specified offset.
+ *
+ *  Note: The Inode is loaded, mapped, expanded and saved once, and the
+ *  buffers are gathered into batches of IOV_BATCH_BLOCKS blocks, so many
+ *  small records cost about as much as one large write.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       iov             Buffers with data to copy.
+ * @param       iovcnt          Number of buffers.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes write (-1 on error).
+ **/
+ssize_t fs_writev(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt, size_t offset) {
+    fs_lock_inode(fs, inode_number, true);
+    ssize_t bytes_write = fs_iov_transfer(fs, inode_number, iov, iovcnt, offset, true);
+    fs_unlock_inode(fs, inode_number);
+    return bytes_write;
+}
+
+/**
+ * Open the specified Inode and return a handle that keeps the Inode and its
+ * block map (indirect block, cached double/triple indirect path or extent
+ * list) in memory, so fs_pread and fs_pwrite do not load them again.
+ *
+ *  Note: The file may still be changed by inode number or through other
+ *  handles; a handle reloads its copies the next time it is used after such
+ *  a change (see fs_file_refresh).  A handle must not be used by two
+ *  threads at once.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to open.
+ * @return      Handle of the open file (NULL on error).
+ **/
+File *  fs_open(FileSystem *fs, size_t inode_number) {
+    File *file = (File *)calloc(1, sizeof(File));
+    if (!file)
+        return NULL;
+
+    file->fs           = fs;
+    file->inode_number = inode_number;
+    fs_lock_inode(fs, inode_number, false);
+    bool loaded = fs_file_load(file);
+    fs_unlock_inode(fs, inode_number);
+    if (!loaded)
+    {
+        fs_map_free(&file->map);
+        free(file);
+        return NULL;
+    }
+    return file;
+}
+
+/**
+ * Close a file handle and release the memory it pins.
+ *
+ * @param       file            Handle returned by fs_open.
+ * @return      Whether or not the file was closed cleanly.
+ **/
+bool    fs_close(File *file) {
+    if (!file)
+        return false;
+
+    // fs_pwrite已经写回了所有修改
+    fs_map_free(&file->map);
+    free(file);
+    return true;
+}
+
+/**
+ * Read from an open file into the data buffer exactly length bytes beginning
+ * from the specified offset, using the pinned Inode and block map.
+ *
+ *  Note: Inline files and delayed allocation go through fs_read.
+ *
+ * @param       file            Handle returned by fs_open.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read.
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_pread(File *file, char *data, size_t length, size_t offset) {
+    FileSystem *fs = file->fs;
+
+    fs_lock_inode(fs, file->inode_number, false);
+    ssize_t bytes_read = !fs_file_refresh(file, false) ? -1
+                         : file->inode.valid & INODE_INLINE || fs->options & FS_MOUNT_DELALLOC
+                         ? fs_read_inode(fs, file->inode_number, data, length, offset)
+                         : fs_map_read(&file->map, data, length, offset);
+    fs_unlock_inode(fs, file->inode_number);
+    return bytes_read;
+}
+
+/**
+ * Write to an open file from the data buffer exactly length bytes beginning
+ * from the specified offset by doing the following:
+ *
+ *  1. Reload the pinned Inode and block map if anything else changed the
+ *  file since the handle last used them (see fs_file_refresh).
+ *
+ *  2. Write the blocks through the pinned block map.
+ *
+ *  3. Write back the changed parts of the map, and the Inode only if it
+ *  changed.
+ *
+ *  Note: Inline files and delayed allocation go through fs_write, after
+ *  which the handle reloads the Inode.
+ *
+ * @param       file            Handle returned by fs_open.
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes write (-1 on error).
+ **/
+ssize_t fs_pwrite(File *file, char *data, size_t length, size_t offset) {
+    FileSystem *fs = file->fs;
+
+    if (fs->options & FS_MOUNT_READONLY)
+        return -1;
+
+    fs_lock_inode(fs, file->inode_number, true);
+    if (!fs_file_refresh(file, true))
+    {
+        fs_unlock_inode(fs, file->inode_number);
+        return -1;
+    }
+    if (file->inode.valid & INODE_INLINE || fs->options & FS_MOUNT_DELALLOC)
+    {
+        ssize_t bytes_write = fs_write_inode(fs, file->inode_number, data, length, offset);
+        fs_map_free(&file->map);
+        bool    loaded      = fs_file_load(file);
+        fs_unlock_inode(fs, file->inode_number);
+        return loaded ? bytes_write : -1;
+    }
+
+    Inode saved = file->inode;
+
+    fs_journal_start(fs);
+    fs_writer_enter(fs);
+    ssize_t bytes_write = fs_map_write(&file->map, data, length, offset);
+
+    // 只有inode变了才需要写回
+    bool ok = fs_map_flush(&file->map);
+    if (memcmp(&saved, &file->inode, sizeof(Inode)))
+        ok = fs_save_inode(fs, file->inode_number, &file->inode) && ok;
+    fs_writer_exit(fs);
+    fs_journal_stop(fs);
+    fs_unlock_inode(fs, file->inode_number);
+
+    return ok ? bytes_write : -1;
+}
+
+/**
+ * Read length bytes of an open file beginning from the specified offset
+ * without copying them into a caller buffer, by doing the following:
+ *
+ *  1. Read the blocks covering the range straight into one block buffer
+ *  (contiguous blocks with a single disk request).
+ *
+ *  2. Describe the range as views (iovecs) into that buffer; holes point at
+ *  a shared zero block and cost neither I/O nor memory.
+ *
+ *  Note: The block buffer is allocated for the view and holds a private
+ *  copy of the data; views do not point into any cache.  They are read-only
+ *  and stay valid until fs_release_view.  Inline files and delayed
+ *  allocation are read with fs_read into the buffer.
+ *
+ * @param       file            Handle returned by fs_open.
+ * @param       length          Number of bytes to read.
+ * @param       offset          Byte offset from which to begin reading.
+ * @param       view            Receives the views of the range.
+ * @return      Number of bytes the views cover (-1 on error).
+ **/
+ssize_t fs_read_view(File *file, size_t length, size_t offset, FileView *view) {
+    FileSystem *fs = file->fs;
+
+    memset(view, 0, sizeof(FileView));
+
+    // fs_pwrite在写锁里改inode, 先拿读锁再看类型和大小
+    fs_lock_inode(fs, file->inode_number, false);
+    if (!fs_file_refresh(file, false))
+    {
+        fs_unlock_inode(fs, file->inode_number);
+        return -1;
+    }
+    if (file->inode.valid & INODE_INLINE || fs->options & FS_MOUNT_DELALLOC)
+    {
+        view->blocks = (char *)malloc(max(length, (size_t)1));
+        view->iov    = (struct iovec *)malloc(sizeof(struct iovec));
+        ssize_t bytes_read = view->blocks && view->iov
+                             ? fs_read_inode(fs, file->inode_number, view->blocks, length, offset) : -1;
+        fs_unlock_inode(fs, file->inode_number);
+        if (bytes_read > 0)
+            fs_view_append(view, view->blocks, bytes_read);
+        else
+            fs_release_view(view);
+        return bytes_read;
+    }
+
+    size_t size = fs_inode_size(&file->inode);
+    if (offset >= size)
+    {
+        fs_unlock_inode(fs, file->inode_number);
+        return 0;
+    }
+    length = min(length, size - offset);
+
+    size_t first = offset / BLOCK_SIZE;
+    size_t last  = UPPER_ROUND(offset + length, BLOCK_SIZE);
+    view->blocks = (char *)malloc((last - first) * BLOCK_SIZE);
+    view->iov    = (struct iovec *)malloc((last - first) * sizeof(struct iovec));
+    if (!view->blocks || !view->iov)
+    {
+        fs_unlock_inode(fs, file->inode_number);
+        fs_release_view(view);
+        return -1;
+    }
+
+    size_t idx     = first;
+    size_t covered = 0;
+    while (idx < last)
+    {
+        size_t   run     = last - idx;
+        uint32_t pointer = fs_map_get(&file->map, idx, &run);
+        char    *base    = view->blocks + (idx - first) * BLOCK_SIZE;
+        if (!run)
+            break;
+
+        if (pointer & POINTER_UNWRITTEN)
+            memset(base, 0, run * BLOCK_SIZE);
+        else if (pointer && disk_read_blocks(fs->disk, pointer, run, base) == DISK_FAILURE)
+        {
+            error("Fail to read blocks %d+%lu\n", pointer, run);
+            fs_unlock_inode(fs, file->inode_number);
+            fs_release_view(view);
+            return -1;
+        }
+
+        // 只保留[offset, offset + length)的部分
+        for (size_t b = idx; b < idx + run; ++b)
+        {
+            size_t start = max(b * BLOCK_SIZE, offset);
+            size_t end   = min((b + 1) * BLOCK_SIZE, offset + length);
+            char  *data  = pointer ? base + (b - idx) * BLOCK_SIZE : (char *)ZERO_BLOCK;
+            fs_view_append(view, data + start % BLOCK_SIZE, end - start);
+            covered += end - start;
+        }
+        idx += run;
+    }
+    fs_unlock_inode(fs, file->inode_number);
+
+    // 映射提前结束时只返回views实际覆盖的部分
+    if (!covered)
+        fs_release_view(view);
+    return covered;
+}
+
+/**
+ * Release the views and the block buffer returned by fs_read_view.
+ *
+ * @param       view            Views to release.
+ **/
+void    fs_release_view(FileView *view) {
+    free(view->iov);
+    free(view->blocks);
+    memset(view, 0, sizeof(FileView));
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
+
+/* Internal Functions */
+
+/**
+ * Compute block group geometry from the number of blocks: every group
+ * holds group_blocks blocks (the last one also absorbs a remainder too small
+ * to be a group of its own), starting with its slice of the inode table
+ * and followed by its data region.
+ **/
+static void    fs_group_geometry(SuperBlock *sb)
+{
+    size_t usable       = sb->blocks - 1;
+    size_t group_blocks = min(usable, BLOCKS_PER_GROUP);
+    size_t inode_blocks = UPPER_ROUND(group_blocks, 10);
+    size_t groups       = usable / group_blocks;
+
+    if (usable % group_blocks > inode_blocks)
+        ++groups;
+
+    sb->groups             = groups;
+    sb->group_blocks       = group_blocks;
+    sb->group_inode_blocks = inode_blocks;
+    sb->inode_blocks       = groups * inode_blocks;
+    sb->inodes             = sb->inode_blocks * INODES_PER_BLOCK;
+}
+
+/**
+ * Read the feature flags of a SuperBlock.  fs_add_feature may set a flag
+ * while other threads read them, so the word is read atomically.
+ **/
+static uint32_t fs_features(const SuperBlock *sb)
+{
+    return __atomic_load_n(&sb->features, __ATOMIC_RELAXED);
+}
+
+/* The original layout is treated as a single group spanning the disk */
+
+static size_t  fs_group_count(const SuperBlock *sb)
+{
+    return (fs_features(sb) & FS_FEATURE_GROUPS) ? sb->groups : 1;
+}
+
+static size_t  fs_group_inode_blocks(const SuperBlock *sb)
+{
+    return (fs_features(sb) & FS_FEATURE_GROUPS) ? sb->group_inode_blocks : sb->inode_blocks;
+}
+
+static size_t  fs_group_data_start(const SuperBlock *sb, size_t group)
+{
+    if (!(fs_features(sb) & FS_FEATURE_GROUPS))
+        return 1 + sb->inode_blocks;
+    return 1 + group * sb->group_blocks + sb->group_inode_blocks;
+}
+
+static size_t  fs_group_data_end(const SuperBlock *sb, size_t group)
+{
+    if (!(fs_features(sb) & FS_FEATURE_GROUPS) || group + 1 == sb->groups)
+        return sb->blocks;
+    return 1 + (group + 1) * sb->group_blocks;
+}
+
+static size_t  fs_inode_group(const SuperBlock *sb, size_t inode_number)
+{
+    return inode_number / (fs_group_inode_blocks(sb) * INODES_PER_BLOCK);
+}
+
+static size_t  fs_block_group(const SuperBlock *sb, size_t block_number)
+{
+    if (!(fs_features(sb) & FS_FEATURE_GROUPS))
+        return 0;
+    return min((block_number - 1) / sb->group_blocks, sb->groups - 1);
+}
+
+/**
+ * Map the index-th block of the Inode table to its disk block.
+ **/
+static size_t  fs_inode_table_block(const SuperBlock *sb, size_t index)
+{
+    if (!(fs_features(sb) & FS_FEATURE_GROUPS))
+        return 1 + index;
+    return 1 + (index / sb->group_inode_blocks) * sb->group_blocks + index % sb->group_inode_blocks;
+}
+
+
+/**
+ * Map the index-th block of the mounted Inode table (the live one, or the
+ * copy of a mounted snapshot) to its disk block.
+ **/
+static size_t  fs_table_block(FileSystem *fs, size_t index)
+{
+    if (fs->snapshot_table)
+        return fs->snapshot_table[index];
+    return fs_inode_table_block(&fs->meta_data, index);
+}
+
+
+static bool    fs_load_inode(FileSystem *fs, size_t inode_number, Inode *node)
+{
+    if (inode_number >= fs->meta_data.inodes)
+        return false;
+
+    // 只拷贝这一个inode, 读者不在inode缓存锁里拷整个块
+    size_t inode_block_number = fs_table_block(fs, inode_number / INODES_PER_BLOCK);
+    size_t offset             = (inode_number % INODES_PER_BLOCK) * sizeof(Inode);
+    if (!fs_read_table_range(fs, inode_block_number, offset, (char *)node, sizeof(Inode)))
+    {
+        debug("Fail to read inode %d\n", inode_number);
+        return false;
+    }
+
+    // inline数据的slot不是文件
+    return node->valid & INODE_VALID;
+}
+
+
+/**
+ * Read the Inode table block holding the specified Inode.
+ **/
+static bool    fs_load_inode_block(FileSystem *fs, size_t inode_number, Block *block)
+{
+    if (inode_number >= fs->meta_data.inodes)
+        return false;
+
+    // inode block number
+    size_t inode_block_number = fs_table_block(fs, inode_number / INODES_PER_BLOCK);
+
+    if (!fs_read_table(fs, inode_block_number, block))
+    {
+        debug("Fail to read inode %d\n", inode_number);
+        return false;
+    }
+
+    return true;
+}
+
+
+static bool    fs_save_inode(FileSystem *fs, size_t inode_number, Inode *node)
+{
+    if (inode_number >= fs->meta_data.inodes)
+        return false;
+
+    // inode block number
+    size_t inode_block_number = fs_table_block(fs, inode_number / INODES_PER_BLOCK);
+    Block block;
+
+    // 同一个inode块里的其他inode可能被其他线程同时修改
+    pthread_mutex_t *table_lock = fs_table_lock(fs, inode_number);
+    pthread_mutex_lock(table_lock);
+    if (!fs_read_table(fs, inode_block_number, &block))
+    {
+        pthread_mutex_unlock(table_lock);
+        debug("Fail to read inode %d\n", inode_number);
+        return false;
+    }
+
+    inode_number %= INODES_PER_BLOCK;
+
+    memcpy(&block.inodes[inode_number], node, sizeof(Inode));
+
+    if (!fs_write_table(fs, inode_block_number, &block))
+    {
+        pthread_mutex_unlock(table_lock);
+        debug("Fail to write inode %d back\n", inode_number);
+        return false;
+    }
+    pthread_mutex_unlock(table_lock);
+    
+    return true;
+}
+
+
+/**
+ * Return the lock serializing read-modify-write of the Inode table block
+ * that holds the specified Inode (blocks share TABLE_LOCKS locks).
+ **/
+static pthread_mutex_t *fs_table_lock(FileSystem *fs, size_t inode_number)
+{
+    return &fs->table_locks[inode_number / INODES_PER_BLOCK % TABLE_LOCKS];
+}
+
+
+/**
+ * Lock a file for reading (shared) or for changing it (exclusive).  Inodes
+ * share INODE_LOCKS locks, so unrelated files only rarely wait for each
+ * other.
+ *
+ * Note: Every exclusive lock bumps the generation of the lock, so handles
+ * from fs_open can tell whether their copies may be stale (see
+ * fs_file_refresh).
+ **/
+static void    fs_lock_inode(FileSystem *fs, size_t inode_number, bool write)
+{
+    if (!fs->inode_locks)
+        return;
+
+    pthread_rwlock_t *lock = &fs->inode_locks[inode_number % INODE_LOCKS];
+    if (write)
+    {
+        pthread_rwlock_wrlock(lock);
+        ++fs->inode_generations[inode_number % INODE_LOCKS];
+    }
+    else
+        pthread_rwlock_rdlock(lock);
+}
+
+
+static void    fs_unlock_inode(FileSystem *fs, size_t inode_number)
+{
+    if (fs->inode_locks)
+        pthread_rwlock_unlock(&fs->inode_locks[inode_number % INODE_LOCKS]);
+}
+
+
+/**
+ * Lock the source of a copy shared and its target exclusive, in lock order
+ * so two copies in opposite directions cannot deadlock.
+ **/
+static void    fs_lock_pair(FileSystem *fs, size_t src_inode, size_t dst_inode)
+{
+    size_t src = src_inode % INODE_LOCKS;
+    size_t dst = dst_inode % INODE_LOCKS;
+
+    if (src == dst)
+        fs_lock_inode(fs, dst_inode, true);
+    else if (src < dst)
+    {
+        fs_lock_inode(fs, src_inode, false);
+        fs_lock_inode(fs, dst_inode, true);
+    }
+    else
+    {
+        fs_lock_inode(fs, dst_inode, true);
+        fs_lock_inode(fs, src_inode, false);
+    }
+}
+
+
+static void    fs_unlock_pair(FileSystem *fs, size_t src_inode, size_t dst_inode)
+{
+    fs_unlock_inode(fs, dst_inode);
+    if (src_inode % INODE_LOCKS != dst_inode % INODE_LOCKS)
+        fs_unlock_inode(fs, src_inode);
+}
+
+
+/**
+ * Lock a pair like fs_lock_pair once the source has no buffered data left,
+ * so its blocks can be shared or copied.  Writing the data back needs the
+ * source exclusive, so it happens before the pair is locked, and again if
+ * a writer buffered more in between.
+ **/
+static void    fs_lock_pair_flushed(FileSystem *fs, size_t src_inode, size_t dst_inode)
+{
+    fs_lock_pair(fs, src_inode, dst_inode);
+    while (fs->options & FS_MOUNT_DELALLOC && fs_delalloc_find(fs, src_inode))
+    {
+        fs_unlock_pair(fs, src_inode, dst_inode);
+        fs_lock_inode(fs, src_inode, true);
+        DirtyFile *df = fs_delalloc_find(fs, src_inode);
+        if (df)
+            fs_delalloc_flush(fs, df);
+        fs_unlock_inode(fs, src_inode);
+        fs_lock_pair(fs, src_inode, dst_inode);
+    }
+}
+
+
+/**
+ * Lock the files of one Inode table block exclusively, in lock order, so
+ * their buffered data can be written back and they cannot change while the
+ * block is copied.
+ **/
+static void    fs_lock_inode_block(FileSystem *fs, size_t block_index)
+{
+    size_t first = (block_index * INODES_PER_BLOCK) % INODE_LOCKS;
+    size_t count = min((size_t)INODES_PER_BLOCK, (size_t)INODE_LOCKS);
+
+    for (size_t k = 0; fs->inode_locks && k < INODE_LOCKS; ++k)
+    {
+        if ((k + INODE_LOCKS - first) % INODE_LOCKS < count)
+        {
+            pthread_rwlock_wrlock(&fs->inode_locks[k]);
+            ++fs->inode_generations[k];
+        }
+    }
+}
+
+
+static void    fs_unlock_inode_block(FileSystem *fs, size_t block_index)
+{
+    size_t first = (block_index * INODES_PER_BLOCK) % INODE_LOCKS;
+    size_t count = min((size_t)INODES_PER_BLOCK, (size_t)INODE_LOCKS);
+
+    for (size_t k = 0; fs->inode_locks && k < INODE_LOCKS; ++k)
+    {
+        if ((k + INODE_LOCKS - first) % INODE_LOCKS < count)
+            pthread_rwlock_unlock(&fs->inode_locks[k]);
+    }
+}
+
+
+/**
+ * Lock every file exclusively, for passes over the whole file system.
+ **/
+static void    fs_lock_all(FileSystem *fs)
+{
+    for (size_t k = 0; fs->inode_locks && k < INODE_LOCKS; ++k)
+    {
+        pthread_rwlock_wrlock(&fs->inode_locks[k]);
+        ++fs->inode_generations[k];
+    }
+}
+
+
+static void    fs_unlock_all(FileSystem *fs)
+{
+    for (size_t k = INODE_LOCKS; fs->inode_locks && k > 0; --k)
+        pthread_rwlock_unlock(&fs->inode_locks[k - 1]);
+}
+
+
+static void    fs_initialize_free_block_bitmap(FileSystem *fs)
+{
+    SuperBlock *sb     = &fs->meta_data;
+    size_t      groups = fs_group_count(sb);
+
+    fs->free_blocks = (bool *)malloc(sb->blocks * sizeof(bool));
+
+    // 只有clone过的文件系统才有共享的块
+    fs->block_shares = sb->features & FS_FEATURE_REFLINK ? (uint32_t *)calloc(sb->blocks, sizeof(uint32_t)) : NULL;
+
+    // every inode is free until the scanner finds it valid
+    fs->free_inodes = (bool *)malloc(sb->inodes * sizeof(bool));
+    memset(fs->free_inodes, true, sb->inodes * sizeof(bool));
+
+    fs->groups      = (BlockGroup *)calloc(groups, sizeof(BlockGroup));
+    fs->group_rotor = 0;
+
+    // super block and inode blocks are not free, data regions are free
+    // until the scanner proves otherwise
+    memset(fs->free_blocks, false, sb->blocks * sizeof(bool));
+    for (size_t g = 0; g < groups; ++g)
+    {
+        fs->groups[g].inode_hint = g * fs_group_inode_blocks(sb) * INODES_PER_BLOCK;
+        fs->groups[g].block_hint = fs_group_data_start(sb, g);
+        for (size_t i = fs_group_data_start(sb, g); i < fs_group_data_end(sb, g); ++i)
+            fs->free_blocks[i] = true;
+    }
+
+    // 日志块永远不空闲
+    if (sb->features & FS_FEATURE_JOURNAL)
+    {
+        memset(fs->free_blocks + sb->journal, false, sb->journal_blocks * sizeof(bool));
+        fs->groups[0].block_hint = sb->journal + sb->journal_blocks;
+    }
+}
+
+
+/**
+ * Scanner thread: walk the Inode table and mark every block referenced by a
+ * valid Inode as used, publishing progress after each inode block.
+ **/
+static void *  fs_scan_inode_table(void *arg)
+{
+    FileSystem *fs = (FileSystem *)arg;
+
+    // 找到磁盘中已经使用的块 set false
+    // 访问每一个inode块
+    Block block;
+    for (size_t i = 0; i < fs->meta_data.inode_blocks; ++i)
+    {
+        // 读入inode 块
+        if (!fs_read_table(fs, fs_table_block(fs, i), &block))
+        {
+            debug("Fail to read inode block\n");
+            exit(1);
+        }
+        
+        // 访问每一个inode
+        for (size_t j = 0; j < INODES_PER_BLOCK; ++j)
+        {
+            if (block.inodes[j].valid)
+            {
+                fs->free_inodes[i * INODES_PER_BLOCK + j] = false;
+                fs_scan_inode(fs, i * INODES_PER_BLOCK + j, &block.inodes[j]);
+            }
+        }
+
+        // 扫描完成后统计每个block group的空闲数据块
+        if (i + 1 == fs->meta_data.inode_blocks)
+        {
+            fs_scan_snapshots(fs);
+            for (size_t g = 0; g < fs_group_count(&fs->meta_data); ++g)
+            {
+                size_t end = fs_group_data_end(&fs->meta_data, g);
+                for (size_t b = fs_group_data_start(&fs->meta_data, g); b < end; ++b)
+                    fs->groups[g].free_count += fs->free_blocks[b];
+            }
+        }
+
+        // publish progress
+        pthread_mutex_lock(&fs->scan_lock);
+        __atomic_store_n(&fs->scanned, i + 1, __ATOMIC_RELEASE);
+        bool cancel = fs->scan_cancel;
+        pthread_cond_broadcast(&fs->scan_cond);
+        pthread_mutex_unlock(&fs->scan_lock);
+
+        if (cancel)
+            break;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Mark every block referenced by a valid Inode as used.
+ **/
+static void    fs_scan_inode(FileSystem *fs, size_t inode_number, Inode *pi)
+{
+    if (pi->valid & (INODE_INLINE | INODE_SLOT))
+    {
+        // 没有数据块
+    }
+    else if (pi->valid & INODE_EXTENTS)
+    {
+        FileMap map = {.fs = fs, .inode = pi};
+        if (!fs_extent_load(fs->disk, &map))
+        {
+            debug("Fail to read extent tree of inode %lu\n", inode_number);
+            exit(1);
+        }
+        for (size_t k = 0; k < map.nextents; ++k)
+            fs_scan_mark(fs, map.extents[k].start, EXTENT_LENGTH(map.extents[k].length));
+        for (size_t k = 0; k < map.nnodes; ++k)
+            fs->free_blocks[map.nodes[k]] = false;
+        fs_map_free(&map);
+    }
+    else
+    {
+        for (size_t k = 0; k < fs_inode_direct(pi); ++k)
+            if (pi->direct[k])
+                fs_scan_mark(fs, POINTER_BLOCK(pi->direct[k]), 1);
+        if (pi->indirect)
+        {
+            fs->free_blocks[pi->indirect] = false;
+
+            Block indirect_block;
+            // 读入indirect block
+            if (!fs_meta_read(fs, pi->indirect, indirect_block.data))
+            {
+                debug("Fail to read indirect block of inode %lu\n", inode_number);
+                exit(1);
+            }
+            for (size_t k = 0; k < POINTERS_PER_BLOCK; ++k)
+                if (indirect_block.pointers[k])
+                    fs_scan_mark(fs, POINTER_BLOCK(indirect_block.pointers[k]), 1);
+        }
+        if (pi->valid & INODE_INDIRECT3)
+        {
+            fs_scan_pointer_tree(fs, pi->double_indirect, 2);
+            fs_scan_pointer_tree(fs, pi->triple_indirect, 3);
+        }
+    }
+}
+
+
+/**
+ * Mark the snapshot directory, the snapshots' Inode table indexes and
+ * copies, and every block their Inodes reference as used (data blocks shared with the live files
+ * count one more reference each).
+ **/
+static void    fs_scan_snapshots(FileSystem *fs)
+{
+    Block directory;
+    Block block;
+
+    // snapshot自己挂载时不需要
+    if (fs->snapshot_table || !fs->meta_data.snapshots)
+        return;
+
+    if (!fs_snapshot_load(fs->disk, &fs->meta_data, &directory))
+    {
+        debug("Fail to read snapshot directory\n");
+        exit(1);
+    }
+    fs->free_blocks[fs->meta_data.snapshots] = false;
+
+    for (size_t k = 0; k < SNAPSHOTS_PER_BLOCK; ++k)
+    {
+        Snapshot *snap = &directory.snapshots[k];
+        if (!snap->table)
+            continue;
+
+        uint32_t *index = fs_snapshot_index(fs->disk, &fs->meta_data, snap->table);
+        if (!index)
+        {
+            debug("Fail to read inode table index of snapshot %.*s\n", SNAPSHOT_NAME_LENGTH, snap->name);
+            exit(1);
+        }
+        for (size_t i = 0; i < UPPER_ROUND(fs->meta_data.inode_blocks, POINTERS_PER_BLOCK); ++i)
+            fs->free_blocks[snap->table + i] = false;
+        fs->free_blocks[snap->zero] = false;
+
+        // 空的inode块都指向同一个全0块
+        for (size_t i = 0; i < fs->meta_data.inode_blocks; ++i)
+        {
+            if (index[i] == snap->zero)
+                continue;
+            if (disk_read(fs->disk, index[i], block.data) == DISK_FAILURE)
+            {
+                debug("Fail to read inode block of snapshot %.*s\n", SNAPSHOT_NAME_LENGTH, snap->name);
+                exit(1);
+            }
+            fs->free_blocks[index[i]] = false;
+            for (size_t j = 0; j < INODES_PER_BLOCK; ++j)
+                if (block.inodes[j].valid)
+                    fs_scan_inode(fs, i * INODES_PER_BLOCK + j, &block.inodes[j]);
+        }
+        free(index);
+    }
+}
+
+
+/**
+ * Mark an indirect tree of the given height (1 for blocks pointing at data)
+ * and every block it maps as used.
+ **/
+static void    fs_scan_pointer_tree(FileSystem *fs, uint32_t block_number, size_t height)
+{
+    if (!block_number)
+        return;
+
+    Block block;
+    if (!fs_meta_read(fs, block_number, block.data))
+    {
+        debug("Fail to read indirect block %u\n", block_number);
+        exit(1);
+    }
+
+    fs->free_blocks[block_number] = false;
+    for (size_t k = 0; k < POINTERS_PER_BLOCK; ++k)
+    {
+        if (height == 1 && block.pointers[k])
+            fs_scan_mark(fs, POINTER_BLOCK(block.pointers[k]), 1);
+        else if (height > 1)
+            fs_scan_pointer_tree(fs, block.pointers[k], height - 1);
+    }
+}
+
+
+/**
+ * Mark count data blocks starting at start as used.  A block some other
+ * (cloned) file already uses is shared, so count the extra reference.
+ **/
+static void    fs_scan_mark(FileSystem *fs, size_t start, size_t count)
+{
+    for (size_t b = start; b < start + count; ++b)
+    {
+        if (!fs->free_blocks[b] && fs->block_shares)
+            ++fs->block_shares[b];
+        fs->free_blocks[b] = false;
+    }
+}
+
+
+/**
+ * Block until the scanner has processed at least inode_blocks inode blocks.
+ **/
+static void    fs_wait_scanned(FileSystem *fs, size_t inode_blocks)
+{
+    if (!fs->free_blocks)
+        return;
+    if (__atomic_load_n(&fs->scanned, __ATOMIC_ACQUIRE) >= inode_blocks)
+        return;
+
+    pthread_mutex_lock(&fs->scan_lock);
+    while (fs->scanned < inode_blocks && !fs->scan_cancel)
+        pthread_cond_wait(&fs->scan_cond, &fs->scan_lock);
+    pthread_mutex_unlock(&fs->scan_lock);
+}
+
+
+/**
+ * Take the first free data block of the given block group from the global
+ * pool, falling back to the following groups when it is full.
+ *
+ * Note: The caller must hold alloc_lock.
+ **/
+static ssize_t fs_pool_allocate(FileSystem *fs, size_t group)
+{
+    size_t groups = fs_group_count(&fs->meta_data);
+    for (size_t k = 0; k < groups; ++k)
+    {
+        size_t      g  = (group + k) % groups;
+        BlockGroup *bg = &fs->groups[g];
+        if (!bg->free_count)
+            continue;
+
+        size_t i   = bg->block_hint;
+        size_t end = fs_group_data_end(&fs->meta_data, g);
+        while (i < end && !fs->free_blocks[i])
+            ++i;
+        bg->block_hint = i;
+        if (i < end)
+        {
+            fs->free_blocks[i] = false;
+            --bg->free_count;
+            bg->block_hint = i + 1;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/**
+ * Return a block to the global pool.
+ *
+ * Note: The caller must hold alloc_lock.
+ **/
+static void    fs_pool_release(FileSystem *fs, size_t block_number)
+{
+    BlockGroup *bg = &fs->groups[fs_block_group(&fs->meta_data, block_number)];
+
+    fs->free_blocks[block_number] = true;
+    ++bg->free_count;
+    bg->block_hint = min(bg->block_hint, block_number);
+}
+
+
+/**
+ * Allocate a block from the calling thread's arena, refilling it with
+ * ARENA_BLOCKS blocks from the global pool when it runs dry.  The arena lock
+ * is private to the thread and is only contended when the arenas are
+ * reclaimed.
+ **/
+static ssize_t fs_arena_allocate(FileSystem *fs, size_t group)
+{
+    Arena *arena = (Arena *)pthread_getspecific(fs->arena_key);
+    if (!arena)
+    {
+        if (!(arena = (Arena *)calloc(1, sizeof(Arena))))
+            return -1;
+        arena->fs = fs;
+        pthread_mutex_init(&arena->lock, NULL);
+
+        pthread_mutex_lock(&fs->arena_lock);
+        arena->next = fs->arenas;
+        __atomic_store_n(&fs->arenas, arena, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&fs->arena_lock);
+        pthread_setspecific(fs->arena_key, arena);
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    // 换了block group, 先把旧的预留还回去
+    if (arena->ranges && arena->group != group)
+        fs_arena_return(fs, arena);
+    if (!arena->ranges)
+        fs_arena_refill(fs, arena, group);
+
+    ssize_t block_number = -1;
+    if (arena->ranges)
+    {
+        block_number = arena->start[0]++;
+        if (!--arena->length[0])
+        {
+            --arena->ranges;
+            memmove(arena->start, arena->start + 1, arena->ranges * sizeof(size_t));
+            memmove(arena->length, arena->length + 1, arena->ranges * sizeof(size_t));
+        }
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    return block_number;
+}
+
+
+/**
+ * Reserve up to ARENA_BLOCKS free blocks (in at most ARENA_RANGES ranges) for
+ * an arena, taking them first-fit from the given group onwards.
+ *
+ * Note: The caller must hold the arena lock.
+ **/
+static void    fs_arena_refill(FileSystem *fs, Arena *arena, size_t group)
+{
+    size_t groups = fs_group_count(&fs->meta_data);
+    size_t wanted = ARENA_BLOCKS;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (size_t k = 0; k < groups && wanted && arena->ranges < ARENA_RANGES; ++k)
+    {
+        size_t      g  = (group + k) % groups;
+        BlockGroup *bg = &fs->groups[g];
+        if (!bg->free_count)
+            continue;
+
+        size_t i   = bg->block_hint;
+        size_t end = fs_group_data_end(&fs->meta_data, g);
+        while (i < end && wanted && arena->ranges < ARENA_RANGES)
+        {
+            if (!fs->free_blocks[i])
+            {
+                ++i;
+                continue;
+            }
+
+            size_t start = i;
+            while (i < end && wanted && fs->free_blocks[i])
+            {
+                fs->free_blocks[i++] = false;
+                --bg->free_count;
+                --wanted;
+            }
+            arena->start[arena->ranges]  = start;
+            arena->length[arena->ranges] = i - start;
+            ++arena->ranges;
+        }
+        // every free block below i now belongs to the arena
+        bg->block_hint = i;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    arena->group = group;
+}
+
+
+/**
+ * Give every block still reserved by an arena back to the global pool.
+ *
+ * Note: The caller must hold the arena lock.
+ *
+ * @return      Whether or not any block was returned.
+ **/
+static bool    fs_arena_return(FileSystem *fs, Arena *arena)
+{
+    if (!arena->ranges)
+        return false;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (size_t r = 0; r < arena->ranges; ++r)
+        for (size_t b = 0; b < arena->length[r]; ++b)
+            fs_pool_release(fs, arena->start[r] + b);
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    arena->ranges = 0;
+    return true;
+}
+
+
+/**
+ * Thread exit destructor: return the arena's reservation and forget it.
+ **/
+static void    fs_arena_destroy(void *arg)
+{
+    Arena      *arena = (Arena *)arg;
+    FileSystem *fs    = arena->fs;
+
+    pthread_mutex_lock(&fs->arena_lock);
+    for (Arena **a = &fs->arenas; *a; a = &(*a)->next)
+    {
+        if (*a == arena)
+        {
+            __atomic_store_n(a, arena->next, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    fs_arena_return(fs, arena);
+    pthread_mutex_unlock(&arena->lock);
+    pthread_mutex_unlock(&fs->arena_lock);
+
+    pthread_mutex_destroy(&arena->lock);
+    free(arena);
+}
+
+
+/**
+ * Return the reservations of all arenas to the global pool.
+ *
+ * @return      Whether or not any block was returned.
+ **/
+static bool    fs_arenas_reclaim(FileSystem *fs)
+{
+    bool returned = false;
+
+    pthread_mutex_lock(&fs->arena_lock);
+    for (Arena *arena = fs->arenas; arena; arena = arena->next)
+    {
+        pthread_mutex_lock(&arena->lock);
+        returned |= fs_arena_return(fs, arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+    pthread_mutex_unlock(&fs->arena_lock);
+
+    return returned;
+}
+
+
+static void    fs_writer_enter(FileSystem *fs)
+{
+    __atomic_add_fetch(&fs->writers, 1, __ATOMIC_RELAXED);
+}
+
+
+static void    fs_writer_exit(FileSystem *fs)
+{
+    // 最后一个writer离开 (空闲) 时把所有arena还给全局pool
+    if (!__atomic_sub_fetch(&fs->writers, 1, __ATOMIC_RELAXED) &&
+        __atomic_load_n(&fs->arenas, __ATOMIC_ACQUIRE))
+        fs_arenas_reclaim(fs);
+}
+
+
+/**
+ * Allocate a free data block, preferably in the given block group.
+ *
+ * A single writer allocates first-fit from the global pool.  Once several
+ * fs_write calls run at the same time, each thread allocates from its own
+ * arena so that most allocations do not touch alloc_lock.
+ **/
+static ssize_t fs_allocate_free_block(FileSystem *fs, size_t group)
+{
+    // log模式下所有新块都追加在log head, 不用arena
+    if (fs->options & FS_MOUNT_LOG)
+    {
+        size_t start;
+        return fs_allocate_free_run(fs, group, 1, &start) ? (ssize_t)start : -1;
+    }
+
+    // a block is only known to be free once every inode has been scanned
+    fs_wait_scanned(fs, fs->meta_data.inode_blocks);
+
+    ssize_t block_number = -1;
+    if (__atomic_load_n(&fs->writers, __ATOMIC_RELAXED) > 1)
+        block_number = fs_arena_allocate(fs, group);
+
+    while (block_number < 0)
+    {
+        pthread_mutex_lock(&fs->alloc_lock);
+        block_number = fs_pool_allocate(fs, group);
+        pthread_mutex_unlock(&fs->alloc_lock);
+
+        // 全局pool满了, 空闲块可能还在其他线程的arena里或等着日志提交
+        if (block_number < 0 && !fs_arenas_reclaim(fs) && !fs_journal_reclaim(fs))
+            break;
+    }
+
+    return block_number;
+}
+
+
+/**
+ * Allocate a run of up to wanted contiguous free blocks: the first run of
+ * the full length (preferring the given group), or else the longest run.
+ * With FS_MOUNT_LOG the run starts at the log head instead (fs_log_append).
+ *
+ * @return      Number of blocks in the run (0 when the disk is full).
+ **/
+static size_t  fs_allocate_free_run(FileSystem *fs, size_t group, size_t wanted, size_t *start)
+{
+    fs_wait_scanned(fs, fs->meta_data.inode_blocks);
+
+    size_t groups    = fs_group_count(&fs->meta_data);
+    size_t best      = 0;
+    size_t best_size = 0;
+    size_t best_g    = 0;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (fs->options & FS_MOUNT_LOG)
+    {
+        best_size = fs_log_append(fs, wanted, &best);
+        best_g    = fs_block_group(&fs->meta_data, best);
+    }
+    else
+    {
+        for (size_t k = 0; k < groups && best_size < wanted; ++k)
+        {
+            size_t g = (group + k) % groups;
+            if (!fs->groups[g].free_count)
+                continue;
+
+            size_t i   = fs->groups[g].block_hint;
+            size_t end = fs_group_data_end(&fs->meta_data, g);
+            while (i < end && best_size < wanted)
+            {
+                if (!fs->free_blocks[i])
+                {
+                    ++i;
+                    continue;
+                }
+
+                size_t run = i;
+                while (i < end && fs->free_blocks[i] && i - run < wanted)
+                    ++i;
+                if (i - run > best_size)
+                {
+                    best      = run;
+                    best_size = i - run;
+                    best_g    = g;
+                }
+            }
+        }
+    }
+
+    if (best_size)
+    {
+        BlockGroup *bg = &fs->groups[best_g];
+        memset(fs->free_blocks + best, false, best_size * sizeof(bool));
+        bg->free_count -= best_size;
+        if (bg->block_hint == best)
+            bg->block_hint = best + best_size;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    // 磁盘满了, 但可能有块等着日志提交以后释放
+    if (!best_size && fs_journal_reclaim(fs))
+        return fs_allocate_free_run(fs, group, wanted, start);
+
+    *start = best;
+    return best_size;
+}
+
+
+/**
+ * Segment of the data area a block belongs to (FS_MOUNT_LOG).
+ **/
+static size_t  fs_log_segment(const SuperBlock *sb, size_t block_number)
+{
+    return (block_number - fs_group_data_start(sb, 0)) / LOG_SEGMENT_BLOCKS;
+}
+
+
+/**
+ * Take a run of up to wanted free blocks at the log head and move the head
+ * past it, so blocks are handed out in disk order whatever file they are
+ * for.  Once the segment of the head is used up, the head moves on to the
+ * next clean (entirely free) segment, or else to the next free block,
+ * filling holes.
+ *
+ * Note: The caller must hold alloc_lock.
+ *
+ * @return      Number of blocks in the run (0 when the disk is full).
+ **/
+static size_t  fs_log_append(FileSystem *fs, size_t wanted, size_t *start)
+{
+    SuperBlock *sb       = &fs->meta_data;
+    size_t      first    = fs_group_data_start(sb, 0);
+    size_t      span     = sb->blocks - first;
+    size_t      segments = UPPER_ROUND(span, LOG_SEGMENT_BLOCKS);
+    size_t      head     = fs->log_head < first || fs->log_head >= sb->blocks ? first : fs->log_head;
+
+    size_t segment = fs_log_segment(sb, head);
+    size_t end     = min(first + (segment + 1) * LOG_SEGMENT_BLOCKS, (size_t)sb->blocks);
+    while (head < end && !fs->free_blocks[head])
+        ++head;
+
+    if (head == end)
+    {
+        bool found = false;
+        for (size_t k = 1; k <= segments && !found; ++k)
+        {
+            size_t s  = (segment + k) % segments;
+            size_t b  = first + s * LOG_SEGMENT_BLOCKS;
+            size_t e  = min(b + LOG_SEGMENT_BLOCKS, (size_t)sb->blocks);
+            size_t at = b;
+            while (at < e && fs->free_blocks[at])
+                ++at;
+            if ((found = at == e))
+                head = b;
+        }
+
+        // 没有干净的segment, 按顺序填空洞
+        for (size_t k = 0; k < span && !found; ++k)
+        {
+            size_t b = first + (end - first + k) % span;
+            if ((found = fs->free_blocks[b]))
+                head = b;
+        }
+        if (!found)
+            return 0;
+    }
+
+    size_t count = 0;
+    while (count < wanted && head + count < sb->blocks && fs->free_blocks[head + count])
+        ++count;
+
+    *start       = head;
+    fs->log_head = head + count;
+    return count;
+}
+
+
+/**
+ * Read the data block a pointer refers to; unwritten (preallocated) blocks
+ * read back as zeros without touching the disk.
+ **/
+static ssize_t fs_read_block(FileSystem *fs, uint32_t pointer, char *data)
+{
+    if (pointer & POINTER_UNWRITTEN)
+    {
+        memset(data, 0, BLOCK_SIZE);
+        return BLOCK_SIZE;
+    }
+    return disk_read(fs->disk, pointer, data);
+}
+
+
+static void fs_release_free_block(FileSystem *fs, size_t block_number)
+{
+    fs_release_free_run(fs, block_number, 1);
+}
+
+/**
+ * Return count contiguous blocks starting at start to the global pool,
+ * taking alloc_lock once for the whole run.
+ **/
+static void fs_release_free_run(FileSystem *fs, size_t start, size_t count)
+{
+    if (!count)
+        return;
+
+    fs_wait_scanned(fs, fs->meta_data.inode_blocks);
+    fs_forget_pointers(fs, start, count);
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (size_t b = start; b < start + count; ++b)
+    {
+        assert(!fs->free_blocks[b]);
+        // 共享的块只去掉一个引用
+        if (fs->block_shares && fs->block_shares[b])
+            --fs->block_shares[b];
+        else if (!fs_journal_defer(fs, b))
+            fs_pool_release(fs, b);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+/**
+ * Add a block to the run of blocks being released, releasing the run first
+ * when the block does not extend it.
+ **/
+static void fs_release_collect(FileSystem *fs, size_t *start, size_t *count, size_t block_number)
+{
+    if (*count && *start + *count == block_number)
+    {
+        ++*count;
+        return;
+    }
+    fs_release_free_run(fs, *start, *count);
+    *start = block_number;
+    *count = 1;
+}
+
+/**
+ * Allocate the unmapped blocks touched by the byte range [offset, end) and
+ * grow the file to end.  Blocks the range skips over stay holes, and new
+ * blocks are flagged unwritten so the parts a write does not cover read
+ * back as zeros.
+ **/
+static void fs_expand_file(FileSystem * fs, FileMap * map, size_t offset, size_t end)
+{
+    Inode *node = map->inode;
+    size_t size = fs_inode_size(node);
+    size_t last = min(UPPER_ROUND(end, BLOCK_SIZE), fs_inode_max_blocks(node));
+    size_t idx  = offset / BLOCK_SIZE;
+
+    while (idx < last)
+    {
+        // 已经映射的块不用分配
+        size_t run = last - idx;
+        if (fs_map_get(map, idx, &run))
+        {
+            idx += run;
+            continue;
+        }
+        if (!fs_map_reserve(map, idx))
+            break;
+
+        // extent映射的文件一次分配一段连续的块
+        size_t  got = 1;
+        ssize_t free_block_idx;
+        if (node->valid & INODE_EXTENTS)
+        {
+            size_t start;
+            got            = fs_allocate_free_run(fs, map->group, run, &start);
+            free_block_idx = got ? (ssize_t)start : -1;
+        }
+        else
+            free_block_idx = fs_allocate_free_block(fs, map->group);
+
+        if (free_block_idx == -1)
+            break;
+        fs_map_set(map, idx, free_block_idx | POINTER_UNWRITTEN, got);
+        idx += got;
+    }
+
+    // 空间不够时文件只增长到最后一个分配到的块
+    if (idx < UPPER_ROUND(end, BLOCK_SIZE))
+        end = idx * BLOCK_SIZE > offset ? idx * BLOCK_SIZE : 0;
+    fs_inode_set_size(node, max(size, end));
+}
+
+
+/**
+ * Read from the specified Inode into the data buffer exactly length bytes
+ * beginning from the specified offset by doing the following:
+ *
+ *  1. Load Inode information (inline files are copied out right away).
+ *
+ *  2. Read the blocks through a FileMap (fs_map_read).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read.
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+static ssize_t fs_read_mapped(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+    Inode inode;
+    Block table;
+
+    if (fs_load_inode_block(fs, inode_number, &table) &&
+        (inode = table.inodes[inode_number % INODES_PER_BLOCK]).valid & INODE_VALID)
+    {
+        // inline文件的数据已经随inode块读进来了
+        if (inode.valid & INODE_INLINE)
+        {
+            char   buffer[INLINE_MAX];
+            size_t size = fs_inode_size(&inode);
+            if (offset >= size)
+                return 0;
+            length = min(length, size - offset);
+            fs_inline_gather(&table, &inode, buffer);
+            memcpy(data, buffer + offset, length);
+            return length;
+        }
+
+        FileMap map;
+        if (!fs_map_open(fs, &map, &inode, fs_inode_group(&fs->meta_data, inode_number)))
+            return -1;
+
+        ssize_t bytes_read = fs_map_read(&map, data, length, offset);
+        fs_map_free(&map);
+        return bytes_read;
+    }
+
+    return -1;
+}
+
+
+/**
+ * Write to the specified Inode from the data buffer exactly length bytes
+ * beginning from the specified offset by doing the following:
+ *
+ *  1. Load Inode information.
+ *
+ *  2. Write the blocks through a FileMap (fs_map_write).
+ *
+ *  3. Write back the mapping and the Inode.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write.
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes write (-1 on error).
+ **/
+static ssize_t fs_write_mapped(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+    Inode inode;
+
+    if (fs_load_inode(fs, inode_number, &inode))
+    {
+        FileMap map;
+        if (!fs_map_open(fs, &map, &inode, fs_inode_group(&fs->meta_data, inode_number)))
+            return -1;
+
+        fs_writer_enter(fs);
+        ssize_t bytes_write = fs_map_write(&map, data, length, offset);
+
+        // write back indirect block / extent tree and inode
+        bool ok = fs_map_close(&map);
+        ok      = fs_save_inode(fs, inode_number, &inode) && ok;
+
+        fs_writer_exit(fs);
+        return ok ? bytes_write : -1;
+    }
+
+    return -1;
+}
+
+
+/**
+ * Read exactly length bytes beginning from the specified offset of a mapped
+ * file by continuously reading blocks and copying data to buffer.
+ *
+ *  Note: Contiguous whole blocks are read with a single disk request.  Holes
+ *  read as zeros.
+ *
+ * @return      Number of bytes read (-1 on error).
+ **/
+static ssize_t fs_map_read(FileMap *map, char *data, size_t length, size_t offset)
+{
+    FileSystem *fs   = map->fs;
+    size_t      size = fs_inode_size(map->inode);
+
+    // set length
+    if (offset >= size)
+        return 0;
+    length = min(length, size - offset);
+
+    // 暂存数据块
+    Block  block;
+    size_t bytes_read = 0;
+
+    while (bytes_read < length)
+    {
+        size_t   i       = (offset + bytes_read) / BLOCK_SIZE;
+        size_t   off     = (offset + bytes_read) % BLOCK_SIZE;
+        size_t   run     = UPPER_ROUND(off + length - bytes_read, BLOCK_SIZE);
+        uint32_t pointer = fs_map_get(map, i, &run);
+        if (!run)
+            break;
+
+        // 空洞读出0, 不需要磁盘I/O
+        if (!pointer)
+        {
+            size_t sz = min(run * BLOCK_SIZE - off, length - bytes_read);
+            memset(data + bytes_read, 0, sz);
+            bytes_read += sz;
+            continue;
+        }
+
+        // 整块且连续的部分一次读入用户buffer
+        size_t blocks = min(run, (length - bytes_read) / BLOCK_SIZE);
+        if (!off && blocks && !(pointer & POINTER_UNWRITTEN))
+        {
+            if (disk_read_blocks(fs->disk, pointer, blocks, data + bytes_read) == DISK_FAILURE)
+            {
+                error("Fail to read blocks %d+%lu\n", pointer, blocks);
+                return -1;
+            }
+            bytes_read += blocks * BLOCK_SIZE;
+            continue;
+        }
+
+        if (fs_read_block(fs, pointer, block.data) == DISK_FAILURE)
+        {
+            error("Fail to read block %d\n", pointer);
+            return -1;
+        }
+        // 拷贝数据
+        size_t sz = min(BLOCK_SIZE - off, length - bytes_read);
+        memcpy(data + bytes_read, block.data + off, sz);
+        bytes_read += sz;
+    }
+
+    assert(bytes_read == length);
+    return bytes_read;
+}
+
+
+/**
+ * Write exactly length bytes beginning from the specified offset of a
+ * mapped file by allocating the blocks the range touches and continuously
+ * copying data from buffer to blocks.
+ *
+ *  Note: Skipped blocks stay holes.  Whole blocks are written without
+ *  reading them first (contiguous ones with a single disk request); only
+ *  partial blocks are read, modified and written back.  With FS_MOUNT_LOG
+ *  no written block is overwritten in place: the new contents go to blocks
+ *  at the log head.  The caller writes back the mapping and the Inode.
+ *
+ * @return      Number of bytes written.
+ **/
+static ssize_t fs_map_write(FileMap *map, char *data, size_t length, size_t offset)
+{
+    FileSystem *fs = map->fs;
+
+    // 扩容文件, 数据块尽量和inode放在同一个block group
+    size_t old_size = fs_inode_size(map->inode);
+    fs_expand_file(fs, map, offset, offset + length);
+
+    // 和clone共享的块先复制一份 (copy-on-write)
+    length = fs_map_unshare(map, offset, offset + length) - offset;
+
+    // 数据块
+    Block  block;
+    size_t bytes_write = 0;
+
+    while (bytes_write < length)
+    {
+        size_t   i       = (offset + bytes_write) / BLOCK_SIZE;
+        size_t   off     = (offset + bytes_write) % BLOCK_SIZE;
+        size_t   run     = (length - bytes_write) / BLOCK_SIZE;
+        uint32_t pointer = fs_map_get(map, i, &run);
+        if (!pointer)
+            break;
+
+        // 整块且连续的部分不用先读, 一次写出
+        size_t blocks = min(run, (length - bytes_write) / BLOCK_SIZE);
+        if (!off && blocks)
+        {
+            if (pointer & POINTER_UNWRITTEN)
+            {
+                pointer = POINTER_BLOCK(pointer);
+                fs_map_set(map, i, pointer, blocks);
+            }
+            if (disk_write_blocks(fs->disk, pointer, blocks, data + bytes_write) == DISK_FAILURE)
+            {
+                error("Fail to write back blocks %d+%lu\n", pointer, blocks);
+                exit(1);
+            }
+            bytes_write += blocks * BLOCK_SIZE;
+            continue;
+        }
+
+        // 新分配的块(unwritten)在内存里填0, 不读磁盘
+        if (fs_read_block(fs, pointer, block.data) == DISK_FAILURE)
+        {
+            error("Fail to read block %d\n", pointer);
+            exit(1);
+        }
+        // 原来EOF之后的旧内容要读出0
+        if (i * BLOCK_SIZE < old_size && old_size < (i + 1) * BLOCK_SIZE)
+            memset(block.data + old_size % BLOCK_SIZE, 0, BLOCK_SIZE - old_size % BLOCK_SIZE);
+        // 拷贝数据
+        size_t sz = min(BLOCK_SIZE - off, length - bytes_write);
+        memcpy(block.data + off, data + bytes_write, sz);
+        bytes_write += sz;
+
+        // write back, 预分配的块写过之后就不再是unwritten
+        if (pointer & POINTER_UNWRITTEN)
+        {
+            pointer = POINTER_BLOCK(pointer);
+            fs_map_set(map, i, pointer, 1);
+        }
+        else if (fs->options & FS_MOUNT_LOG)
+        {
+            // log模式不覆盖旧块, 改过的块写到log head (磁盘满时只能原地写)
+            ssize_t moved = fs_allocate_free_block(fs, map->group);
+            if (moved >= 0)
+            {
+                fs_map_set(map, i, moved, 1);
+                fs_release_free_block(fs, pointer);
+                pointer = moved;
+            }
+        }
+        if (disk_write(fs->disk, pointer, block.data) == DISK_FAILURE)
+        {
+            error("Fail to write back block %d\n", pointer);
+            exit(1);
+        }
+    }
+
+    return bytes_write;
+}
+
+
+
+/**
+ * Find the buffered data of the specified Inode (NULL if it has none).
+ *
+ * Note: The dirty lock only guards the list itself and the dirty_blocks
+ * count.  A DirtyFile is changed or written back only under the Inode lock
+ * of its file held exclusively, and read under it held shared, so the
+ * caller must hold that lock for the result to stay valid.
+ **/
+static DirtyFile *fs_delalloc_find(FileSystem *fs, size_t inode_number)
+{
+    pthread_mutex_lock(&fs->dirty_lock);
+    DirtyFile *df = fs->dirty;
+    while (df && df->inode_number != inode_number)
+        df = df->next;
+    pthread_mutex_unlock(&fs->dirty_lock);
+    return df;
+}
+
+
+/**
+ * Unlink the buffered data of a file and free it.
+ *
+ * Note: The caller must hold the Inode lock of the file exclusively.
+ **/
+static void    fs_delalloc_discard(FileSystem *fs, DirtyFile *df)
+{
+    size_t pages = 0;
+    for (size_t i = 0; i < df->npages; ++i)
+    {
+        if (df->pages[i])
+        {
+            free(df->pages[i]);
+            ++pages;
+        }
+    }
+
+    pthread_mutex_lock(&fs->dirty_lock);
+    for (DirtyFile **d = &fs->dirty; *d; d = &(*d)->next)
+    {
+        if (*d == df)
+        {
+            *d = df->next;
+            break;
+        }
+    }
+    fs->dirty_blocks -= pages;
+    pthread_mutex_unlock(&fs->dirty_lock);
+
+    free(df->pages);
+    free(df);
+}
+
+
+/**
+ * Write back the buffered data of a file by doing the following:
+ *
+ *  1. Allocate the indirect block (if the file needs one) in front of the
+ *  data it maps.
+ *
+ *  2. Allocate the buffered blocks in runs that are as long as possible and
+ *  write them out (blocks that were never written stay holes).
+ *
+ *  3. Save the indirect block and the Inode with the final size.
+ *
+ * Note: The caller must hold the Inode lock of the file exclusively.
+ *
+ * @return      Whether or not all buffered blocks were written back.
+ **/
+static bool    fs_delalloc_flush(FileSystem *fs, DirtyFile *df)
+{
+    Inode   inode;
+    FileMap map;
+    if (!fs_load_inode(fs, df->inode_number, &inode) ||
+        !fs_map_open(fs, &map, &inode, fs_inode_group(&fs->meta_data, df->inode_number)))
+    {
+        fs_delalloc_discard(fs, df);
+        return false;
+    }
+
+    fs_journal_start(fs);
+    size_t total = df->first + df->npages;
+    if (total > df->first && !fs_map_reserve(&map, total - 1))
+        total = POINTERS_PER_INODE;
+
+    // 知道了最终长度, 一次分配尽量长的连续块
+    size_t idx = df->first;
+    while (idx < total)
+    {
+        // 没写过的块是空洞, 不分配
+        size_t count = 0;
+        while (idx + count < total && df->pages[idx + count - df->first])
+            ++count;
+        if (!count)
+        {
+            ++idx;
+            continue;
+        }
+
+        size_t start;
+        size_t got = fs_allocate_free_run(fs, map.group, count, &start);
+        if (!got)
+            break;
+
+        for (size_t b = 0; b < got; ++b)
+        {
+            if (disk_write(fs->disk, start + b, df->pages[idx + b - df->first]) == DISK_FAILURE)
+            {
+                error("Fail to write back block %lu\n", start + b);
+                exit(1);
+            }
+        }
+        fs_map_set(&map, idx, start, got);
+        idx += got;
+    }
+
+    if (idx < df->first + df->npages)
+        error("Out of space writing back inode %lu\n", df->inode_number);
+
+    bool flushed = fs_map_close(&map) && idx == df->first + df->npages;
+    fs_inode_set_size(&inode, min(df->size, idx * BLOCK_SIZE));
+    flushed = fs_save_inode(fs, df->inode_number, &inode) && flushed;
+    fs_journal_stop(fs);
+
+    fs_delalloc_discard(fs, df);
+    return flushed;
+}
+
+
+/**
+ * Write back the buffered data of every file.
+ *
+ * Note: The caller must hold every Inode lock (or be the only thread left,
+ * as in fs_unmount).
+ **/
+static bool    fs_delalloc_flush_all(FileSystem *fs)
+{
+    bool flushed = true;
+    while (fs->dirty)
+        flushed &= fs_delalloc_flush(fs, fs->dirty);
+    return flushed;
+}
+
+
+/**
+ * Write back the buffered data of every file by doing the following, for
+ * callers that hold no Inode lock:
+ *
+ *  1. Record which files have buffered data under the dirty lock.
+ *
+ *  2. Lock each of them exclusively in turn and write it back, without
+ *  holding the dirty lock across the disk I/O.
+ *
+ * Note: Data buffered after step 1 is left for the next writeback.
+ **/
+static bool    fs_delalloc_sync(FileSystem *fs)
+{
+    size_t  count   = 0;
+    size_t *inodes  = NULL;
+    bool    flushed = true;
+
+    pthread_mutex_lock(&fs->dirty_lock);
+    for (DirtyFile *df = fs->dirty; df; df = df->next)
+        ++count;
+    if (count && (inodes = (size_t *)malloc(count * sizeof(size_t))))
+    {
+        size_t k = 0;
+        for (DirtyFile *df = fs->dirty; df; df = df->next)
+            inodes[k++] = df->inode_number;
+    }
+    pthread_mutex_unlock(&fs->dirty_lock);
+    if (count && !inodes)
+        return false;
+
+    for (size_t k = 0; k < count; ++k)
+    {
+        fs_lock_inode(fs, inodes[k], true);
+        DirtyFile *df = fs_delalloc_find(fs, inodes[k]);
+        if (df)
+            flushed = fs_delalloc_flush(fs, df) && flushed;
+        fs_unlock_inode(fs, inodes[k]);
+    }
+
+    free(inodes);
+    return flushed;
+}
+
+
+/**
+ * Write back buffered files for a writer that went over DELALLOC_BLOCKS.
+ * Files sharing the lock the writer already holds are written back, other
+ * files only if their lock can be taken without waiting, so the writer
+ * never waits for another file while holding its own.
+ *
+ * Note: The caller must hold the Inode lock of held exclusively.
+ **/
+static void    fs_delalloc_reclaim(FileSystem *fs, size_t held)
+{
+    size_t own = held % INODE_LOCKS;
+
+    while (true)
+    {
+        DirtyFile *df     = NULL;
+        bool       locked = false;
+        size_t     k      = 0;
+
+        // trylock不会阻塞, 可以在dirty lock里做
+        pthread_mutex_lock(&fs->dirty_lock);
+        for (df = fs->dirty; df; df = df->next)
+        {
+            k = df->inode_number % INODE_LOCKS;
+            if (k == own)
+                break;
+            if (pthread_rwlock_trywrlock(&fs->inode_locks[k]) == 0)
+            {
+                ++fs->inode_generations[k];
+                locked = true;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&fs->dirty_lock);
+
+        if (!df)
+            break;
+        fs_delalloc_flush(fs, df);
+        if (locked)
+            pthread_rwlock_unlock(&fs->inode_locks[k]);
+    }
+}
+
+
+/**
+ * Read from a file that may have buffered data: the part below the first
+ * unmapped block comes from disk, the rest from the buffered blocks.
+ *
+ * Note: The caller must hold the Inode lock of the file.
+ **/
+static ssize_t fs_delalloc_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset)
+{
+    DirtyFile *df = fs_delalloc_find(fs, inode_number);
+    if (!df)
+        return fs_read_mapped(fs, inode_number, data, length, offset);
+
+    if (offset >= df->size)
+        return 0;
+    length = min(length, df->size - offset);
+
+    size_t end   = offset + length;
+    size_t split = df->first * BLOCK_SIZE;
+    size_t pos   = offset;
+
+    if (pos < split)
+    {
+        size_t  wanted = min(end, split) - pos;
+        ssize_t result = fs_read_mapped(fs, inode_number, data, wanted, pos);
+        if (result < 0)
+            return -1;
+        // 磁盘上size之后到第一个未映射块之间读出0
+        memset(data + result, 0, wanted - result);
+        pos += wanted;
+    }
+
+    while (pos < end)
+    {
+        size_t idx = pos / BLOCK_SIZE - df->first;
+        size_t off = pos % BLOCK_SIZE;
+        size_t sz  = min(BLOCK_SIZE - off, end - pos);
+        if (df->pages[idx])
+            memcpy(data + pos - offset, df->pages[idx] + off, sz);
+        else
+            memset(data + pos - offset, 0, sz);
+        pos += sz;
+    }
+
+    return length;
+}
+
+
+/**
+ * Write to a file with delayed allocation: the part below the first
+ * unmapped block is written in place, the rest is buffered in memory
+ * without allocating blocks.  When more than DELALLOC_BLOCKS blocks are
+ * buffered, files are written back (see fs_delalloc_reclaim).
+ *
+ * Note: The caller must hold the Inode lock of the file exclusively.
+ **/
+static ssize_t fs_delalloc_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset)
+{
+    Inode inode;
+    if (!fs_load_inode(fs, inode_number, &inode))
+        return -1;
+
+    size_t limit = fs_inode_max_blocks(&inode) * BLOCK_SIZE;
+    length = offset < limit ? min(length, limit - offset) : 0;
+
+    DirtyFile *df    = fs_delalloc_find(fs, inode_number);
+    size_t     size  = df ? df->size : fs_inode_size(&inode);
+    size_t     split = df ? df->first * BLOCK_SIZE : UPPER_ROUND(size, BLOCK_SIZE) * BLOCK_SIZE;
+    size_t     end   = offset + length;
+    size_t     bytes_write = 0;
+
+    if (offset < split)
+    {
+        ssize_t result = fs_write_mapped(fs, inode_number, data, min(end, split) - offset, offset);
+        if (result < 0)
+            return -1;
+        bytes_write = result;
+        if (df)
+            df->size = max(df->size, offset + bytes_write);
+    }
+
+    if (offset + bytes_write >= end)
+        return bytes_write;
+
+    if (!df)
+    {
+        if (!(df = (DirtyFile *)calloc(1, sizeof(DirtyFile))))
+            return bytes_write;
+        df->inode_number = inode_number;
+        df->size         = size;
+        df->first        = split / BLOCK_SIZE;
+        pthread_mutex_lock(&fs->dirty_lock);
+        df->next         = fs->dirty;
+        fs->dirty        = df;
+        pthread_mutex_unlock(&fs->dirty_lock);
+    }
+
+    // 扩大buffer数组, 新的项为NULL (读出0)
+    size_t npages = UPPER_ROUND(end, BLOCK_SIZE) - df->first;
+    if (npages > df->npages)
+    {
+        char **pages = (char **)realloc(df->pages, npages * sizeof(char *));
+        if (!pages)
+            return bytes_write;
+        memset(pages + df->npages, 0, (npages - df->npages) * sizeof(char *));
+        df->pages  = pages;
+        df->npages = npages;
+    }
+
+    size_t pos   = offset + bytes_write;
+    size_t added = 0;
+    while (pos < end)
+    {
+        size_t idx = pos / BLOCK_SIZE - df->first;
+        size_t off = pos % BLOCK_SIZE;
+        size_t sz  = min(BLOCK_SIZE - off, end - pos);
+        if (!df->pages[idx])
+        {
+            if (!(df->pages[idx] = (char *)calloc(1, BLOCK_SIZE)))
+                break;
+            ++added;
+        }
+        memcpy(df->pages[idx] + off, data + pos - offset, sz);
+        pos += sz;
+    }
+    df->size = max(df->size, pos);
+    bytes_write = pos - offset;
+
+    pthread_mutex_lock(&fs->dirty_lock);
+    fs->dirty_blocks += added;
+    bool full = fs->dirty_blocks > DELALLOC_BLOCKS;
+    pthread_mutex_unlock(&fs->dirty_lock);
+    if (full)
+        fs_delalloc_reclaim(fs, inode_number);
+
+    return bytes_write;
+}
+
+
+/**
+ * Copy the data of an inline file out of its Inode and the slots it links.
+ **/
+static void    fs_inline_gather(const Block *block, const Inode *inode, char *data)
+{
+    size_t size   = inode->size;
+    size_t copied = min(size, INLINE_INODE_BYTES);
+
+    memcpy(data, inode->inline_data, copied);
+    for (size_t k = 0; copied < size; ++k)
+    {
+        size_t sz = min(size - copied, INLINE_SLOT_BYTES);
+        memcpy(data + copied, block->slots[INODE_SLOT_LINK(inode->valid, k) - 1].data, sz);
+        copied += sz;
+    }
+}
+
+
+/**
+ * Copy the data of an inline file into its Inode and the slots it links
+ * (the slots must already be reserved for Inode.size bytes).
+ **/
+static void    fs_inline_scatter(Block *block, Inode *inode, const char *data)
+{
+    size_t size   = inode->size;
+    size_t copied = min(size, INLINE_INODE_BYTES);
+
+    memcpy(inode->inline_data, data, copied);
+    for (size_t k = 0; copied < size; ++k)
+    {
+        size_t sz = min(size - copied, INLINE_SLOT_BYTES);
+        memcpy(block->slots[INODE_SLOT_LINK(inode->valid, k) - 1].data, data + copied, sz);
+        copied += sz;
+    }
+}
+
+
+/**
+ * Link enough free slots of the same Inode table block to an inline file
+ * to hold size bytes, so reading it still costs a single block read.
+ *
+ * Note: The caller must hold the table lock and write the block back.
+ **/
+static bool    fs_inline_reserve(FileSystem *fs, Block *block, size_t inode_number, size_t size)
+{
+    Inode *node   = &block->inodes[inode_number % INODES_PER_BLOCK];
+    size_t base   = inode_number - inode_number % INODES_PER_BLOCK;
+    size_t needed = size > INLINE_INODE_BYTES ? UPPER_ROUND(size - INLINE_INODE_BYTES, INLINE_SLOT_BYTES) : 0;
+    size_t linked = 0;
+
+    if (size > INLINE_MAX)
+        return false;
+
+    while (linked < INLINE_SLOTS && INODE_SLOT_LINK(node->valid, linked))
+        ++linked;
+    if (needed <= linked)
+        return true;
+
+    // 先确认有足够的空闲slot, 不用回滚
+    pthread_mutex_lock(&fs->inode_lock);
+    size_t available = 0;
+    for (size_t j = 0; j < INODES_PER_BLOCK; ++j)
+        available += fs->free_inodes[base + j];
+    if (available < needed - linked)
+    {
+        pthread_mutex_unlock(&fs->inode_lock);
+        return false;
+    }
+
+    for (size_t k = linked, j = 0; k < needed; ++k, ++j)
+    {
+        while (!fs->free_inodes[base + j])
+            ++j;
+
+        fs->free_inodes[base + j] = false;
+        memset(&block->slots[j], 0, sizeof(InodeSlot));
+        block->slots[j].valid = INODE_SLOT;
+        node->valid |= (uint32_t)(j + 1) << INODE_SLOT_SHIFT(k);
+    }
+    pthread_mutex_unlock(&fs->inode_lock);
+    return true;
+}
+
+
+/**
+ * Unlink and free every slot of an inline file.
+ *
+ * Note: The caller must hold the table lock and write the block back.
+ **/
+static void    fs_inline_release(FileSystem *fs, Block *block, size_t inode_number)
+{
+    Inode *node = &block->inodes[inode_number % INODES_PER_BLOCK];
+    size_t base = inode_number - inode_number % INODES_PER_BLOCK;
+
+    pthread_mutex_lock(&fs->inode_lock);
+    for (size_t k = 0; k < INLINE_SLOTS; ++k)
+    {
+        size_t link = INODE_SLOT_LINK(node->valid, k);
+        if (!link)
+            continue;
+
+        memset(&block->slots[link - 1], 0, sizeof(InodeSlot));
+        fs->free_inodes[base + link - 1] = true;
+
+        BlockGroup *bg = &fs->groups[fs_inode_group(&fs->meta_data, base + link - 1)];
+        bg->inode_hint = min(bg->inode_hint, base + link - 1);
+    }
+    pthread_mutex_unlock(&fs->inode_lock);
+    node->valid &= (1u << INODE_SLOT_SHIFT(0)) - 1;
+}
+
+
+/**
+ * Write to an inline file by doing the following:
+ *
+ *  1. Read the Inode table block (the inode and its slots share it).
+ *
+ *  2. If the file still fits in INLINE_MAX bytes, update the data in place
+ *  and write the block back.
+ *
+ *  3. Otherwise move the data out to a block mapped file and let the
+ *  caller write through the normal path.
+ *
+ * @return      Whether or not the write was handled (result holds the
+ *              number of bytes written, -1 on error).
+ **/
+static bool    fs_inline_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset,
+                               ssize_t *result)
+{
+    Block  block;
+    char   buffer[INLINE_MAX];
+    size_t end = offset + length;
+
+    if (inode_number >= fs->meta_data.inodes)
+        return false;
+
+    // slot的空闲位要等scanner扫描过这个inode块
+    fs_wait_scanned(fs, inode_number / INODES_PER_BLOCK + 1);
+
+    pthread_mutex_t *table_lock = fs_table_lock(fs, inode_number);
+    pthread_mutex_lock(table_lock);
+    if (!fs_load_inode_block(fs, inode_number, &block))
+    {
+        pthread_mutex_unlock(table_lock);
+        *result = -1;
+        return true;
+    }
+
+    Inode *node = &block.inodes[inode_number % INODES_PER_BLOCK];
+    if (!(node->valid & INODE_VALID) || !(node->valid & INODE_INLINE))
+    {
+        pthread_mutex_unlock(table_lock);
+        return false;
+    }
+
+    if (end <= INLINE_MAX && fs_inline_reserve(fs, &block, inode_number, end))
+    {
+        size_t size = node->size;
+        fs_inline_gather(&block, node, buffer);
+        if (offset > size)
+            memset(buffer + size, 0, offset - size);
+        memcpy(buffer + offset, data, length);
+
+        node->size = max(size, end);
+        fs_inline_scatter(&block, node, buffer);
+
+        size_t inode_block_number = fs_table_block(fs, inode_number / INODES_PER_BLOCK);
+        *result = fs_write_table(fs, inode_block_number, &block) ? (ssize_t)length : -1;
+        pthread_mutex_unlock(table_lock);
+        return true;
+    }
+    pthread_mutex_unlock(table_lock);
+
+    // 放不下了, 转换成普通文件
+    if (!fs_inline_convert(fs, inode_number))
+    {
+        *result = -1;
+        return true;
+    }
+    return false;
+}
+
+
+/**
+ * Resize an inline file in its Inode table block: gather the data, relink
+ * just enough slots for the new size and scatter it back (bytes past the
+ * old end read back as zeros).  Files that grow past INLINE_MAX bytes, or
+ * cannot get more slots, are moved out to data blocks and left to the
+ * caller.
+ *
+ * @return      Whether or not the resize was handled (result holds whether
+ *              it succeeded).
+ **/
+static bool    fs_inline_truncate(FileSystem *fs, size_t inode_number, size_t size, bool *result)
+{
+    Block  block;
+    char   buffer[INLINE_MAX];
+
+    if (inode_number >= fs->meta_data.inodes)
+        return false;
+
+    fs_wait_scanned(fs, inode_number / INODES_PER_BLOCK + 1);
+
+    pthread_mutex_t *table_lock = fs_table_lock(fs, inode_number);
+    pthread_mutex_lock(table_lock);
+    if (!fs_load_inode_block(fs, inode_number, &block))
+    {
+        pthread_mutex_unlock(table_lock);
+        *result = false;
+        return true;
+    }
+
+    Inode *node = &block.inodes[inode_number % INODES_PER_BLOCK];
+    if (!(node->valid & INODE_VALID) || !(node->valid & INODE_INLINE))
+    {
+        pthread_mutex_unlock(table_lock);
+        return false;
+    }
+
+    if (size <= INLINE_MAX && fs_inline_reserve(fs, &block, inode_number, max(size, (size_t)node->size)))
+    {
+        size_t old_size = node->size;
+        fs_inline_gather(&block, node, buffer);
+        if (size > old_size)
+            memset(buffer + old_size, 0, size - old_size);
+
+        // 缩小时多余的slot还给inode表
+        fs_inline_release(fs, &block, inode_number);
+        node->size = size;
+        fs_inline_reserve(fs, &block, inode_number, size);
+        fs_inline_scatter(&block, node, buffer);
+
+        size_t inode_block_number = fs_table_block(fs, inode_number / INODES_PER_BLOCK);
+        *result = fs_write_table(fs, inode_block_number, &block);
+        pthread_mutex_unlock(table_lock);
+        return true;
+    }
+    pthread_mutex_unlock(table_lock);
+
+    if (!fs_inline_convert(fs, inode_number))
+    {
+        *result = false;
+        return true;
+    }
+    return false;
+}
+
+
+/**
+ * Move the data of an inline file out to data blocks: free its slots, turn
+ * the Inode into an empty block mapped file and write the data back through
+ * fs_write.
+ **/
+static bool    fs_inline_convert(FileSystem *fs, size_t inode_number)
+{
+    Block  block;
+    char   buffer[INLINE_MAX];
+
+    if (inode_number >= fs->meta_data.inodes)
+        return false;
+
+    fs_wait_scanned(fs, inode_number / INODES_PER_BLOCK + 1);
+
+    pthread_mutex_t *table_lock = fs_table_lock(fs, inode_number);
+    pthread_mutex_lock(table_lock);
+    if (!fs_load_inode_block(fs, inode_number, &block))
+    {
+        pthread_mutex_unlock(table_lock);
+        return false;
+    }
+
+    Inode *node = &block.inodes[inode_number % INODES_PER_BLOCK];
+    if (!(node->valid & INODE_INLINE))
+    {
+        pthread_mutex_unlock(table_lock);
+        return true;
+    }
+
+    size_t size = node->size;
+    fs_inline_gather(&block, node, buffer);
+    fs_inline_release(fs, &block, inode_number);
+
+    memset(node, 0, sizeof(Inode));
+    node->valid = INODE_VALID | (fs_features(&fs->meta_data) & FS_FEATURE_EXTENTS ? INODE_EXTENTS : 0);
+
+    size_t inode_block_number = fs_table_block(fs, inode_number / INODES_PER_BLOCK);
+    bool   ok = fs_write_table(fs, inode_block_number, &block);
+    pthread_mutex_unlock(table_lock);
+
+    return ok && (!size || fs_write_inode(fs, inode_number, buffer, size, 0) == (ssize_t)size);
+}
+
+
+/**
+ * Clear an inline file and its slots with a single table block write.
+ **/
+static bool    fs_inline_remove(FileSystem *fs, size_t inode_number)
+{
+    Block block;
+
+    pthread_mutex_t *table_lock = fs_table_lock(fs, inode_number);
+    pthread_mutex_lock(table_lock);
+    if (!fs_load_inode_block(fs, inode_number, &block))
+    {
+        pthread_mutex_unlock(table_lock);
+        return false;
+    }
+
+    fs_inline_release(fs, &block, inode_number);
+    memset(&block.inodes[inode_number % INODES_PER_BLOCK], 0, sizeof(Inode));
+
+    size_t inode_block_number = fs_table_block(fs, inode_number / INODES_PER_BLOCK);
+    bool   ok = fs_write_table(fs, inode_block_number, &block);
+    pthread_mutex_unlock(table_lock);
+    return ok;
+}
+
+
+/**
+ * Load the Inode of a file handle and open its block map.
+ *
+ * Note: The caller must hold the Inode lock.
+ **/
+static bool    fs_file_load(File *file)
+{
+    FileSystem *fs = file->fs;
+
+    file->generation = fs->inode_generations ? fs->inode_generations[file->inode_number % INODE_LOCKS] : 0;
+    if (!fs_load_inode(fs, file->inode_number, &file->inode))
+    {
+        memset(&file->map, 0, sizeof(FileMap));
+        return false;
+    }
+    return fs_map_open(fs, &file->map, &file->inode, fs_inode_group(&fs->meta_data, file->inode_number));
+}
+
+
+/**
+ * Reload the Inode and block map of a file handle if anything else locked
+ * the file exclusively since the handle loaded them: fs_write, fs_truncate,
+ * fs_clone, other handles, or another file sharing its Inode lock.
+ *
+ * Note: The caller must hold the Inode lock, exclusively when write is set
+ * (taking it counted as one change already).
+ *
+ * @return      Whether or not the handle still maps a valid Inode.
+ **/
+static bool    fs_file_refresh(File *file, bool write)
+{
+    FileSystem *fs = file->fs;
+
+    if (!fs->inode_generations)
+        return true;
+
+    size_t generation = fs->inode_generations[file->inode_number % INODE_LOCKS];
+    if (file->generation + write == generation)
+    {
+        file->generation = generation;
+        return true;
+    }
+
+    // 别人改过这个文件, pinned的inode和map都可能过期
+    fs_map_free(&file->map);
+    return fs_file_load(file);
+}
+
+
+/**
+ * Move data between several buffers and a file by doing the following:
+ *
+ *  1. Load and map the Inode once (inline files and delayed allocation go
+ *  through fs_read/fs_write instead).
+ *
+ *  2. Gather (write) or scatter (read) the buffers through a batch buffer
+ *  of up to IOV_BATCH_BLOCKS blocks, so block I/O is batched across small
+ *  buffers (a single buffer is used directly).
+ *
+ *  3. Write back the mapping and the Inode once.
+ *
+ * @return      Number of bytes moved (-1 on error).
+ **/
+static ssize_t fs_iov_transfer(FileSystem *fs, size_t inode_number, const struct iovec *iov, int iovcnt,
+                               size_t offset, bool write)
+{
+    Inode   inode;
+    FileMap map;
+    size_t  total = 0;
+
+    if (iovcnt < 0 || (write && fs->options & FS_MOUNT_READONLY) || !fs_load_inode(fs, inode_number, &inode))
+        return -1;
+    for (int i = 0; i < iovcnt; ++i)
+        total += iov[i].iov_len;
+    if (!total)
+        return 0;
+
+    bool mapped = !(inode.valid & INODE_INLINE) && !(fs->options & FS_MOUNT_DELALLOC);
+    if (mapped && !fs_map_open(fs, &map, &inode, fs_inode_group(&fs->meta_data, inode_number)))
+        return -1;
+
+    size_t batch  = iovcnt == 1 ? total : min(total, (size_t)IOV_BATCH_BLOCKS * BLOCK_SIZE);
+    char  *buffer = iovcnt == 1 ? (char *)iov[0].iov_base : (char *)malloc(max(batch, (size_t)1));
+    if (!buffer)
+    {
+        if (mapped)
+            fs_map_free(&map);
+        return -1;
+    }
+
+    if (mapped && write)
+    {
+        fs_journal_start(fs);
+        fs_writer_enter(fs);
+    }
+
+    ssize_t done = 0;
+    while ((size_t)done < total)
+    {
+        size_t  n = min(total - done, batch);
+        ssize_t moved;
+
+        if (write)
+        {
+            if (iovcnt != 1)
+                fs_iov_copy(iov, iovcnt, done, buffer, n, true);
+            moved = mapped ? fs_map_write(&map, buffer, n, offset + done)
+                           : fs_write_inode(fs, inode_number, buffer, n, offset + done);
+        }
+        else
+        {
+            moved = mapped ? fs_map_read(&map, buffer, n, offset + done)
+                           : fs_read_inode(fs, inode_number, buffer, n, offset + done);
+            if (moved > 0 && iovcnt != 1)
+                fs_iov_copy(iov, iovcnt, done, buffer, moved, false);
+        }
+
+        if (moved < 0)
+        {
+            done = done ? done : -1;
+            break;
+        }
+        done += moved;
+        if ((size_t)moved < n)
+            break;
+    }
+
+    if (mapped && write)
+    {
+        // write back indirect block / extent tree and inode
+        bool ok = fs_map_close(&map);
+        if (!fs_save_inode(fs, inode_number, &inode) || !ok)
+            done = -1;
+        fs_writer_exit(fs);
+        fs_journal_stop(fs);
+    }
+    else if (mapped)
+        fs_map_free(&map);
+
+    if (iovcnt != 1)
+        free(buffer);
+    return done;
+}
+
+
+/**
+ * Copy length bytes between a batch buffer and the buffers of an iovec
+ * array, starting skip bytes into the array (gather copies into buffer).
+ **/
+static void    fs_iov_copy(const struct iovec *iov, int iovcnt, size_t skip, char *buffer, size_t length,
+                           bool gather)
+{
+    int i = 0;
+    while (i < iovcnt && skip >= iov[i].iov_len)
+        skip -= iov[i++].iov_len;
+
+    for (size_t copied = 0; copied < length && i < iovcnt; ++i, skip = 0)
+    {
+        size_t sz = min(iov[i].iov_len - skip, length - copied);
+        if (gather)
+            memcpy(buffer + copied, (char *)iov[i].iov_base + skip, sz);
+        else
+            memcpy((char *)iov[i].iov_base + skip, buffer + copied, sz);
+        copied += sz;
+    }
+}
+
+
+/**
+ * Copy length bytes between two files through fs_read/fs_write in batches
+ * of up to IOV_BATCH_BLOCKS blocks.  Overlapping ranges of one file are
+ * copied back to front when the target lies after the source.
+ *
+ * @return      Number of bytes copied (-1 on error).
+ **/
+static ssize_t fs_copy_buffered(FileSystem *fs, size_t src_inode, size_t src_offset, size_t dst_inode,
+                                size_t dst_offset, size_t length)
+{
+    size_t batch    = min(length, (size_t)IOV_BATCH_BLOCKS * BLOCK_SIZE);
+    char  *buffer   = (char *)malloc(batch);
+    bool   backward = src_inode == dst_inode && dst_offset > src_offset && dst_offset < src_offset + length;
+    size_t done     = 0;
+
+    if (!buffer)
+        return -1;
+
+    while (done < length)
+    {
+        size_t n   = min(batch, length - done);
+        size_t pos = backward ? length - done - n : done;
+        if (fs_read_inode(fs, src_inode, buffer, n, src_offset + pos) != (ssize_t)n ||
+            fs_write_inode(fs, dst_inode, buffer, n, dst_offset + pos) != (ssize_t)n)
+            break;
+        done += n;
+    }
+
+    free(buffer);
+    return done;
+}
+
+
+/**
+ * Append a view, merging it with the previous one when they are adjacent
+ * in memory.
+ **/
+static void    fs_view_append(FileView *view, char *base, size_t length)
+{
+    struct iovec *prev = view->iovcnt ? &view->iov[view->iovcnt - 1] : NULL;
+    if (prev && (char *)prev->iov_base + prev->iov_len == base)
+    {
+        prev->iov_len += length;
+        return;
+    }
+
+    view->iov[view->iovcnt].iov_base = base;
+    view->iov[view->iovcnt].iov_len  = length;
+    ++view->iovcnt;
+}
+
+
+/**
+ * Maximum number of blocks a file may have with the Inode's block mapping
+ * (pointer mapped files switch to double/triple indirect blocks on demand).
+ **/
+static size_t  fs_inode_max_blocks(const Inode *inode)
+{
+    if (inode->valid & INODE_EXTENTS)
+        return UINT32_MAX;
+    return DIRECT_POINTERS_LARGE + POINTERS_PER_BLOCK +
+           POINTERS_PER_BLOCK * POINTERS_PER_BLOCK +
+           (size_t)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+}
+
+
+/**
+ * Return the size of an Inode (bits 32-47 live in the top of Inode.valid,
+ * except for inline files that keep their slot links there).
+ **/
+static size_t  fs_inode_size(const Inode *inode)
+{
+    if (inode->valid & INODE_INLINE)
+        return inode->size;
+    return inode->size | (size_t)(inode->valid >> INODE_SIZE_SHIFT) << 32;
+}
+
+
+static void    fs_inode_set_size(Inode *inode, size_t size)
+{
+    inode->size  = (uint32_t)size;
+    if (inode->valid & INODE_INLINE)
+        return;
+    inode->valid = (inode->valid & ((1u << INODE_SIZE_SHIFT) - 1)) | (uint32_t)(size >> 32) << INODE_SIZE_SHIFT;
+}
+
+
+/**
+ * Number of direct pointers of a pointer mapped Inode.
+ **/
+static size_t  fs_inode_direct(const Inode *inode)
+{
+    return inode->valid & INODE_INDIRECT3 ? DIRECT_POINTERS_LARGE : POINTERS_PER_INODE;
+}
+
+
+/**
+ * Read an indirect block through the pointer cache.
+ **/
+static bool    fs_read_pointers(FileSystem *fs, uint32_t block_number, Block *block)
+{
+    if (!fs->pointer_cache)
+        return fs_meta_read(fs, block_number, block->data);
+
+    PointerCache *entry = &fs->pointer_cache[block_number % POINTER_CACHE_BLOCKS];
+
+    pthread_mutex_lock(&fs->pointer_lock);
+    if (entry->block == block_number)
+    {
+        memcpy(block->data, entry->data.data, BLOCK_SIZE);
+        pthread_mutex_unlock(&fs->pointer_lock);
+        return true;
+    }
+    pthread_mutex_unlock(&fs->pointer_lock);
+
+    if (!fs_meta_read(fs, block_number, block->data))
+        return false;
+
+    pthread_mutex_lock(&fs->pointer_lock);
+    entry->block = block_number;
+    memcpy(entry->data.data, block->data, BLOCK_SIZE);
+    pthread_mutex_unlock(&fs->pointer_lock);
+    return true;
+}
+
+
+/**
+ * Write an indirect block through the pointer cache.
+ **/
+static bool    fs_write_pointers(FileSystem *fs, uint32_t block_number, Block *block)
+{
+    if (!fs->pointer_cache)
+        return fs_meta_write(fs, block_number, block->data);
+
+    PointerCache *entry = &fs->pointer_cache[block_number % POINTER_CACHE_BLOCKS];
+
+    pthread_mutex_lock(&fs->pointer_lock);
+    entry->block = block_number;
+    memcpy(entry->data.data, block->data, BLOCK_SIZE);
+    pthread_mutex_unlock(&fs->pointer_lock);
+
+    return fs_meta_write(fs, block_number, block->data);
+}
+
+
+/**
+ * Forget the cached indirect blocks among count blocks starting at start
+ * (the blocks are being freed and may come back as data blocks).
+ **/
+static void    fs_forget_pointers(FileSystem *fs, size_t start, size_t count)
+{
+    if (!fs->pointer_cache)
+        return;
+
+    pthread_mutex_lock(&fs->pointer_lock);
+    for (size_t b = start; b < start + count; ++b)
+    {
+        PointerCache *entry = &fs->pointer_cache[b % POINTER_CACHE_BLOCKS];
+        if (entry->block == b)
+            entry->block = 0;
+    }
+    pthread_mutex_unlock(&fs->pointer_lock);
+}
+
+
+/**
+ * Find the inode cache entry for an Inode table block, writing back the
+ * dirty block it holds first when it holds another one.
+ *
+ * Note: The caller must hold inode_cache_lock.
+ *
+ * @return      Entry for the block (NULL if the write back failed).
+ **/
+static InodeCache *fs_table_entry(FileSystem *fs, uint32_t block_number)
+{
+    InodeCache *entry = &fs->inode_cache[block_number % INODE_CACHE_BLOCKS];
+
+    // 冲突的脏块先写回 (缓存满了)
+    if (entry->block != block_number && entry->dirty)
+    {
+        if (!fs_meta_write(fs, entry->block, entry->data.data))
+            return NULL;
+        entry->dirty = false;
+    }
+    return entry;
+}
+
+
+/**
+ * Read an Inode table block through the inode cache.
+ **/
+static bool    fs_read_table(FileSystem *fs, uint32_t block_number, Block *block)
+{
+    return fs_read_table_range(fs, block_number, 0, block->data, BLOCK_SIZE);
+}
+
+
+/**
+ * Copy length bytes at offset of an Inode table block out of the inode
+ * cache, so loading one Inode does not copy the whole block under the lock.
+ **/
+static bool    fs_read_table_range(FileSystem *fs, uint32_t block_number, size_t offset, char *data, size_t length)
+{
+    if (!fs->inode_cache)
+    {
+        Block block;
+        if (!fs_meta_read(fs, block_number, block.data))
+            return false;
+        memcpy(data, block.data + offset, length);
+        return true;
+    }
+
+    // 缺失时在锁里读, 不会装进比缓存里更旧的内容
+    pthread_mutex_lock(&fs->inode_cache_lock);
+    InodeCache *entry = fs_table_entry(fs, block_number);
+    bool        ok    = entry != NULL;
+    if (ok && entry->block != block_number)
+    {
+        entry->block = 0;
+        ok = fs_meta_read(fs, block_number, entry->data.data);
+        if (ok)
+            entry->block = block_number;
+    }
+    if (ok)
+        memcpy(data, entry->data.data + offset, length);
+    pthread_mutex_unlock(&fs->inode_cache_lock);
+    return ok;
+}
+
+
+/**
+ * Write an Inode table block through the inode cache.  With
+ * FS_MOUNT_WRITEBACK the block is only marked dirty and written back by
+ * fs_flush_table, so changes to many Inodes of a block cost one write.
+ * Otherwise (and always with a journal, whose running transaction already
+ * collects the block until the commit) it is written through.
+ **/
+static bool    fs_write_table(FileSystem *fs, uint32_t block_number, Block *block)
+{
+    if (!fs->inode_cache)
+        return fs_meta_write(fs, block_number, block->data);
+
+    bool writeback = fs->options & FS_MOUNT_WRITEBACK && !fs_journaled(fs);
+
+    pthread_mutex_lock(&fs->inode_cache_lock);
+    InodeCache *entry = fs_table_entry(fs, block_number);
+    if (entry)
+    {
+        entry->block = block_number;
+        entry->dirty = writeback;
+        memcpy(entry->data.data, block->data, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&fs->inode_cache_lock);
+
+    return entry && (writeback || fs_meta_write(fs, block_number, block->data));
+}
+
+
+static int     fs_table_compare(const void *a, const void *b)
+{
+    uint32_t x = (*(InodeCache * const *)a)->block;
+    uint32_t y = (*(InodeCache * const *)b)->block;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * Write back the dirty blocks of the inode cache in block order, each run
+ * of consecutive blocks with a single disk request.
+ *
+ * @return      Whether or not all blocks were written.
+ **/
+static bool    fs_flush_table(FileSystem *fs)
+{
+    if (!fs->inode_cache)
+        return true;
+
+    InodeCache *dirty[INODE_CACHE_BLOCKS];
+    Block      *run = (Block *)malloc(INODE_CACHE_BLOCKS * sizeof(Block));
+    size_t      n   = 0;
+    bool        ok  = run != NULL;
+
+    pthread_mutex_lock(&fs->inode_cache_lock);
+    for (size_t k = 0; k < INODE_CACHE_BLOCKS; ++k)
+        if (fs->inode_cache[k].dirty)
+            dirty[n++] = &fs->inode_cache[k];
+    qsort(dirty, n, sizeof(InodeCache *), fs_table_compare);
+
+    for (size_t i = 0; i < n && ok; )
+    {
+        size_t count = 0;
+        while (i + count < n && dirty[i + count]->block == dirty[i]->block + count)
+        {
+            memcpy(run[count].data, dirty[i + count]->data.data, BLOCK_SIZE);
+            ++count;
+        }
+        ok = disk_write_blocks(fs->disk, dirty[i]->block, count, run[0].data) != DISK_FAILURE;
+        for (size_t k = 0; k < count && ok; ++k)
+            dirty[i + k]->dirty = false;
+        i += count;
+    }
+    pthread_mutex_unlock(&fs->inode_cache_lock);
+
+    free(run);
+    return ok;
+}
+
+
+/**
+ * Write back one Inode table block if the inode cache holds it dirty.
+ **/
+static bool    fs_flush_table_block(FileSystem *fs, uint32_t block_number)
+{
+    if (!fs->inode_cache)
+        return true;
+
+    InodeCache *entry = &fs->inode_cache[block_number % INODE_CACHE_BLOCKS];
+    bool        ok    = true;
+
+    pthread_mutex_lock(&fs->inode_cache_lock);
+    if (entry->block == block_number && entry->dirty)
+    {
+        ok = fs_meta_write(fs, block_number, entry->data.data);
+        entry->dirty = !ok;
+    }
+    pthread_mutex_unlock(&fs->inode_cache_lock);
+    return ok;
+}
+
+
+/**
+ * Flush the disk image on behalf of the caller by doing the following:
+ *
+ *  1. Take a ticket, then wait for the flush in progress (it may have
+ *  started before the caller's writes finished).
+ *
+ *  2. Return if a flush started after the ticket was taken has succeeded
+ *  meanwhile.
+ *
+ *  3. Otherwise flush once for every ticket taken so far.
+ *
+ * Note: A failed flush covers nobody, so its waiters try again themselves.
+ *
+ * @return      Whether or not the writes issued before the call are durable.
+ **/
+static bool    fs_disk_sync(FileSystem *fs)
+{
+    pthread_mutex_lock(&fs->sync_lock);
+    size_t ticket = ++fs->sync_requested;
+    while (fs->sync_busy)
+        pthread_cond_wait(&fs->sync_cond, &fs->sync_lock);
+
+    if (fs->sync_done >= ticket)
+    {
+        pthread_mutex_unlock(&fs->sync_lock);
+        return true;
+    }
+
+    // 排在后面的调用者都等这一次
+    size_t covered = fs->sync_requested;
+    fs->sync_busy  = true;
+    pthread_mutex_unlock(&fs->sync_lock);
+
+    bool ok = disk_sync(fs->disk);
+
+    pthread_mutex_lock(&fs->sync_lock);
+    if (ok)
+        fs->sync_done = covered;
+    fs->sync_busy = false;
+    pthread_cond_broadcast(&fs->sync_cond);
+    pthread_mutex_unlock(&fs->sync_lock);
+    return ok;
+}
+
+
+/**
+ * Prepare a FileMap for looking up and changing the blocks of an Inode (the
+ * extent list is loaded into memory right away).
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       map         FileMap to initialize.
+ * @param       inode       Inode to map (updated in place by fs_map_close).
+ * @param       group       Block group for new metadata blocks.
+ * @return      Whether or not the mapping could be loaded.
+ **/
+static bool    fs_map_open(FileSystem *fs, FileMap *map, Inode *inode, size_t group)
+{
+    memset(map, 0, sizeof(FileMap));
+    map->fs         = fs;
+    map->inode      = inode;
+    map->group      = group;
+    map->dirty_from = SIZE_MAX;
+
+    if (inode->valid & INODE_EXTENTS)
+        return fs_extent_load(fs->disk, map);
+    return true;
+}
+
+
+/**
+ * Write back the changed parts of the mapping (indirect blocks or extent
+ * tree) and release the FileMap.
+ *
+ * Note: The caller still has to save the Inode itself.
+ *
+ * @return      Whether or not all disk operations were successful.
+ **/
+static bool    fs_map_close(FileMap *map)
+{
+    bool ok = fs_map_flush(map);
+    fs_map_free(map);
+    return ok;
+}
+
+
+/**
+ * Write back the changed parts of the mapping but keep it loaded (open
+ * file handles keep using it).
+ *
+ * @return      Whether or not all disk operations were successful.
+ **/
+static bool    fs_map_flush(FileMap *map)
+{
+    FileSystem *fs    = map->fs;
+    Inode      *inode = map->inode;
+    bool        ok    = fs_map_path_flush(map);
+
+    if (map->indirect_dirty)
+    {
+        // indirect block不再映射任何块时归还
+        size_t k = 0;
+        while (k < POINTERS_PER_BLOCK && !map->indirect.pointers[k])
+            ++k;
+        if (k == POINTERS_PER_BLOCK)
+        {
+            fs_release_free_block(fs, inode->indirect);
+            inode->indirect = 0;
+        }
+        else if (!fs_write_pointers(fs, inode->indirect, &map->indirect))
+        {
+            error("Fail to write back indirect block %d\n", inode->indirect);
+            ok = false;
+        }
+        map->indirect_dirty = false;
+    }
+
+    if (map->dirty_from != SIZE_MAX)
+        ok = fs_extent_store(map) && ok;
+
+    return ok;
+}
+
+
+/**
+ * Load the indirect block of a pointer mapped Inode (all zeros if it has
+ * none yet).
+ **/
+static bool    fs_map_load_indirect(FileMap *map)
+{
+    if (map->indirect_loaded)
+        return true;
+
+    if (!map->inode->indirect)
+        memset(map->indirect.data, 0, BLOCK_SIZE);
+    else if (!fs_read_pointers(map->fs, map->inode->indirect, &map->indirect))
+    {
+        error("Fail to read indirect block %d\n", map->inode->indirect);
+        return false;
+    }
+    map->indirect_loaded = true;
+    return true;
+}
+
+
+/**
+ * Write back the dirty levels of the cached double/triple indirect path.
+ **/
+static bool    fs_map_path_flush(FileMap *map)
+{
+    bool ok = true;
+    for (size_t level = 0; level < 3; ++level)
+    {
+        if (!map->path_dirty[level])
+            continue;
+        if (!fs_write_pointers(map->fs, map->path_block[level], &map->path[level]))
+        {
+            error("Fail to write back indirect block %u\n", map->path_block[level]);
+            ok = false;
+        }
+        map->path_dirty[level] = false;
+    }
+    return ok;
+}
+
+
+/**
+ * Load an indirect block into the path level for its height (1 for blocks
+ * that point at data), writing back the block it replaces if needed.
+ **/
+static Block * fs_map_path_load(FileMap *map, size_t level, uint32_t block_number, bool fresh)
+{
+    if (!map->path && !(map->path = (Block *)calloc(3, sizeof(Block))))
+        return NULL;
+
+    Block *node = &map->path[level];
+    if (map->path_block[level] == block_number && !fresh)
+        return node;
+
+    if (map->path_dirty[level] && !fs_write_pointers(map->fs, map->path_block[level], node))
+        return NULL;
+    map->path_dirty[level] = fresh;
+    map->path_block[level] = 0;
+
+    if (fresh)
+        memset(node->data, 0, BLOCK_SIZE);
+    else if (!fs_read_pointers(map->fs, block_number, node))
+        return NULL;
+
+    map->path_block[level] = block_number;
+    return node;
+}
+
+
+/**
+ * Walk the double or triple indirect tree down to the slot that maps the
+ * given block (counted from the end of the single indirect range),
+ * allocating missing indirect blocks if asked to.
+ *
+ * @return      Pointer to the slot in the cached level 1 block (NULL if it
+ *              does not exist).
+ **/
+static uint32_t *fs_map_tree_slot(FileMap *map, size_t index, bool allocate)
+{
+    Inode    *inode  = map->inode;
+    size_t    height = 2;
+    size_t    span   = POINTERS_PER_BLOCK;          // blocks mapped by one child
+    uint32_t *slot   = &inode->double_indirect;
+    ssize_t   owner  = -1;                          // path level holding slot (-1: inode)
+
+    if (index >= POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+    {
+        index -= POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+        height = 3;
+        span   = POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+        slot   = &inode->triple_indirect;
+    }
+
+    for (; height; --height, span /= POINTERS_PER_BLOCK)
+    {
+        bool fresh = false;
+        if (!*slot)
+        {
+            ssize_t block_number;
+            if (!allocate || (block_number = fs_allocate_free_block(map->fs, map->group)) < 0)
+                return NULL;
+            *slot = block_number;
+            fresh = true;
+            if (owner >= 0)
+                map->path_dirty[owner] = true;
+        }
+
+        Block *node = fs_map_path_load(map, height - 1, *slot, fresh);
+        if (!node)
+            return NULL;
+        slot  = &node->pointers[(index / span) % POINTERS_PER_BLOCK];
+        owner = height - 1;
+    }
+    return slot;
+}
+
+
+/**
+ * Look up the pointer for a file block (0 if not mapped).  When run is not
+ * NULL it holds the largest run the caller is interested in, and receives
+ * the number of blocks from index on that are mapped contiguously (or are
+ * all unmapped).
+ **/
+static uint32_t fs_map_get(FileMap *map, size_t index, size_t *run)
+{
+    size_t limit  = fs_inode_max_blocks(map->inode);
+    size_t wanted = run ? max(*run, (size_t)1) : 1;
+    if (index >= limit)
+    {
+        if (run)
+            *run = 0;
+        return 0;
+    }
+
+    if (map->inode->valid & INODE_EXTENTS)
+    {
+        size_t i = fs_extent_search(map, index);
+        if (i && index < fs_extent_end(&map->extents[i - 1]))
+        {
+            Extent *e   = &map->extents[i - 1];
+            size_t  off = index - e->logical;
+            if (run)
+                *run = min(wanted, EXTENT_LENGTH(e->length) - off);
+            return (e->start + off) | (e->length & EXTENT_UNWRITTEN ? POINTER_UNWRITTEN : 0);
+        }
+        if (run)
+            *run = min(wanted, (i < map->nextents ? map->extents[i].logical : limit) - index);
+        return 0;
+    }
+
+    uint32_t pointer = fs_map_pointer(map, index);
+    if (run)
+    {
+        *run = 1;
+        while (*run < wanted && index + *run < limit &&
+               fs_map_pointer(map, index + *run) == (pointer ? pointer + *run : 0))
+            ++*run;
+    }
+    return pointer;
+}
+
+
+/**
+ * Look up the pointer for a file block of a pointer mapped Inode.
+ **/
+static uint32_t fs_map_pointer(FileMap *map, size_t index)
+{
+    Inode *inode  = map->inode;
+    size_t direct = fs_inode_direct(inode);
+
+    if (index < direct)
+        return inode->direct[index];
+    index -= direct;
+
+    if (index < POINTERS_PER_BLOCK)
+    {
+        if (!inode->indirect || !fs_map_load_indirect(map))
+            return 0;
+        return map->indirect.pointers[index];
+    }
+
+    if (!(inode->valid & INODE_INDIRECT3))
+        return 0;
+    uint32_t *slot = fs_map_tree_slot(map, index - POINTERS_PER_BLOCK, false);
+    return slot ? *slot : 0;
+}
+
+
+/**
+ * Switch a full pointer mapped Inode to the INODE_INDIRECT3 layout: the last
+ * two direct pointers become the double and triple indirect pointers, so
+ * every block from the fourth one on moves two slots further.
+ **/
+static bool    fs_map_upgrade(FileMap *map)
+{
+    FileSystem *fs    = map->fs;
+    Inode      *inode = map->inode;
+    uint32_t    old[POINTERS_PER_INODE + POINTERS_PER_BLOCK];
+
+    for (size_t i = 0; i < POINTERS_PER_INODE + POINTERS_PER_BLOCK; ++i)
+        old[i] = fs_map_pointer(map, i);
+
+    inode->valid          |= INODE_INDIRECT3;
+    inode->double_indirect = 0;
+    inode->triple_indirect = 0;
+    if (inode->indirect)
+    {
+        memset(map->indirect.data, 0, BLOCK_SIZE);
+        map->indirect_loaded = true;
+        map->indirect_dirty  = true;
+    }
+
+    for (size_t i = DIRECT_POINTERS_LARGE; i < POINTERS_PER_INODE + POINTERS_PER_BLOCK; ++i)
+        if (old[i] && !fs_map_set(map, i, old[i], 1))
+            return false;
+
+    // 旧版本不认识这种inode, 在super block里记下
+    return fs_add_feature(fs, FS_FEATURE_LARGE_FILES);
+}
+
+
+/**
+ * Start counting the extra references to shared data blocks (once every
+ * Inode has been scanned, so the counts are complete) and record
+ * FS_FEATURE_REFLINK in the SuperBlock.
+ **/
+static bool    fs_enable_shares(FileSystem *fs)
+{
+    fs_wait_scanned(fs, fs->meta_data.inode_blocks);
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (!fs->block_shares)
+        __atomic_store_n(&fs->block_shares, (uint32_t *)calloc(fs->meta_data.blocks, sizeof(uint32_t)),
+                         __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    return fs->block_shares && fs_add_feature(fs, FS_FEATURE_REFLINK);
+}
+
+
+/**
+ * Record a feature in the SuperBlock the first time it is used, so older
+ * versions refuse to mount the Disk.
+ **/
+static bool    fs_add_feature(FileSystem *fs, uint32_t feature)
+{
+    pthread_mutex_lock(&fs->super_lock);
+    if (fs->meta_data.features & feature)
+    {
+        pthread_mutex_unlock(&fs->super_lock);
+        return true;
+    }
+
+    __atomic_or_fetch(&fs->meta_data.features, feature, __ATOMIC_RELAXED);
+    bool ok = fs_write_super(fs);
+    pthread_mutex_unlock(&fs->super_lock);
+    return ok;
+}
+
+
+/**
+ * Write the in-memory SuperBlock back to the Disk.
+ *
+ * Note: The caller must hold super_lock.
+ **/
+static bool    fs_write_super(FileSystem *fs)
+{
+    Block block;
+
+    memset(block.data, 0, BLOCK_SIZE);
+    memcpy(&block.super, &fs->meta_data, sizeof(SuperBlock));
+    return disk_write(fs->disk, 0, block.data) != DISK_FAILURE;
+}
+
+
+/**
+ * Whether or not metadata updates go through the journal.  The running
+ * transaction is swapped by commits but never becomes NULL while mounted.
+ **/
+static bool    fs_journaled(FileSystem *fs)
+{
+    return __atomic_load_n(&fs->running, __ATOMIC_RELAXED) != NULL;
+}
+
+
+/**
+ * Number of blocks one transaction may log: the descriptor block lists at
+ * most JOURNAL_ENTRIES homes and the images follow it in the journal.
+ **/
+static size_t  fs_journal_limit(FileSystem *fs)
+{
+    return min((size_t)JOURNAL_ENTRIES, (size_t)fs->meta_data.journal_blocks - 2);
+}
+
+
+/**
+ * Open the journal of a mounted FileSystem by doing the following:
+ *
+ *  1. Read the journal header and the descriptor block.
+ *
+ *  2. If the descriptor belongs to the current sequence and its checksum
+ *     matches, the last commit did not finish its checkpoint: copy the
+ *     logged images to their home blocks again and advance the header.
+ *
+ *  3. Allocate the running and committing transactions.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not the journal was opened.
+ **/
+static bool    fs_journal_open(FileSystem *fs)
+{
+    SuperBlock *sb = &fs->meta_data;
+    Block       header;
+
+    if (disk_read(fs->disk, sb->journal, header.data) == DISK_FAILURE ||
+        header.journal.magic != JOURNAL_MAGIC)
+        return false;
+    fs->sequence = header.journal.sequence;
+
+    size_t limit = fs_journal_limit(fs);
+    Block *log   = (Block *)malloc((limit + 1) * sizeof(Block));
+    if (!log)
+        return false;
+
+    bool ok = disk_read(fs->disk, sb->journal + 1, log[0].data) != DISK_FAILURE;
+    JournalBlock *descriptor = &log[0].journal;
+    if (ok && descriptor->magic == JOURNAL_MAGIC && descriptor->sequence == fs->sequence &&
+        descriptor->count && descriptor->count <= limit &&
+        disk_read_blocks(fs->disk, sb->journal + 2, descriptor->count, log[1].data) != DISK_FAILURE &&
+        fs_journal_checksum(log, descriptor->count) == descriptor->checksum)
+    {
+        // 重放上次没有写完的提交
+        debug("replaying journal sequence %u (%u blocks)", fs->sequence, descriptor->count);
+        for (size_t i = 0; i < descriptor->count && ok; ++i)
+        {
+            uint32_t home = descriptor->blocks[i];
+            ok = home && home < sb->blocks &&
+                 disk_write(fs->disk, home, log[i + 1].data) != DISK_FAILURE;
+        }
+
+        memset(header.data, 0, BLOCK_SIZE);
+        header.journal.magic    = JOURNAL_MAGIC;
+        header.journal.sequence = ++fs->sequence;
+        ok = ok && disk_sync(fs->disk) && disk_write(fs->disk, sb->journal, header.data) != DISK_FAILURE;
+    }
+    free(log);
+    if (!ok)
+        return false;
+
+    fs->running    = fs_transaction_alloc(fs);
+    fs->committing = fs_transaction_alloc(fs);
+    if (!fs->running || !fs->committing)
+    {
+        fs_transaction_free(fs->running);
+        fs_transaction_free(fs->committing);
+        fs->running = fs->committing = NULL;
+        return false;
+    }
+
+    pthread_mutex_init(&fs->journal_lock, NULL);
+    pthread_cond_init(&fs->journal_cond, NULL);
+    fs->journal_busy = false;
+    fs->handles      = 0;
+    return true;
+}
+
+
+/**
+ * Commit the running transaction and release the journal.
+ **/
+static void    fs_journal_close(FileSystem *fs)
+{
+    if (!fs_journaled(fs))
+        return;
+
+    if (!fs_journal_commit(fs))
+        error("Fail to commit journal sequence %u", fs->sequence);
+
+    fs_transaction_free(fs->running);
+    fs_transaction_free(fs->committing);
+    fs->running = fs->committing = NULL;
+    pthread_cond_destroy(&fs->journal_cond);
+    pthread_mutex_destroy(&fs->journal_lock);
+}
+
+
+static Transaction *fs_transaction_alloc(FileSystem *fs)
+{
+    Transaction *tx = (Transaction *)calloc(1, sizeof(Transaction));
+    if (!tx)
+        return NULL;
+
+    tx->blocks = (Block *)malloc((fs_journal_limit(fs) + 1) * sizeof(Block));
+    tx->slots  = (uint32_t *)calloc(JOURNAL_SLOTS, sizeof(uint32_t));
+    if (!tx->blocks || !tx->slots)
+    {
+        fs_transaction_free(tx);
+        return NULL;
+    }
+    return tx;
+}
+
+
+static void    fs_transaction_free(Transaction *tx)
+{
+    if (!tx)
+        return;
+    free(tx->blocks);
+    free(tx->slots);
+    free(tx->frees);
+    free(tx);
+}
+
+
+/**
+ * Look up the hash slot of a home block in a transaction.
+ *
+ * @return      Slot holding the block, or the empty slot where it would go.
+ **/
+static ssize_t fs_transaction_find(const Transaction *tx, uint32_t block_number)
+{
+    size_t slot = (block_number * 2654435761u) & (JOURNAL_SLOTS - 1);
+
+    // 线性探测; slot里存的是镜像位置 + 1
+    while (tx->slots[slot] && tx->blocks[0].journal.blocks[tx->slots[slot] - 1] != block_number)
+        slot = (slot + 1) & (JOURNAL_SLOTS - 1);
+    return slot;
+}
+
+
+/**
+ * Checksum of the count logged images and their home blocks, so a commit
+ * torn by a crash is not replayed.
+ **/
+static uint32_t fs_journal_checksum(const Block *blocks, size_t count)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; ++i)
+        sum = sum * 31 + fs_block_hash(blocks[i + 1].data) + blocks[0].journal.blocks[i];
+    return (uint32_t)(sum ^ (sum >> 32));
+}
+
+
+/**
+ * Open a handle on the running transaction: metadata updates made until
+ * the matching fs_journal_stop are committed together (unless they overflow
+ * one transaction).
+ **/
+static void    fs_journal_start(FileSystem *fs)
+{
+    if (!fs_journaled(fs))
+        return;
+
+    pthread_mutex_lock(&fs->journal_lock);
+    ++fs->handles;
+    pthread_mutex_unlock(&fs->journal_lock);
+}
+
+
+/**
+ * Close a handle.  The last handle to leave commits the running transaction
+ * once it is half full, so operations running together share one commit.
+ **/
+static void    fs_journal_stop(FileSystem *fs)
+{
+    if (!fs_journaled(fs))
+        return;
+
+    pthread_mutex_lock(&fs->journal_lock);
+    bool commit = !--fs->handles && fs->running->count >= fs_journal_limit(fs) / 2;
+    pthread_mutex_unlock(&fs->journal_lock);
+
+    if (commit && !fs_journal_commit(fs))
+        error("Fail to commit journal sequence %u", fs->sequence);
+}
+
+
+/**
+ * Commit the running transaction by doing the following:
+ *
+ *  1. Wait for a commit in progress, then swap the running transaction with
+ *     the empty committing one so new updates keep going.
+ *
+ *  2. Write the descriptor and all logged images to the journal with one
+ *     request, and flush the disk so they (and the data blocks written
+ *     before them) are durable before any home block is overwritten.
+ *
+ *  3. Checkpoint: write each image to its home block, flush again, then
+ *     advance the journal header so the descriptor is no longer replayed.
+ *
+ *  4. Release the blocks freed by the transaction, which may now be reused.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not the commit succeeded.
+ **/
+static bool    fs_journal_commit(FileSystem *fs)
+{
+    if (!fs_journaled(fs))
+        return true;
+
+    pthread_mutex_lock(&fs->journal_lock);
+    while (fs->journal_busy)
+        pthread_cond_wait(&fs->journal_cond, &fs->journal_lock);
+
+    Transaction *tx = fs->running;
+    if (!tx->count && !tx->nfrees)
+    {
+        pthread_mutex_unlock(&fs->journal_lock);
+        return true;
+    }
+
+    __atomic_store_n(&fs->running, fs->committing, __ATOMIC_RELAXED);
+    fs->committing   = tx;
+    fs->journal_busy = true;
+    uint32_t sequence = fs->sequence;
+    if (tx->count)
+        ++fs->sequence;
+    pthread_mutex_unlock(&fs->journal_lock);
+
+    bool ok = true;
+    if (tx->count)
+    {
+        SuperBlock   *sb         = &fs->meta_data;
+        JournalBlock *descriptor = &tx->blocks[0].journal;
+        descriptor->magic    = JOURNAL_MAGIC;
+        descriptor->sequence = sequence;
+        descriptor->count    = tx->count;
+        descriptor->checksum = fs_journal_checksum(tx->blocks, tx->count);
+        memset(descriptor->blocks + tx->count, 0, (JOURNAL_ENTRIES - tx->count) * sizeof(uint32_t));
+
+        ok = disk_write_blocks(fs->disk, sb->journal + 1, tx->count + 1, tx->blocks[0].data) != DISK_FAILURE;
+        ok = ok && fs_disk_sync(fs);
+        for (size_t i = 0; i < tx->count && ok; ++i)
+            ok = disk_write(fs->disk, descriptor->blocks[i], tx->blocks[i + 1].data) != DISK_FAILURE;
+        ok = ok && fs_disk_sync(fs);
+
+        Block header;
+        memset(header.data, 0, BLOCK_SIZE);
+        header.journal.magic    = JOURNAL_MAGIC;
+        header.journal.sequence = sequence + 1;
+        ok = ok && disk_write(fs->disk, sb->journal, header.data) != DISK_FAILURE;
+    }
+
+    // 提交以后释放的块才能被重新分配
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (size_t i = 0; i < tx->nfrees; ++i)
+        fs_pool_release(fs, tx->frees[i]);
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    pthread_mutex_lock(&fs->journal_lock);
+    memset(tx->slots, 0, JOURNAL_SLOTS * sizeof(uint32_t));
+    tx->count        = 0;
+    tx->nfrees       = 0;
+    fs->journal_busy = false;
+    pthread_cond_broadcast(&fs->journal_cond);
+    pthread_mutex_unlock(&fs->journal_lock);
+    return ok;
+}
+
+
+/**
+ * Hold a freed block in the running transaction until it commits, so it is
+ * not reused while the committed metadata still refers to it.
+ *
+ * @return      Whether or not the block was deferred (false without journal).
+ **/
+static bool    fs_journal_defer(FileSystem *fs, size_t block_number)
+{
+    if (!fs_journaled(fs))
+        return false;
+
+    pthread_mutex_lock(&fs->journal_lock);
+    Transaction *tx = fs->running;
+    if (tx->nfrees == tx->free_capacity)
+    {
+        size_t    capacity = max(tx->free_capacity * 2, (size_t)64);
+        uint32_t *frees    = (uint32_t *)realloc(tx->frees, capacity * sizeof(uint32_t));
+        if (!frees)
+        {
+            pthread_mutex_unlock(&fs->journal_lock);
+            return false;
         }
+        tx->frees         = frees;
+        tx->free_capacity = capacity;
+    }
+    tx->frees[tx->nfrees++] = block_number;
+    pthread_mutex_unlock(&fs->journal_lock);
+    return true;
+}
+
+
+/**
+ * Commit the running transaction when it holds freed blocks, so that an
+ * allocation failing on a full disk can retry.
+ *
+ * @return      Whether or not any block was released.
+ **/
+static bool    fs_journal_reclaim(FileSystem *fs)
+{
+    if (!fs_journaled(fs))
+        return false;
+
+    pthread_mutex_lock(&fs->journal_lock);
+    bool frees = fs->running->nfrees > 0;
+    pthread_mutex_unlock(&fs->journal_lock);
+
+    return frees && fs_journal_commit(fs);
+}
 
-        // 读取indirect block
-        if (bytes_read < length && inode.indirect)
+
+/**
+ * Read a metadata block, preferring the image logged by an uncommitted
+ * transaction over the (older) home block.
+ **/
+static bool    fs_meta_read(FileSystem *fs, size_t block_number, char *data)
+{
+    if (fs_journaled(fs))
+    {
+        pthread_mutex_lock(&fs->journal_lock);
+        Transaction *txs[] = {fs->running, fs->journal_busy ? fs->committing : NULL};
+        for (size_t t = 0; t < 2; ++t)
         {
-            // 读取indirect block
-            Block indirect_block;
+            if (!txs[t])
+                continue;
+            ssize_t slot = fs_transaction_find(txs[t], block_number);
+            if (txs[t]->slots[slot])
+            {
+                memcpy(data, txs[t]->blocks[txs[t]->slots[slot]].data, BLOCK_SIZE);
+                pthread_mutex_unlock(&fs->journal_lock);
+                return true;
+            }
+        }
+        pthread_mutex_unlock(&fs->journal_lock);
+    }
+
+    return disk_read(fs->disk, block_number, data) != DISK_FAILURE;
+}
 
-            if (!disk_read(fs->disk, inode.indirect, indirect_block.data))
+
+/**
+ * Write a metadata block: log its image in the running transaction, or
+ * write it in place when the FileSystem has no journal.  A full
+ * transaction is committed first, which splits the current operation.
+ **/
+static bool    fs_meta_write(FileSystem *fs, size_t block_number, char *data)
+{
+    if (!fs_journaled(fs))
+        return disk_write(fs->disk, block_number, data) != DISK_FAILURE;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&fs->journal_lock);
+        Transaction *tx   = fs->running;
+        ssize_t      slot = fs_transaction_find(tx, block_number);
+        if (tx->slots[slot] || tx->count < fs_journal_limit(fs))
+        {
+            if (!tx->slots[slot])
             {
-                error("Fail to read block %d\n", inode.indirect);
-                return -1;
+                tx->blocks[0].journal.blocks[tx->count] = block_number;
+                tx->slots[slot] = ++tx->count;
+            }
+            memcpy(tx->blocks[tx->slots[slot]].data, data, BLOCK_SIZE);
+            pthread_mutex_unlock(&fs->journal_lock);
+            return true;
+        }
+        pthread_mutex_unlock(&fs->journal_lock);
+
+        if (!fs_journal_commit(fs))
+            return false;
+    }
+}
+
+
+/**
+ * Make sure the metadata needed to map a file block exists, so that it is
+ * allocated in front of the data it maps (indirect blocks of a pointer
+ * mapped Inode; extent tree blocks are placed by fs_map_close).
+ **/
+static bool    fs_map_reserve(FileMap *map, size_t index)
+{
+    Inode *inode = map->inode;
+    if (inode->valid & INODE_EXTENTS)
+        return true;
+
+    if (index >= POINTERS_PER_INODE + POINTERS_PER_BLOCK && !(inode->valid & INODE_INDIRECT3) &&
+        !fs_map_upgrade(map))
+        return false;
+
+    size_t direct = fs_inode_direct(inode);
+    if (index < direct)
+        return true;
+    if (index >= direct + POINTERS_PER_BLOCK)
+        return fs_map_tree_slot(map, index - direct - POINTERS_PER_BLOCK, true) != NULL;
+    if (inode->indirect)
+        return true;
+
+    ssize_t indirect = fs_allocate_free_block(map->fs, map->group);
+    if (indirect < 0)
+        return false;
+
+    inode->indirect = indirect;
+    memset(map->indirect.data, 0, BLOCK_SIZE);
+    map->indirect_loaded = true;
+    map->indirect_dirty  = true;
+    return true;
+}
+
+
+/**
+ * Map count file blocks starting at index to consecutive disk blocks
+ * starting at pointer (which may carry POINTER_UNWRITTEN), or unmap them if
+ * pointer is 0.
+ **/
+static bool    fs_map_set(FileMap *map, size_t index, uint32_t pointer, size_t count)
+{
+    if (map->inode->valid & INODE_EXTENTS)
+        return fs_extent_set(map, index, pointer, count);
+
+    for (size_t k = 0; k < count; ++k)
+    {
+        size_t   idx   = index + k;
+        uint32_t value = pointer ? pointer + k : 0;
+        if (idx >= fs_inode_max_blocks(map->inode))
+            return false;
+        if (value && !fs_map_reserve(map, idx))
+            return false;
+
+        size_t direct = fs_inode_direct(map->inode);
+        if (idx < direct)
+            map->inode->direct[idx] = value;
+        else if (idx < direct + POINTERS_PER_BLOCK)
+        {
+            if (!map->inode->indirect)
+                continue;
+            if (!fs_map_load_indirect(map))
+                return false;
+            map->indirect.pointers[idx - direct] = value;
+            map->indirect_dirty = true;
+        }
+        else if (map->inode->valid & INODE_INDIRECT3)
+        {
+            uint32_t *slot = fs_map_tree_slot(map, idx - direct - POINTERS_PER_BLOCK, false);
+            if (slot)
+            {
+                *slot = value;
+                map->path_dirty[0] = true;
+            }
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Release the data blocks of an indirect (sub)tree at or after block from
+ * (counted inside the tree), together with indirect blocks that end up
+ * empty.
+ *
+ * @return      Whether or not the root of the tree was released.
+ **/
+static bool    fs_map_release_tree(FileMap *map, uint32_t block_number, size_t height, size_t from)
+{
+    FileSystem *fs   = map->fs;
+    size_t      span = 1;
+    Block       node;
+
+    for (size_t h = 1; h < height; ++h)
+        span *= POINTERS_PER_BLOCK;
+
+    if (!fs_read_pointers(fs, block_number, &node))
+    {
+        error("Fail to read indirect block %u\n", block_number);
+        return false;
+    }
+
+    bool   empty = true;
+    size_t start = 0;
+    size_t count = 0;
+    for (size_t k = 0; k < POINTERS_PER_BLOCK; ++k)
+    {
+        uint32_t pointer = node.pointers[k];
+        if (!pointer)
+            continue;
+        if (k < from / span)
+        {
+            empty = false;
+            continue;
+        }
+
+        size_t child_from = k == from / span ? from % span : 0;
+        if (height == 1)
+            fs_release_collect(fs, &start, &count, POINTER_BLOCK(pointer));
+        else if (!fs_map_release_tree(map, pointer, height - 1, child_from))
+        {
+            empty = false;
+            continue;
+        }
+        node.pointers[k] = 0;
+    }
+    fs_release_free_run(fs, start, count);
+
+    if (empty)
+        fs_release_free_block(fs, block_number);
+    else if (!fs_write_pointers(fs, block_number, &node))
+        error("Fail to write back indirect block %u\n", block_number);
+    return empty;
+}
+
+
+/**
+ * Release every data block mapped at or after file block from (and the
+ * metadata blocks that are no longer needed).
+ **/
+static void    fs_map_release(FileMap *map, size_t from)
+{
+    FileSystem *fs    = map->fs;
+    Inode      *inode = map->inode;
+
+    if (inode->valid & INODE_EXTENTS)
+    {
+        for (size_t i = 0; i < map->nextents; ++i)
+        {
+            Extent *e     = &map->extents[i];
+            size_t  first = max(from, (size_t)e->logical);
+            if (first < fs_extent_end(e))
+                fs_release_free_run(fs, e->start + first - e->logical, fs_extent_end(e) - first);
+        }
+        fs_extent_set(map, from, 0, fs_inode_max_blocks(inode) - from);
+        return;
+    }
+
+    size_t direct = fs_inode_direct(inode);
+    size_t start  = 0;
+    size_t count  = 0;
+
+    // release direct blocks (contiguous ones as a single run)
+    for (size_t i = from; i < direct; ++i)
+    {
+        if (inode->direct[i])
+            fs_release_collect(fs, &start, &count, POINTER_BLOCK(inode->direct[i]));
+        inode->direct[i] = 0;
+    }
+
+    // release indirect blocks
+    if (inode->indirect && from < direct + POINTERS_PER_BLOCK && fs_map_load_indirect(map))
+    {
+        size_t first = from > direct ? from - direct : 0;
+        for (size_t i = first; i < POINTERS_PER_BLOCK; ++i)
+        {
+            if (map->indirect.pointers[i])
+                fs_release_collect(fs, &start, &count, POINTER_BLOCK(map->indirect.pointers[i]));
+            map->indirect.pointers[i] = 0;
+        }
+        map->indirect_dirty = true;
+
+        if (!first)
+        {
+            fs_release_free_block(fs, inode->indirect);
+            inode->indirect      = 0;
+            map->indirect_dirty  = false;
+            map->indirect_loaded = false;
+        }
+    }
+
+    fs_release_free_run(fs, start, count);
+
+    // release double and triple indirect trees (the cached path goes stale)
+    if (inode->valid & INODE_INDIRECT3)
+    {
+        size_t first  = direct + POINTERS_PER_BLOCK;
+        size_t second = first + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+
+        fs_map_path_flush(map);
+        memset(map->path_block, 0, sizeof(map->path_block));
+
+        if (inode->double_indirect && from < second &&
+            fs_map_release_tree(map, inode->double_indirect, 2, from > first ? from - first : 0))
+            inode->double_indirect = 0;
+        if (inode->triple_indirect &&
+            fs_map_release_tree(map, inode->triple_indirect, 3, from > second ? from - second : 0))
+            inode->triple_indirect = 0;
+    }
+}
+
+
+/**
+ * Zero the bytes past size in the block that holds byte size, so they read
+ * back as zeros once the file grows over them again.
+ *
+ * @return      Whether or not the block could be updated.
+ **/
+static bool    fs_map_zero_tail(FileMap *map, size_t size)
+{
+    Block block;
+
+    if (!(size % BLOCK_SIZE))
+        return true;
+
+    // 空洞和unwritten块本来就读出0
+    uint32_t pointer = fs_map_get(map, size / BLOCK_SIZE, NULL);
+    if (!pointer || pointer & POINTER_UNWRITTEN)
+        return true;
+    if (fs_map_unshare(map, size, size + 1) <= size)
+        return false;
+    pointer = fs_map_get(map, size / BLOCK_SIZE, NULL);
+
+    if (disk_read(map->fs->disk, pointer, block.data) == DISK_FAILURE)
+        return false;
+    memset(block.data + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+    return disk_write(map->fs->disk, pointer, block.data) != DISK_FAILURE;
+}
+
+
+/**
+ * Give the file private copies of the shared blocks that the byte range
+ * [offset, end) touches, so writing them does not change its clones.
+ * Blocks the range covers completely are not copied; they come back
+ * unwritten because the write replaces them anyway.
+ *
+ * With FS_MOUNT_LOG every unshared written block the range covers
+ * completely also moves to a new block at the log head this way; partly
+ * written unshared blocks are moved by fs_map_write, which reads them
+ * anyway.  Shared blocks are always copied first.
+ *
+ * @return      End of the part of the range that may be written (short at
+ *              a hole or when the disk is full).
+ **/
+static size_t  fs_map_unshare(FileMap *map, size_t offset, size_t end)
+{
+    FileSystem *fs   = map->fs;
+    size_t      last = UPPER_ROUND(end, BLOCK_SIZE);
+    bool        log  = fs->options & FS_MOUNT_LOG;
+    Block       block;
+
+    if (end <= offset || (!log && !__atomic_load_n(&fs->block_shares, __ATOMIC_ACQUIRE)))
+        return end;
+
+    for (size_t idx = offset / BLOCK_SIZE; idx < last; ++idx)
+    {
+        uint32_t pointer = fs_map_get(map, idx, NULL);
+        if (!pointer)
+            return max(offset, idx * BLOCK_SIZE);
+
+        bool whole  = idx * BLOCK_SIZE >= offset && (idx + 1) * BLOCK_SIZE <= end;
+        bool shared = false;
+        if (__atomic_load_n(&fs->block_shares, __ATOMIC_ACQUIRE))
+        {
+            pthread_mutex_lock(&fs->alloc_lock);
+            shared = fs->block_shares[POINTER_BLOCK(pointer)] > 0;
+            pthread_mutex_unlock(&fs->alloc_lock);
+        }
+
+        // 共享的块一定要复制; 日志模式下没共享的整块只是搬到log头
+        if (!shared && !(log && whole && !(pointer & POINTER_UNWRITTEN)))
+            continue;
+
+        ssize_t copy = fs_allocate_free_block(fs, map->group);
+        if (copy < 0)
+            return max(offset, idx * BLOCK_SIZE);
+
+        // 只写一部分的块要先复制原来的内容
+        if (!whole && !(pointer & POINTER_UNWRITTEN))
+        {
+            if (disk_read(fs->disk, POINTER_BLOCK(pointer), block.data) == DISK_FAILURE ||
+                disk_write(fs->disk, copy, block.data) == DISK_FAILURE)
+            {
+                error("Fail to copy shared block %u\n", POINTER_BLOCK(pointer));
+                exit(1);
             }
+        }
+
+        fs_map_set(map, idx, copy | (whole || pointer & POINTER_UNWRITTEN ? POINTER_UNWRITTEN : 0), 1);
+        fs_release_free_block(fs, POINTER_BLOCK(pointer));
+    }
+    return end;
+}
+
+
+/**
+ * Map the first blocks blocks of a mapped file into another mapped file (in
+ * runs), counting one more reference for each data block they now share.
+ *
+ * Note: The caller writes back the target mapping.
+ *
+ * @return      Number of blocks mapped (blocks unless metadata ran out).
+ **/
+static size_t  fs_map_share(FileMap *from, FileMap *to, size_t blocks)
+{
+    FileSystem *fs  = from->fs;
+    size_t      idx = 0;
+
+    while (idx < blocks)
+    {
+        size_t   run     = blocks - idx;
+        uint32_t pointer = fs_map_get(from, idx, &run);
+        if (!run)
+            break;
+        if (pointer)
+        {
+            // 指针映射的文件逐块设置, 失败时知道已经共享了多少块
+            size_t count = 0;
+            if (to->inode->valid & INODE_EXTENTS)
+                count = fs_map_set(to, idx, pointer, run) ? run : 0;
+            else
+                while (count < run && fs_map_set(to, idx + count, pointer + count, 1))
+                    ++count;
+
+            pthread_mutex_lock(&fs->alloc_lock);
+            for (size_t b = POINTER_BLOCK(pointer); b < POINTER_BLOCK(pointer) + count; ++b)
+                ++fs->block_shares[b];
+            pthread_mutex_unlock(&fs->alloc_lock);
+            if (count < run)
+                break;
+        }
+        idx += run;
+    }
+    return idx;
+}
+
+
+/**
+ * Read the snapshot directory (all entries unused if there is none).
+ **/
+static bool    fs_snapshot_load(Disk *disk, const SuperBlock *sb, Block *directory)
+{
+    if (!(fs_features(sb) & FS_FEATURE_SNAPSHOTS) || !sb->snapshots)
+    {
+        memset(directory->data, 0, BLOCK_SIZE);
+        return true;
+    }
+    return disk_read(disk, sb->snapshots, directory->data) != DISK_FAILURE;
+}
+
+
+/**
+ * Find the directory entry of the named snapshot (of an unused entry if name
+ * is NULL).
+ *
+ * @return      Index of the entry (-1 if not found).
+ **/
+static ssize_t fs_snapshot_find(const Block *directory, const char *name)
+{
+    for (size_t k = 0; k < SNAPSHOTS_PER_BLOCK; ++k)
+    {
+        const Snapshot *snap = &directory->snapshots[k];
+        if (name ? snap->table && !strncmp(snap->name, name, SNAPSHOT_NAME_LENGTH) : !snap->table)
+            return k;
+    }
+    return -1;
+}
+
+
+/**
+ * Read the Inode table index of a snapshot into a new array (one disk block
+ * per Inode table block; the caller frees it).
+ **/
+static uint32_t *fs_snapshot_index(Disk *disk, const SuperBlock *sb, uint32_t table)
+{
+    size_t    nindex = UPPER_ROUND(sb->inode_blocks, POINTERS_PER_BLOCK);
+    uint32_t *index  = (uint32_t *)malloc(nindex * BLOCK_SIZE);
+
+    for (size_t i = 0; index && i < nindex; ++i)
+    {
+        if (disk_read(disk, table + i, (char *)index + i * BLOCK_SIZE) == DISK_FAILURE)
+        {
+            free(index);
+            return NULL;
+        }
+    }
+    return index;
+}
+
+
+/**
+ * Replace a block mapped Inode by a copy with its own mapping metadata that
+ * shares every data block (see fs_map_share), for a snapshot's Inode table.
+ *
+ * Note: On failure the Inode holds what was mapped so far, so dropping the
+ * snapshot returns every reference.
+ **/
+static bool    fs_snapshot_inode(FileSystem *fs, size_t inode_number, Inode *inode)
+{
+    Inode   copy;
+    FileMap from;
+    FileMap to;
+    size_t  group = fs_inode_group(&fs->meta_data, inode_number);
+
+    memset(&copy, 0, sizeof(Inode));
+    copy.valid = INODE_VALID | (inode->valid & (INODE_EXTENTS | INODE_INDIRECT3));
+    if (!fs_map_open(fs, &from, inode, group))
+    {
+        *inode = copy;
+        return false;
+    }
+    if (!fs_map_open(fs, &to, &copy, group))
+    {
+        fs_map_free(&from);
+        *inode = copy;
+        return false;
+    }
+
+    size_t blocks = UPPER_ROUND(fs_inode_size(inode), BLOCK_SIZE);
+    bool   ok     = fs_map_share(&from, &to, blocks) >= blocks;
+    fs_map_free(&from);
+    ok = fs_map_close(&to) && ok;
+
+    fs_inode_set_size(&copy, fs_inode_size(inode));
+    *inode = copy;
+    return ok;
+}
+
+
+/**
+ * Release everything a snapshot holds: the mappings of the Inodes in its
+ * Inode table copies (data blocks shared with other files only lose a
+ * reference), the copies themselves, its zero block and its index.
+ *
+ * Note: Index entries that are 0 (not copied yet) are skipped.
+ **/
+static void    fs_snapshot_drop(FileSystem *fs, uint32_t *index, uint32_t table, uint32_t zero)
+{
+    Block block;
 
-            i -= POINTERS_PER_INODE;
-            while (i < POINTERS_PER_BLOCK && indirect_block.pointers[i] && bytes_read < length)
+    for (size_t i = 0; i < fs->meta_data.inode_blocks; ++i)
+    {
+        if (!index[i] || index[i] == zero)
+            continue;
+        if (disk_read(fs->disk, index[i], block.data) == DISK_FAILURE)
+        {
+            error("Fail to read snapshot inode block %u\n", index[i]);
+            exit(1);
+        }
+
+        for (size_t j = 0; j < INODES_PER_BLOCK; ++j)
+        {
+            Inode  *pi = &block.inodes[j];
+            FileMap map;
+            if (!(pi->valid & INODE_VALID) || pi->valid & INODE_INLINE)
+                continue;
+            if (!fs_map_open(fs, &map, pi, fs_inode_group(&fs->meta_data, i * INODES_PER_BLOCK + j)))
             {
-                if (!disk_read(fs->disk, indirect_block.pointers[i], block.data))
-                {
-                    error("Fail to read block %d\n", indirect_block.pointers[i]);
-                    return -1;
-                }   
-
-                // 拷贝数据
-                size_t sz = min(BLOCK_SIZE, length - bytes_read);
-                memcpy(data + bytes_read, block.data + offset, sz);
-                bytes_read += sz;
-                ++i;
-                offset = 0;
+                error("Fail to load block map of snapshot inode %lu\n", i * INODES_PER_BLOCK + j);
+                continue;
             }
+            fs_map_release(&map, 0);
+            for (size_t k = 0; k < map.nnodes; ++k)
+                fs_release_free_block(fs, map.nodes[k]);
+            fs_map_free(&map);
         }
-        assert(bytes_read == length);
-        return bytes_read;
+        fs_release_free_block(fs, index[i]);
     }
 
-    return -1;
+    fs_release_free_block(fs, zero);
+    fs_release_free_run(fs, table, UPPER_ROUND(fs->meta_data.inode_blocks, POINTERS_PER_BLOCK));
 }
 
+
 /**
- * Write to the specified Inode from the data buffer exactly length bytes
- * beginning from the specified offset by doing the following:
+ * Copy length bytes of a mapped file to another mapped file by doing the
+ * following:
  *
- *  1. Load Inode information.
+ *  1. If the two offsets sit at different places inside a block, move the
+ *  data through a buffer of up to IOV_BATCH_BLOCKS blocks.
  *
- *  2. Continuously copy data from buffer to blocks.
+ *  2. Otherwise copy the partial blocks at either end through a block
+ *  buffer, and for the whole blocks in between allocate (or unshare) the
+ *  target blocks and copy each run of contiguous blocks with a single
+ *  disk_copy_blocks request.  Holes and unwritten blocks are not copied;
+ *  the target blocks are flagged unwritten instead.
  *
- *  Note: Data is write to direct blocks first, and then to indirect blocks.
+ * Note: The caller writes back the target mapping and Inode.
  *
- * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to write data to.
- * @param       data            Buffer with data to copy
- * @param       length          Number of bytes to write.
- * @param       offset          Byte offset from which to begin writing.
- * @return      Number of bytes write (-1 on error).
+ * @return      Number of bytes copied.
  **/
-ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
-    Inode inode;
+static size_t  fs_map_copy(FileMap *from, size_t src_offset, FileMap *to, size_t dst_offset, size_t length)
+{
+    FileSystem *fs   = to->fs;
+    size_t      done = 0;
+    Block       block;
 
-    if (fs_load_inode(fs, inode_number, &inode))
+    // 块内偏移不一样, 只能经过buffer
+    if ((src_offset - dst_offset) % BLOCK_SIZE)
     {
-        // 扩容文件
-        fs_expand_file(fs, &inode, offset + length);
+        size_t batch  = min(length, (size_t)IOV_BATCH_BLOCKS * BLOCK_SIZE);
+        char  *buffer = (char *)malloc(batch);
+        while (buffer && done < length)
+        {
+            size_t n = min(batch, length - done);
+            if (fs_map_read(from, buffer, n, src_offset + done) != (ssize_t)n ||
+                fs_map_write(to, buffer, n, dst_offset + done) != (ssize_t)n)
+                break;
+            done += n;
+        }
+        free(buffer);
+        return done;
+    }
 
-        // 数据块
-        Block block;
-        size_t bytes_write = 0;
+    while (done < length)
+    {
+        // 头尾不满一块的部分
+        size_t off = (dst_offset + done) % BLOCK_SIZE;
+        if (off || length - done < BLOCK_SIZE)
+        {
+            size_t n = min(BLOCK_SIZE - off, length - done);
+            if (fs_map_read(from, block.data, n, src_offset + done) != (ssize_t)n ||
+                fs_map_write(to, block.data, n, dst_offset + done) != (ssize_t)n)
+                break;
+            done += n;
+            continue;
+        }
+
+        // 中间的整块先分配好目标块, 再按段在磁盘上复制
+        size_t blocks = (length - done) / BLOCK_SIZE;
+        size_t start  = dst_offset + done;
+        fs_expand_file(fs, to, start, start + blocks * BLOCK_SIZE);
+        size_t ready  = (fs_map_unshare(to, start, start + blocks * BLOCK_SIZE) - start) / BLOCK_SIZE;
 
-        // 读取direct block
-        size_t i = offset / BLOCK_SIZE;
-        offset %= BLOCK_SIZE;
-        while (i < POINTERS_PER_INODE && inode.direct[i] && bytes_write < length)
+        size_t si = (src_offset + done) / BLOCK_SIZE;
+        size_t di = start / BLOCK_SIZE;
+        size_t k  = 0;
+        while (k < ready)
         {
-            if (!disk_read(fs->disk, inode.direct[i], block.data))
+            size_t   srun   = ready - k;
+            uint32_t source = fs_map_get(from, si + k, &srun);
+            size_t   drun   = srun;
+            uint32_t target = fs_map_get(to, di + k, &drun);
+            if (!srun || !target)
+                break;
+
+            if (!source || source & POINTER_UNWRITTEN)
+                fs_map_set(to, di + k, POINTER_BLOCK(target) | POINTER_UNWRITTEN, drun);
+            else
             {
-                error("Fail to read block %d\n", inode.direct[i]);
-                return -1;
+                if (disk_copy_blocks(fs->disk, POINTER_BLOCK(source), POINTER_BLOCK(target), drun) == DISK_FAILURE)
+                {
+                    error("Fail to copy blocks %u+%lu\n", POINTER_BLOCK(source), drun);
+                    exit(1);
+                }
+                if (target & POINTER_UNWRITTEN)
+                    fs_map_set(to, di + k, POINTER_BLOCK(target), drun);
             }
-            // 拷贝数据
-            size_t sz = min(BLOCK_SIZE - offset, length - bytes_write);
-            memcpy(block.data + offset, data + bytes_write, sz);
-            bytes_write += sz;
+            k += drun;
+        }
 
-             // write back
-            if (!disk_write(fs->disk, inode.direct[i], block.data))
-            {
+        done += k * BLOCK_SIZE;
+        if (k < blocks)
+            break;
+    }
+    return done;
+}
 
-            }
 
-            ++i;
-            offset = 0;
+/**
+ * Hash the contents of a block with four independent multiply-xor lanes
+ * over 64 bit words, so the loop pipelines (and vectorizes where the
+ * target has 64 bit vector multiplies).
+ **/
+static uint64_t fs_block_hash(const char *data)
+{
+    uint64_t lanes[4] = {0xcbf29ce484222325ull, 0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull};
+    uint64_t words[4];
+
+    for (size_t i = 0; i < BLOCK_SIZE; i += sizeof(words))
+    {
+        memcpy(words, data + i, sizeof(words));
+        for (size_t l = 0; l < 4; ++l)
+            lanes[l] = (lanes[l] ^ words[l]) * 0x100000001b3ull;
+    }
+
+    uint64_t hash = lanes[0] ^ (lanes[1] >> 7) ^ (lanes[2] << 11) ^ (lanes[3] >> 17);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    return hash ^ (hash >> 33);
+}
+
+
+/**
+ * Deduplicate the written blocks of one mapped file against the index of
+ * blocks seen so far (buffer holds IOV_BATCH_BLOCKS blocks).  A hash match
+ * only counts once the contents compare equal.
+ *
+ * Note: The caller writes back the mapping and the Inode.
+ *
+ * @return      Number of blocks remapped.
+ **/
+static size_t  fs_dedup_file(FileSystem *fs, FileMap *map, DedupEntry *index, size_t mask, char *buffer)
+{
+    size_t blocks   = UPPER_ROUND(fs_inode_size(map->inode), BLOCK_SIZE);
+    size_t remapped = 0;
+    Block  block;
+
+    for (size_t idx = 0; idx < blocks; )
+    {
+        size_t   run     = min(blocks - idx, (size_t)IOV_BATCH_BLOCKS);
+        uint32_t pointer = fs_map_get(map, idx, &run);
+        if (!run)
+            break;
+        if (!pointer || pointer & POINTER_UNWRITTEN)
+        {
+            idx += run;
+            continue;
         }
 
-        // 读取indirect block
-        if (bytes_write < length && inode.indirect)
+        if (disk_read_blocks(fs->disk, pointer, run, buffer) == DISK_FAILURE)
         {
-            // 读取indirect block
-            Block indirect_block;
+            error("Fail to read blocks %u+%lu\n", pointer, run);
+            break;
+        }
 
-            if (!disk_read(fs->disk, inode.indirect, indirect_block.data))
+        for (size_t k = 0; k < run; ++k)
+        {
+            char    *data   = buffer + k * BLOCK_SIZE;
+            uint32_t own    = pointer + k;
+            uint64_t hash   = fs_block_hash(data);
+            size_t   slot   = hash & mask;
+            uint32_t shared = 0;
+
+            // 线性探测, hash相同还要比较内容
+            for (; index[slot].block; slot = (slot + 1) & mask)
             {
-                error("Fail to read block %d\n", inode.indirect);
-                exit(1);
+                if (index[slot].hash != hash)
+                    continue;
+                if (index[slot].block == own)
+                    break;
+                if (disk_read(fs->disk, index[slot].block, block.data) != DISK_FAILURE &&
+                    !memcmp(block.data, data, BLOCK_SIZE))
+                {
+                    shared = index[slot].block;
+                    break;
+                }
             }
 
-            i -= POINTERS_PER_INODE; // 回退direct blocks个block
-            while (i < POINTERS_PER_BLOCK && indirect_block.pointers[i] && bytes_write < length)
+            if (!shared)
             {
-                if (!disk_read(fs->disk, indirect_block.pointers[i], block.data))
+                if (!index[slot].block)
                 {
-                    error("Fail to read block %d\n", indirect_block.pointers[i]);
-                    exit(1);
-                }   
+                    index[slot].hash  = hash;
+                    index[slot].block = own;
+                }
+                continue;
+            }
 
-                // 拷贝数据
-                size_t sz = min(BLOCK_SIZE - offset, length - bytes_write);
-                memcpy(block.data + offset, data + bytes_write, sz);
-                bytes_write += sz;
+            pthread_mutex_lock(&fs->alloc_lock);
+            ++fs->block_shares[shared];
+            pthread_mutex_unlock(&fs->alloc_lock);
+            fs_map_set(map, idx + k, shared, 1);
+            fs_release_free_block(fs, own);
+            ++remapped;
+        }
+        idx += run;
+    }
+    return remapped;
+}
 
-                 // write back
-                if (!disk_write(fs->disk, indirect_block.pointers[i], block.data))
-                {
-                    error("Fail to write back block %d\n", indirect_block.pointers[i]);
-                    exit(1);
-                }
 
-                offset = 0;
-                ++i;
-            }
+/**
+ * Whether or not fs_clean should move a data block: it lies in a segment
+ * being cleaned and no other file shares it.
+ **/
+static bool    fs_clean_movable(FileSystem *fs, const bool *victims, size_t block_number)
+{
+    if (block_number < fs_group_data_start(&fs->meta_data, 0) ||
+        !victims[fs_log_segment(&fs->meta_data, block_number)])
+        return false;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    bool shared = fs->block_shares && fs->block_shares[block_number];
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return !shared;
+}
+
+
+/**
+ * Move the written data blocks of one mapped file out of the segments
+ * being cleaned to the log head, a run of up to IOV_BATCH_BLOCKS blocks
+ * (buffer) at a time.
+ *
+ * Note: The caller writes back the mapping and the Inode.
+ *
+ * @return      Number of blocks moved.
+ **/
+static size_t  fs_clean_file(FileSystem *fs, FileMap *map, const bool *victims, char *buffer)
+{
+    size_t blocks = UPPER_ROUND(fs_inode_size(map->inode), BLOCK_SIZE);
+    size_t moved  = 0;
+
+    for (size_t idx = 0; idx < blocks; )
+    {
+        size_t   run     = min(blocks - idx, (size_t)IOV_BATCH_BLOCKS);
+        uint32_t pointer = fs_map_get(map, idx, &run);
+        if (!run)
+            break;
+
+        // 只搬开头连续的一段, 不用搬的块逐块跳过
+        bool   written = pointer && !(pointer & POINTER_UNWRITTEN);
+        size_t count   = 0;
+        while (written && count < run && fs_clean_movable(fs, victims, pointer + count))
+            ++count;
+        if (!count)
+        {
+            idx += written ? 1 : run;
+            continue;
         }
 
-        // write back inode
-        fs_save_inode(fs, inode_number, &inode);
+        size_t start;
+        size_t got = fs_allocate_free_run(fs, map->group, count, &start);
+        if (!got)
+            break;
+        if (disk_read_blocks(fs->disk, pointer, got, buffer) == DISK_FAILURE ||
+            disk_write_blocks(fs->disk, start, got, buffer) == DISK_FAILURE)
+        {
+            error("Fail to move blocks %u+%lu\n", pointer, got);
+            exit(1);
+        }
 
-        return bytes_write;
+        fs_map_set(map, idx, start, got);
+        fs_release_free_run(fs, pointer, got);
+        moved += got;
+        idx   += got;
     }
+    return moved;
+}
 
-    return -1;
+
+/**
+ * Release the memory held by a FileMap without writing anything back.
+ **/
+static void    fs_map_free(FileMap *map)
+{
+    free(map->extents);
+    free(map->nodes);
+    free(map->path);
+    map->extents = NULL;
+    map->nodes   = NULL;
+    map->path    = NULL;
 }
 
-/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
 
-/* Internal Functions */
-static bool    fs_load_inode(FileSystem *fs, size_t inode_number, Inode *node)
+static size_t  fs_extent_end(const Extent *e)
 {
-    // inode block number
-    size_t inode_block_number = 1 + inode_number / INODES_PER_BLOCK;
-    Block block;
+    return e->logical + EXTENT_LENGTH(e->length);
+}
+
 
-    if (!disk_read(fs->disk, inode_block_number, block.inodes))
+/**
+ * Return the number of extents that start at or before file block index.
+ **/
+static size_t  fs_extent_search(FileMap *map, size_t index)
+{
+    size_t lo = 0, hi = map->nextents;
+    while (lo < hi)
     {
-        debug("Fail to read inode %d\n", inode_number);
-        return false;
+        size_t mid = (lo + hi) / 2;
+        if (map->extents[mid].logical <= index)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return lo;
+}
 
-    inode_number %= INODES_PER_BLOCK;
 
-    memcpy(node, &block.inodes[inode_number], sizeof(Inode));
+static bool    fs_extent_insert(FileMap *map, size_t position, Extent extent)
+{
+    if (map->nextents == map->capacity)
+    {
+        size_t  capacity = map->capacity ? 2 * map->capacity : 8;
+        Extent *extents  = (Extent *)realloc(map->extents, capacity * sizeof(Extent));
+        if (!extents)
+            return false;
+        map->extents  = extents;
+        map->capacity = capacity;
+    }
 
-    return node->valid;
+    memmove(map->extents + position + 1, map->extents + position, (map->nextents - position) * sizeof(Extent));
+    map->extents[position] = extent;
+    ++map->nextents;
+    return true;
 }
 
 
-static bool    fs_save_inode(FileSystem *fs, size_t inode_number, Inode *node)
+static void    fs_extent_remove(FileMap *map, size_t from, size_t to)
 {
-    // inode block number
-    size_t inode_block_number = 1 + inode_number / INODES_PER_BLOCK;
-    Block block;
+    if (from == to)
+        return;
+    memmove(map->extents + from, map->extents + to, (map->nextents - to) * sizeof(Extent));
+    map->nextents -= to - from;
+}
+
+
+/**
+ * Merge the extent at position with the one after it if they are
+ * contiguous both in the file and on disk.
+ **/
+static void    fs_extent_merge(FileMap *map, size_t position)
+{
+    if (position + 1 >= map->nextents)
+        return;
 
-    if (!disk_read(fs->disk, inode_block_number, block.inodes))
+    Extent *a = &map->extents[position];
+    Extent *b = &map->extents[position + 1];
+    size_t  n = EXTENT_LENGTH(a->length);
+    if (a->logical + n == b->logical && a->start + n == b->start &&
+        (a->length & EXTENT_UNWRITTEN) == (b->length & EXTENT_UNWRITTEN))
     {
-        debug("Fail to read inode %d\n", inode_number);
-        return false;
+        a->length += EXTENT_LENGTH(b->length);
+        fs_extent_remove(map, position + 1, position + 2);
     }
+}
 
-    inode_number %= INODES_PER_BLOCK;
 
-    memcpy(&block.inodes[inode_number], node, sizeof(Inode));
+/**
+ * Extent version of fs_map_set: cut [index, index + count) out of the
+ * extents it overlaps, then insert the new extent and merge it with its
+ * neighbours.
+ **/
+static bool    fs_extent_set(FileMap *map, size_t index, uint32_t pointer, size_t count)
+{
+    size_t end = index + count;
+    size_t i   = fs_extent_search(map, index);
+    if (i && fs_extent_end(&map->extents[i - 1]) > index)
+        --i;
 
-    if (!disk_write(fs->disk, inode_block_number, block.data))
+    // 起点落在extent中间: 保留前半部分 (范围在中间时还要拆出后半部分)
+    if (i < map->nextents && map->extents[i].logical < index)
     {
-        debug("Fail to write inode %d back\n", inode_number);
-        return false;
+        Extent *e = &map->extents[i];
+        if (fs_extent_end(e) > end)
+        {
+            size_t shift = end - e->logical;
+            Extent tail  = {end, e->start + shift, e->length - shift};
+            if (!fs_extent_insert(map, i + 1, tail))
+                return false;
+            e = &map->extents[i];
+        }
+        e->length = (e->length & EXTENT_UNWRITTEN) | (index - e->logical);
+        ++i;
+    }
+
+    // 删除范围内的extent, 截掉跨过终点的extent的前半部分
+    size_t j = i;
+    while (j < map->nextents && map->extents[j].logical < end)
+    {
+        Extent *e = &map->extents[j];
+        if (fs_extent_end(e) <= end)
+        {
+            ++j;
+            continue;
+        }
+        size_t shift = end - e->logical;
+        e->logical  = end;
+        e->start   += shift;
+        e->length  -= shift;
+        break;
+    }
+    fs_extent_remove(map, i, j);
+    map->dirty_from = min(map->dirty_from, i ? i - 1 : 0);
+
+    if (pointer)
+    {
+        Extent extent = {index, POINTER_BLOCK(pointer), count | (pointer & POINTER_UNWRITTEN ? EXTENT_UNWRITTEN : 0)};
+        if (!fs_extent_insert(map, i, extent))
+            return false;
+        fs_extent_merge(map, i);
+        if (i)
+            fs_extent_merge(map, i - 1);
     }
-    
     return true;
 }
 
 
-static void    fs_initialize_free_block_bitmap(FileSystem *fs)
+static bool    fs_append_block(uint32_t **array, size_t *count, uint32_t block_number)
 {
-    fs->free_blocks = (bool *)malloc(fs->disk->blocks * sizeof(bool));
+    // 容量为2的幂次, 满了就翻倍
+    if (!(*count & (*count - 1)))
+    {
+        uint32_t *grown = (uint32_t *)realloc(*array, max(1, 2 * *count) * sizeof(uint32_t));
+        if (!grown)
+            return false;
+        *array = grown;
+    }
+    (*array)[(*count)++] = block_number;
+    return true;
+}
 
-    size_t i;
-    // super block and inode blocks are not free
-    for (i = 0; i <= fs->meta_data.inode_blocks; ++i)
-        fs->free_blocks[i] = false;
-    // remain blocks are free
-    while (i < fs->meta_data.blocks)
-        fs->free_blocks[i++] = true;
 
-    // 找到磁盘中已经使用的块 set false
-    // 访问每一个inode块
+/**
+ * Append the extents below an extent tree node to the FileMap, recording
+ * leaves in map->nodes and index blocks in the given array.
+ **/
+static bool    fs_extent_load_node(Disk *disk, FileMap *map, uint32_t block_number, uint32_t depth,
+                                   uint32_t **indexes, size_t *nindexes)
+{
     Block block;
-    for (size_t i = 0; i < fs->meta_data.inode_blocks; ++i)
+    bool loaded = map->fs ? fs_meta_read(map->fs, block_number, block.data)
+                          : disk_read(disk, block_number, block.data) != DISK_FAILURE;
+    if (!loaded || block.node.depth != depth)
     {
-        // 读入inode 块
-        if (disk_read(fs->disk, i + 1, block.data) == DISK_FAILURE)
-        {
-            debug("Fail to read inode block\n");
-            exit(1);
-        }
-        
-        // 访问每一个inode
-        for (size_t j = 0; j < INODES_PER_BLOCK; ++j)
-        {
-            Inode *pi = &block.inodes[j];
-            if (pi->valid)
-            {
-                for (size_t k = 0; k < POINTERS_PER_INODE && pi->direct[k]; ++k)
-                    fs->free_blocks[pi->direct[k]] = false;
-                if (pi->indirect)
-                {
-                    fs->free_blocks[pi->indirect] = false;
+        error("Fail to read extent tree block %u\n", block_number);
+        return false;
+    }
 
-                    Block indirect_block;
-                    // 读入indirect block
-                    if (disk_read(fs->disk, pi->indirect, indirect_block.pointers) == DISK_FAILURE)
-                    {
-                        debug("Fail to read indirect block of inode %d\n", i);
-                        exit(1);
-                    }
-                    for (size_t k = 0; k < POINTERS_PER_BLOCK && indirect_block.pointers[k]; ++k)
-                        fs->free_blocks[indirect_block.pointers[k]] = false;
-                }
-            }
-        }
+    if (!depth)
+    {
+        if (!fs_append_block(&map->nodes, &map->nnodes, block_number))
+            return false;
+        for (size_t i = 0; i < block.node.entries && i < EXTENTS_PER_BLOCK; ++i)
+            if (!fs_extent_insert(map, map->nextents, block.node.extents[i]))
+                return false;
+        return true;
     }
+
+    if (!fs_append_block(indexes, nindexes, block_number))
+        return false;
+    for (size_t i = 0; i < block.node.entries && i < INDEXES_PER_BLOCK; ++i)
+        if (!fs_extent_load_node(disk, map, block.node.index[i].block, depth - 1, indexes, nindexes))
+            return false;
+    return true;
 }
 
 
-static ssize_t fs_allocate_free_block(FileSystem *fs)
+/**
+ * Load all extents of map->inode into memory, together with the list of
+ * extent tree blocks (leaves in file order first, then index blocks).
+ **/
+static bool    fs_extent_load(Disk *disk, FileMap *map)
 {
-    size_t i = 1 + fs->meta_data.inode_blocks;
-    while (i < fs->disk->blocks && !fs->free_blocks[i])
-        ++i;
-    if (i < fs->disk->blocks)
+    Inode   *inode    = map->inode;
+    uint32_t depth    = INODE_DEPTH(inode->valid);
+    uint32_t *indexes = NULL;
+    size_t   nindexes = 0;
+    bool     ok       = true;
+
+    if (!depth)
     {
-        fs->free_blocks[i] = false;
-        return i;
+        for (size_t i = 0; i < EXTENTS_PER_INODE && ok; ++i)
+            if (EXTENT_LENGTH(inode->extents[i].length))
+                ok = fs_extent_insert(map, map->nextents, inode->extents[i]);
     }
     else
-        return -1;
+    {
+        for (size_t i = 0; i < INDEXES_PER_INODE && inode->index[i].block && ok; ++i)
+            ok = fs_extent_load_node(disk, map, inode->index[i].block, depth - 1, &indexes, &nindexes);
+    }
+
+    for (size_t i = 0; i < nindexes && ok; ++i)
+        ok = fs_append_block(&map->nodes, &map->nnodes, indexes[i]);
+    free(indexes);
+
+    if (!ok)
+        fs_map_free(map);
+    return ok;
 }
 
 
-static void fs_release_free_block(FileSystem *fs, size_t block_number)
+/**
+ * Take a block for an extent tree node: reuse one of the old tree blocks if
+ * any is left, otherwise allocate a new one.
+ **/
+static ssize_t fs_extent_node_block(FileMap *map, size_t *used, bool *fresh)
 {
-    assert(!fs->free_blocks[block_number]);
-    fs->free_blocks[block_number] = true;
+    *fresh = *used >= map->nnodes;
+    if (!*fresh)
+        return map->nodes[(*used)++];
+    return fs_allocate_free_block(map->fs, map->group);
 }
 
-static void fs_expand_file(FileSystem * fs, Inode * node, size_t new_size)
+
+/**
+ * Write the extent list back by doing the following:
+ *
+ *  1. Store up to EXTENTS_PER_INODE extents in the Inode itself.
+ *
+ *  2. Otherwise pack the extents into leaf blocks (only leaves holding a
+ *  changed extent are written) and build index levels above them until at
+ *  most INDEXES_PER_INODE roots are left for the Inode.
+ *
+ *  3. Release the old tree blocks that are no longer used.
+ **/
+static bool    fs_extent_store(FileMap *map)
 {
-    size_t old_blocks = UPPER_ROUND(node->size, BLOCK_SIZE);
-    size_t new_blocks = UPPER_ROUND(new_size, BLOCK_SIZE);
+    Inode       *inode  = map->inode;
+    size_t       n      = map->nextents;
+    size_t       used   = 0;
+    uint32_t    *nodes  = NULL;
+    size_t       nnodes = 0;
+    uint32_t     depth  = 0;
+    bool         ok     = true;
+    Inode        saved  = *inode;
+    Block        block;
 
-    if (old_blocks < new_blocks)
+    memset(inode->extents, 0, sizeof(inode->extents));
+    if (n <= EXTENTS_PER_INODE)
     {
-        size_t dif = new_blocks - old_blocks;
-        ssize_t free_block_idx;
-
-        // inode中的最后一个data block index的下一个位置
-        size_t idx = UPPER_ROUND(node->size, BLOCK_SIZE);
-        
-        while (idx < POINTERS_PER_INODE && dif && (free_block_idx = fs_allocate_free_block(fs)) != -1)
-        {
-            node->direct[idx++] = free_block_idx;
-            --dif;
-        }
+        // 没有extent时map->extents是NULL
+        if (n)
+            memcpy(inode->extents, map->extents, n * sizeof(Extent));
+    }
+    else
+    {
+        size_t       count = UPPER_ROUND(n, EXTENTS_PER_BLOCK);
+        ExtentIndex *level = (ExtentIndex *)malloc(count * sizeof(ExtentIndex));
+        ok = level != NULL;
 
-        if (idx >= POINTERS_PER_INODE)
+        // 叶子节点
+        for (size_t i = 0; i < count && ok; ++i)
         {
-            idx -= POINTERS_PER_INODE;
-            // read indirect block
-            Block indirect_block;
+            bool    fresh;
+            ssize_t b     = fs_extent_node_block(map, &used, &fresh);
+            size_t  first = i * EXTENTS_PER_BLOCK;
+            if (b < 0 || !(ok = fs_append_block(&nodes, &nnodes, b)))
+            {
+                ok = false;
+                break;
+            }
 
-            // 如果没有indirect block则分配
-            bool pre_indirect = node->indirect;
-            if (!node->indirect)
+            level[i].logical = map->extents[first].logical;
+            level[i].block   = b;
+            if (fresh || first + EXTENTS_PER_BLOCK > map->dirty_from)
             {
-                if (((free_block_idx = fs_allocate_free_block(fs)) != -1))
-                    node->indirect = free_block_idx;
+                memset(block.data, 0, BLOCK_SIZE);
+                block.node.entries = min(EXTENTS_PER_BLOCK, n - first);
+                memcpy(block.node.extents, map->extents + first, block.node.entries * sizeof(Extent));
+                ok = fs_meta_write(map->fs, b, block.data);
             }
+        }
 
-            if (node->indirect)
+        // index节点, 直到inode放得下
+        while (ok && count > INDEXES_PER_INODE)
+        {
+            size_t parents = UPPER_ROUND(count, INDEXES_PER_BLOCK);
+            ++depth;
+            for (size_t i = 0; i < parents && ok; ++i)
             {
-                // clear indirect block
-                if (!disk_read(fs->disk, node->indirect, indirect_block.data))
+                bool    fresh;
+                ssize_t b     = fs_extent_node_block(map, &used, &fresh);
+                size_t  first = i * INDEXES_PER_BLOCK;
+                if (b < 0 || !(ok = fs_append_block(&nodes, &nnodes, b)))
                 {
-                    error("Fail to read indirect block %d\n", node->indirect);
-                    exit(1);
+                    ok = false;
+                    break;
                 }
 
-                if (!pre_indirect) // 新的间接块，需要先clear
-                    memset(indirect_block.pointers, 0, sizeof(indirect_block));
-
-                while (idx < POINTERS_PER_BLOCK && dif && (free_block_idx = fs_allocate_free_block(fs)) != -1)
-                {
-                    indirect_block.pointers[idx++] = free_block_idx;
-                    --dif;
-                }
+                memset(block.data, 0, BLOCK_SIZE);
+                block.node.depth   = depth;
+                block.node.entries = min(INDEXES_PER_BLOCK, count - first);
+                memcpy(block.node.index, level + first, block.node.entries * sizeof(ExtentIndex));
+                ok = fs_meta_write(map->fs, b, block.data);
 
-                if (!idx && !pre_indirect) // 分配完indirect block后没有空闲块了，需要返回这个空的indirect block
-                {
-                    fs_release_free_block(fs, node->indirect);
-                    node->indirect = 0;
-                }
-                else
-                {
-                    // write back indirect block
-                    if (!disk_write(fs->disk, node->indirect, indirect_block.data))
-                    {
-                        error("Fail to write back indirect block %d\n", node->indirect);
-                        exit(1);
-                    }
-                }
+                level[i].logical = level[first].logical;
+                level[i].block   = b;
             }
+            count = parents;
         }
-        
-        node->size = dif ? (new_blocks - dif) * BLOCK_SIZE : new_size;
+
+        if (ok)
+        {
+            ++depth;
+            memcpy(inode->index, level, count * sizeof(ExtentIndex));
+        }
+        free(level);
     }
-    else
-        node->size = max(node->size, new_size);
-}
\ No newline at end of file
+
+    if (!ok)
+    {
+        error("Fail to write extent tree (%lu extents)\n", n);
+        *inode = saved;
+        free(nodes);
+        return false;
+    }
+
+    inode->valid = (inode->valid & ~(0xff << INODE_DEPTH_SHIFT)) | depth << INODE_DEPTH_SHIFT;
+
+    for (size_t i = used; i < map->nnodes; ++i)
+        fs_release_free_block(map->fs, map->nodes[i]);
+    free(map->nodes);
+    map->nodes      = nodes;
+    map->nnodes     = nnodes;
+    map->dirty_from = SIZE_MAX;
+    return true;
+}
@@ -19,6 +19,13 @@ void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_create(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_remove(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_clone(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_copy(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_dedup(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_clean(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_snapshot(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_rmsnap(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_sync(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_copyout(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_cat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
@@ -30,6 +37,32 @@ void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 bool copyout(FileSystem *fs, size_t inode_number, const char *path);
 bool copyin(FileSystem *fs, const char *path, size_t inode_number);
 
+/* Format Features and Mount Options */
+
+typedef struct {
+    const char *name;
+    uint32_t    flag;
+} Flag;
+
+Flag FEATURES[] = {
+    {"groups",  FS_FEATURE_GROUPS},
+    {"extents", FS_FEATURE_EXTENTS},
+    {"inline",  FS_FEATURE_INLINE_DATA},
+    {"reflink", FS_FEATURE_REFLINK},
+    {"journal", FS_FEATURE_JOURNAL},
+    {NULL,      0},
+};
+
+Flag MOUNT_OPTIONS[] = {
+    {"delalloc",  FS_MOUNT_DELALLOC},
+    {"readonly",  FS_MOUNT_READONLY},
+    {"log",       FS_MOUNT_LOG},
+    {"writeback", FS_MOUNT_WRITEBACK},
+    {NULL,        0},
+};
+
+bool parse_flags(const Flag *table, const char *list, uint32_t *flags);
+
 /* Main Execution */
 
 int main(int argc, char *argv[]) {
@@ -69,6 +102,20 @@ int main(int argc, char *argv[]) {
 	    do_create(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "remove")) {
 	    do_remove(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "clone")) {
+	    do_clone(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "copy")) {
+	    do_copy(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "dedup")) {
+	    do_dedup(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "clean")) {
+	    do_clean(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "snapshot")) {
+	    do_snapshot(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "rmsnap")) {
+	    do_rmsnap(disk, &fs, args, arg1, arg2);
+        } else if (streq(cmd, "sync")) {
+	    do_sync(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "stat")) {
 	    do_stat(disk, &fs, args, arg1, arg2);
         } else if (streq(cmd, "copyout")) {
@@ -101,16 +148,20 @@ void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 	printf("Usage: debug\n");
 	return;
     }
+    if (fs->disk) {
+        fs_sync(fs);
+    }
     fs_debug(disk);
 }
 
 void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-	printf("Usage: format\n");
+    uint32_t features = 0;
+    if (args > 2 || (args == 2 && !parse_flags(FEATURES, arg1, &features))) {
+	printf("Usage: format [feature,...]\n");
 	return;
     }
 
-    if (fs_format(fs, disk)) {
+    if (fs_format_features(fs, disk, features)) {
         printf("disk formatted.\n");
     } else {
         printf("format failed!\n");
@@ -118,12 +169,22 @@ void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 }
 
 void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-	printf("Usage: mount\n");
+    uint32_t options = 0;
+    if (args == 3 && streq(arg1, "snapshot")) {
+        if (fs_mount_snapshot(fs, disk, arg2)) {
+            printf("snapshot %s mounted.\n", arg2);
+        } else {
+            printf("mount failed!\n");
+        }
+        return;
+    }
+    if (args > 2 || (args == 2 && !parse_flags(MOUNT_OPTIONS, arg1, &options))) {
+	printf("Usage: mount [option,...]\n");
+	printf("       mount snapshot <name>\n");
 	return;
     }
 
-    if (fs_mount(fs, disk)) {
+    if (fs_mount_options(fs, disk, options)) {
         printf("disk mounted.\n");
     } else {
         printf("mount failed!\n");
@@ -158,6 +219,101 @@ void do_remove(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_clone(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: clone <inode>\n");
+        return;
+    }
+
+    ssize_t inode_number = fs_clone(fs, atoi(arg1));
+    if (inode_number >= 0) {
+        printf("cloned inode %s to inode %ld.\n", arg1, inode_number);
+    } else {
+        printf("clone failed!\n");
+    }
+}
+
+void do_copy(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+        printf("Usage: copy <inode> <inode>\n");
+        return;
+    }
+
+    ssize_t bytes = fs_copy_range(fs, atoi(arg1), 0, atoi(arg2), 0, SIZE_MAX);
+    if (bytes >= 0) {
+        printf("%ld bytes copied\n", bytes);
+    } else {
+        printf("copy failed!\n");
+    }
+}
+
+void do_dedup(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+        printf("Usage: dedup\n");
+        return;
+    }
+
+    ssize_t blocks = fs_dedup(fs);
+    if (blocks >= 0) {
+        printf("%ld blocks deduplicated.\n", blocks);
+    } else {
+        printf("dedup failed!\n");
+    }
+}
+
+void do_clean(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+        printf("Usage: clean\n");
+        return;
+    }
+
+    ssize_t blocks = fs_clean(fs);
+    if (blocks >= 0) {
+        printf("%ld blocks moved.\n", blocks);
+    } else {
+        printf("clean failed!\n");
+    }
+}
+
+void do_snapshot(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: snapshot <name>\n");
+        return;
+    }
+
+    if (fs_snapshot(fs, arg1)) {
+        printf("snapshot %s created.\n", arg1);
+    } else {
+        printf("snapshot failed!\n");
+    }
+}
+
+void do_rmsnap(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: rmsnap <name>\n");
+        return;
+    }
+
+    if (fs_delete_snapshot(fs, arg1)) {
+        printf("snapshot %s deleted.\n", arg1);
+    } else {
+        printf("rmsnap failed!\n");
+    }
+}
+
+void do_sync(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args > 2) {
+        printf("Usage: sync [inode]\n");
+        return;
+    }
+
+    if (args == 1 ? fs_sync(fs) : fs_fsync(fs, atoi(arg1), false)) {
+        printf("disk synced.\n");
+    } else {
+        printf("sync failed!\n");
+    }
+}
+
 void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
         printf("Usage: stat <inode>\n");
@@ -208,11 +364,19 @@ void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 
 void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
-    printf("    format\n");
-    printf("    mount\n");
+    printf("    format  [feature,...]\n");
+    printf("    mount   [option,...]\n");
+    printf("    mount   snapshot <name>\n");
     printf("    debug\n");
     printf("    create\n");
     printf("    remove  <inode>\n");
+    printf("    clone   <inode>\n");
+    printf("    copy    <inode> <inode>\n");
+    printf("    dedup\n");
+    printf("    clean\n");
+    printf("    snapshot <name>\n");
+    printf("    rmsnap  <name>\n");
+    printf("    sync    [inode]\n");
     printf("    cat     <inode>\n");
     printf("    stat    <inode>\n");
     printf("    copyin  <file> <inode>\n");
@@ -231,29 +395,54 @@ bool copyin(FileSystem *fs, const char *path, size_t inode_number) {
         return false;
     }
 
+    File *file = fs_open(fs, inode_number);
+    if (!file) {
+        fprintf(stderr, "Unable to open inode %lu\n", inode_number);
+    }
+
     char buffer[4*BUFSIZ] = {0};
     size_t offset = 0;
-    while (true) {
+    while (file) {
         ssize_t result = fread(buffer, 1, sizeof(buffer), stream);
         if (result <= 0) {
             break;
         }
-        ssize_t actual = fs_write(fs, inode_number, buffer, result, offset);
+        ssize_t actual = fs_pwrite(file, buffer, result, offset);
         if (actual < 0) {
-            fprintf(stderr, "fs_write returned invalid result %ld\n", actual);
+            fprintf(stderr, "fs_pwrite returned invalid result %ld\n", actual);
             break;
         }
         offset += actual;
         if (actual != result) {
-            fprintf(stderr, "fs_write only wrote %ld bytes, not %ld bytes\n", actual, result);
+            fprintf(stderr, "fs_pwrite only wrote %ld bytes, not %ld bytes\n", actual, result);
             break;
         }
     }
     printf("%lu bytes copied\n", offset);
+    fs_close(file);
     fclose(stream);
     return true;
 }
 
+bool parse_flags(const Flag *table, const char *list, uint32_t *flags) {
+    char buffer[BUFSIZ];
+    strncpy(buffer, list, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = 0;
+
+    for (char *name = strtok(buffer, ","); name; name = strtok(NULL, ",")) {
+        size_t i = 0;
+        while (table[i].name && !streq(table[i].name, name)) {
+            i++;
+        }
+        if (!table[i].name) {
+            fprintf(stderr, "Unknown option: %s\n", name);
+            return false;
+        }
+        *flags |= table[i].flag;
+    }
+    return true;
+}
+
 bool copyout(FileSystem *fs, size_t inode_number, const char *path) {
     FILE *stream = fopen(path, "w");
     if (!stream) {
@@ -261,17 +450,25 @@ bool copyout(FileSystem *fs, size_t inode_number, const char *path) {
         return false;
     }
 
-    char buffer[4*BUFSIZ] = {0};
+    File *file = fs_open(fs, inode_number);
+
     size_t offset = 0;
-    while (true) {
-        ssize_t result = fs_read(fs, inode_number, buffer, sizeof(buffer), offset);
+    while (file) {
+        FileView view;
+        ssize_t result = fs_read_view(file, 16*BUFSIZ, offset, &view);
         if (result <= 0) {
             break;
         }
-        fwrite(buffer, 1, result, stream);
+        ssize_t actual = writev(fileno(stream), view.iov, view.iovcnt);
+        fs_release_view(&view);
+        if (actual != result) {
+            fprintf(stderr, "writev only wrote %ld bytes, not %ld bytes\n", actual, result);
+            break;
+        }
         offset += result;
     }
     printf("%lu bytes copied\n", offset);
+    fs_close(file);
     fclose(stream);
     return true;
 }
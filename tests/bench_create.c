@@ -0,0 +1,86 @@
+/* bench_create.c: Benchmark fs_create on a mostly full inode table */
+
+#include "sfs/fs.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define BENCH_PATH      "data/image.bench"
+#define BENCH_BLOCKS    (10000)
+#define BENCH_FULL      (0.90)
+
+/* Functions */
+
+double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_cleanup() {
+    unlink(BENCH_PATH);
+}
+
+int main(int argc, char *argv[]) {
+    size_t blocks = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_BLOCKS;
+
+    int fd = open(BENCH_PATH, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    assert(fd >= 0);
+    close(fd);
+    assert(atexit(bench_cleanup) == EXIT_SUCCESS);
+
+    Disk *disk = disk_open(BENCH_PATH, blocks);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    /* Fill the table, then punch a random 10% back out */
+    size_t inodes = fs.meta_data.inodes;
+    for (size_t i = 0; i < inodes; i++) {
+        assert(fs_create(&fs) == (ssize_t)i);
+    }
+
+    srand(30341);
+    size_t holes = 0;
+    for (size_t i = 0; i < inodes; i++) {
+        if (rand() < (1.0 - BENCH_FULL) * RAND_MAX) {
+            assert(fs_remove(&fs, i));
+            holes++;
+        }
+    }
+
+    /* Remount so the free inode hint starts from scratch */
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    size_t reads  = disk->reads;
+    size_t writes = disk->writes;
+    double start  = timestamp();
+    size_t created = 0;
+    while (fs_create(&fs) >= 0) {
+        created++;
+    }
+    double elapsed = timestamp() - start;
+    assert(created == holes);
+
+    printf("inodes:         %lu (%.0f%% full)\n", inodes, 100.0 * (inodes - holes) / inodes);
+    printf("creates:        %lu in %.6f seconds\n", created, elapsed);
+    printf("creates/second: %.0f\n", created / elapsed);
+    printf("reads/create:   %.2f\n", (double)(disk->reads - reads) / created);
+    printf("writes/create:  %.2f\n", (double)(disk->writes - writes) / created);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,110 @@
+/* bench_readers.c: Benchmark read throughput with concurrent readers */
+
+#include "sfs/fs.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define BENCH_PATH      "data/image.bench"
+#define BENCH_BLOCKS    (20000)
+#define BENCH_FILE_SIZE (64*BLOCK_SIZE)         /* Bytes per file (one per reader) */
+#define BENCH_CHUNK     (4*BUFSIZ)              /* Bytes per fs_read (as copyout) */
+#define BENCH_READS     (1<<16)                 /* fs_read calls shared by all readers */
+#define BENCH_MAX       (32)                    /* Maximum number of readers */
+
+/* Structures */
+
+typedef struct {
+    FileSystem *fs;
+    size_t      inode_number;                   /* File read by this reader */
+    size_t      reads;                          /* Number of fs_read calls to make */
+} Reader;
+
+/* Functions */
+
+double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_cleanup() {
+    unlink(BENCH_PATH);
+}
+
+void *reader(void *arg) {
+    Reader *r = (Reader *)arg;
+    char buffer[BENCH_CHUNK];
+
+    for (size_t i = 0, offset = 0; i < r->reads; i++) {
+        ssize_t result = fs_read(r->fs, r->inode_number, buffer, sizeof(buffer), offset);
+        assert(result == sizeof(buffer) && buffer[0] == (char)('a' + r->inode_number % 26));
+        offset = (offset + sizeof(buffer)) % BENCH_FILE_SIZE;
+    }
+    return NULL;
+}
+
+void bench(FileSystem *fs, size_t readers) {
+    Reader    args[BENCH_MAX];
+    pthread_t threads[BENCH_MAX];
+
+    double start = timestamp();
+    for (size_t i = 0; i < readers; i++) {
+        args[i].fs           = fs;
+        args[i].inode_number = i;
+        args[i].reads        = BENCH_READS / readers;
+        assert(pthread_create(&threads[i], NULL, reader, &args[i]) == 0);
+    }
+    for (size_t i = 0; i < readers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = timestamp() - start;
+
+    size_t bytes = readers * (BENCH_READS / readers) * BENCH_CHUNK;
+    printf("%7lu %12.4f %12.1f %16.0f\n",
+        readers, elapsed, bytes / elapsed / (1 << 20), readers * (BENCH_READS / readers) / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+    int fd = open(BENCH_PATH, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    assert(fd >= 0);
+    close(fd);
+    assert(atexit(bench_cleanup) == EXIT_SUCCESS);
+
+    Disk *disk = disk_open(BENCH_PATH, BENCH_BLOCKS);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    /* One file per reader, so readers only share the file system */
+    char buffer[BENCH_CHUNK];
+    for (size_t i = 0; i < BENCH_MAX; i++) {
+        assert(fs_create(&fs) == (ssize_t)i);
+        memset(buffer, 'a' + i % 26, sizeof(buffer));
+        for (size_t offset = 0; offset < BENCH_FILE_SIZE; offset += sizeof(buffer)) {
+            assert(fs_write(&fs, i, buffer, sizeof(buffer), offset) == sizeof(buffer));
+        }
+    }
+
+    printf("%7s %12s %12s %16s\n", "readers", "seconds", "MiB/s", "reads/s");
+    for (size_t readers = 1; readers <= BENCH_MAX; readers *= 2) {
+        bench(&fs, readers);
+    }
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
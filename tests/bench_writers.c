@@ -0,0 +1,115 @@
+/* bench_writers.c: Benchmark block allocation with concurrent writers */
+
+#include "sfs/fs.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define BENCH_PATH      "data/image.bench"
+#define BENCH_BLOCKS    (40000)
+#define BENCH_FILES     (4)                     /* Files per writer */
+#define BENCH_FILE_SIZE (256*BLOCK_SIZE)        /* Bytes per file */
+#define BENCH_CHUNK     (4*BUFSIZ)              /* Bytes per fs_write (as copyin) */
+#define BENCH_MAX       (32)                    /* Maximum number of writers */
+
+/* Structures */
+
+typedef struct {
+    FileSystem *fs;
+    size_t      first;                          /* First inode of this writer */
+} Writer;
+
+/* Functions */
+
+double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_cleanup() {
+    unlink(BENCH_PATH);
+}
+
+void *writer(void *arg) {
+    Writer *w = (Writer *)arg;
+    char buffer[BENCH_CHUNK];
+    memset(buffer, 'w', sizeof(buffer));
+
+    for (size_t f = 0; f < BENCH_FILES; f++) {
+        for (size_t offset = 0; offset < BENCH_FILE_SIZE; offset += sizeof(buffer)) {
+            ssize_t result = fs_write(w->fs, w->first + f, buffer, sizeof(buffer), offset);
+            assert(result == sizeof(buffer));
+        }
+    }
+    return NULL;
+}
+
+void bench(Disk *disk, size_t writers) {
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    Writer    args[BENCH_MAX];
+    pthread_t threads[BENCH_MAX];
+    for (size_t i = 0; i < writers; i++) {
+        args[i].fs    = &fs;
+        args[i].first = i * BENCH_FILES;
+        for (size_t f = 0; f < BENCH_FILES; f++) {
+            assert(fs_create(&fs) == (ssize_t)(args[i].first + f));
+        }
+    }
+
+    double start = timestamp();
+    for (size_t i = 0; i < writers; i++) {
+        assert(pthread_create(&threads[i], NULL, writer, &args[i]) == 0);
+    }
+    for (size_t i = 0; i < writers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = timestamp() - start;
+
+    /* Every file must own its blocks exclusively */
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+    size_t used = 0;
+    for (size_t b = 1 + fs.meta_data.inode_blocks; b < fs.meta_data.blocks; b++) {
+        used += !fs.free_blocks[b];
+    }
+    size_t blocks = writers * BENCH_FILES * (BENCH_FILE_SIZE / BLOCK_SIZE);
+    assert(used == blocks + writers * BENCH_FILES);     /* plus one indirect block each */
+    fs_unmount(&fs);
+
+    printf("%7lu %12.4f %12.1f %16.0f\n",
+        writers, elapsed, blocks * BLOCK_SIZE / elapsed / (1 << 20), blocks / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+    int fd = open(BENCH_PATH, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    assert(fd >= 0);
+    close(fd);
+    assert(atexit(bench_cleanup) == EXIT_SUCCESS);
+
+    Disk *disk = disk_open(BENCH_PATH, BENCH_BLOCKS);
+    assert(disk);
+
+    printf("%7s %12s %12s %16s\n", "writers", "seconds", "MiB/s", "allocations/s");
+    for (size_t writers = 1; writers <= BENCH_MAX; writers *= 2) {
+        bench(disk, writers);
+    }
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,14 +1,25 @@
 /* unit_fs.c: Unit tests for SimpleFS file system */
 
+#include "sfs/async.h"
 #include "sfs/fs.h"
 #include "sfs/logging.h"
 
 #include <assert.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <unistd.h>
 
+/* Structures */
+
+typedef struct {
+    FileSystem *fs;
+    size_t      inode_number;
+} TestWriter;
+
 /* Functions */
 
 void test_cleanup() {
@@ -22,6 +33,7 @@ int test_00_fs_mount() {
     FileSystem fs = {0};
     debug("Check mounting filesystem");
     assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
     assert(fs.disk           == disk);
     assert(fs.free_blocks);
     assert(fs.free_blocks[0] == false);
@@ -41,6 +53,7 @@ int test_00_fs_mount() {
 
     debug("Check mounting filesystem");
     assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
     assert(fs.disk           == disk);
     assert(fs.free_blocks);
     assert(fs.free_blocks[0] == false);
@@ -164,6 +177,2076 @@ int test_03_fs_stat() {
     return EXIT_SUCCESS;
 }
 
+int test_04_fs_lazy_mount() {
+    assert(system("cp data/image.200 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    debug("Check reading before scan completes");
+    assert(fs_mount(&fs, disk));
+    assert(fs_stat(&fs, 9) == 409305);
+
+    char data[BLOCK_SIZE];
+    assert(fs_read(&fs, 1, data, sizeof(data), 0) == 1523);
+
+    debug("Check allocating waits for scan");
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number == 0);
+
+    char buffer[3*BLOCK_SIZE] = {0};
+    assert(fs_write(&fs, inode_number, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    assert(fs.scanned == fs.meta_data.inode_blocks);
+
+    Block block;
+    assert(disk_read(fs.disk, 1, block.data) != DISK_FAILURE);
+    assert(block.inodes[0].direct[0] == 21);
+    assert(block.inodes[0].direct[1] == 27);
+    assert(block.inodes[0].direct[2] == 81);
+
+    debug("Check unmounting during scan");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_unmount(&fs);
+    assert(fs.free_blocks == NULL);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_05_fs_free_inodes() {
+    assert(system("cp data/image.20 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check free inode bitmap after mount");
+    assert(fs.free_inodes);
+    assert(fs.free_inodes[0] == true);
+    assert(fs.free_inodes[2] == false);
+    assert(fs.free_inodes[3] == false);
+
+    debug("Check create costs one write (inode block is cached)");
+    size_t reads  = disk->reads;
+    size_t writes = disk->writes;
+    assert(fs_create(&fs) == 0);
+    assert(fs_create(&fs) == 1);
+    assert(fs_create(&fs) == 4);
+    assert(disk->reads  - reads  == 0);
+    assert(disk->writes - writes == 3);
+
+    debug("Check removed inode is reused first");
+    assert(fs_remove(&fs, 1));
+    assert(fs.free_inodes[1] == true);
+    assert(fs_create(&fs) == 1);
+    assert(fs_create(&fs) == 5);
+
+    fs_unmount(&fs);
+    assert(fs.free_inodes == NULL);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_06_fs_block_groups() {
+    size_t blocks = 1 + 3*BLOCKS_PER_GROUP;
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", blocks);
+    assert(disk);
+
+    FileSystem fs = {0};
+    debug("Check formatting with block groups");
+    assert(fs_format_features(&fs, disk, FS_FEATURE_GROUPS));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+    assert(fs.meta_data.groups             == 3);
+    assert(fs.meta_data.group_blocks       == BLOCKS_PER_GROUP);
+    assert(fs.meta_data.group_inode_blocks == 820);
+    assert(fs.meta_data.inode_blocks       == 3*820);
+    assert(fs.free_blocks[1]                        == false);
+    assert(fs.free_blocks[1 + 820]                  == true);
+    assert(fs.free_blocks[1 + BLOCKS_PER_GROUP]     == false);
+    assert(fs.free_blocks[1 + BLOCKS_PER_GROUP + 820] == true);
+
+    debug("Check new files are spread across groups");
+    size_t group_inodes = 820 * INODES_PER_BLOCK;
+    assert(fs_create(&fs) == 0);
+    assert(fs_create(&fs) == group_inodes);
+    assert(fs_create(&fs) == 2*group_inodes);
+    assert(fs_create(&fs) == 1);
+
+    debug("Check data is placed in the inode's group");
+    char data[2*BLOCK_SIZE] = {0};
+    assert(fs_write(&fs, group_inodes, data, sizeof(data), 0) == sizeof(data));
+
+    Block block;
+    assert(disk_read(disk, 1 + BLOCKS_PER_GROUP, block.data) != DISK_FAILURE);
+    assert(block.inodes[0].valid);
+    assert(block.inodes[0].direct[0] == 1 + BLOCKS_PER_GROUP + 820);
+    assert(block.inodes[0].direct[1] == 1 + BLOCKS_PER_GROUP + 821);
+    assert(fs_read(&fs, group_inodes, data, sizeof(data), 0) == sizeof(data));
+
+    debug("Check remount keeps group layout");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+    assert(fs_stat(&fs, group_inodes) == sizeof(data));
+    assert(fs.free_blocks[1 + BLOCKS_PER_GROUP + 820] == false);
+    assert(fs_remove(&fs, group_inodes));
+    assert(fs.free_blocks[1 + BLOCKS_PER_GROUP + 820] == true);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+void *test_writer(void *arg) {
+    TestWriter *w = (TestWriter *)arg;
+    char data[BLOCK_SIZE];
+    memset(data, 'a' + w->inode_number, sizeof(data));
+
+    for (size_t offset = 0; offset < 64*BLOCK_SIZE; offset += sizeof(data)) {
+        assert(fs_write(w->fs, w->inode_number, data, sizeof(data), offset) == sizeof(data));
+    }
+    return NULL;
+}
+
+int test_07_fs_arenas() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    size_t free_before = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_before += fs.free_blocks[b];
+    }
+
+    debug("Check concurrent writers");
+    TestWriter writers[4];
+    pthread_t  threads[4];
+    for (size_t i = 0; i < 4; i++) {
+        writers[i].fs           = &fs;
+        writers[i].inode_number = fs_create(&fs);
+        assert(pthread_create(&threads[i], NULL, test_writer, &writers[i]) == 0);
+    }
+    for (size_t i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    debug("Check arenas are returned when writers go idle");
+    size_t free_after = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_after += fs.free_blocks[b];
+    }
+    assert(free_before - free_after == 4*(64 + 1));
+
+    for (size_t i = 0; i < 4; i++) {
+        char data[BLOCK_SIZE];
+        assert(fs_stat(&fs, writers[i].inode_number) == 64*BLOCK_SIZE);
+        assert(fs_read(&fs, writers[i].inode_number, data, sizeof(data), 63*BLOCK_SIZE) == sizeof(data));
+        assert(data[0] == 'a' + writers[i].inode_number);
+        assert(data[BLOCK_SIZE - 1] == 'a' + writers[i].inode_number);
+    }
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_08_fs_fallocate() {
+    assert(system("tr '\\0' '\\377' < /dev/zero | head -c 4096000 > data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check fs_fallocate");
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_fallocate(&fs, inode_number, 0, 10*BLOCK_SIZE));
+    assert(fs_stat(&fs, inode_number) == 10*BLOCK_SIZE);
+
+    debug("Check preallocated blocks are contiguous");
+    Block block;
+    assert(disk_read(disk, 1 + inode_number / INODES_PER_BLOCK, block.data) == BLOCK_SIZE);
+    Inode *inode = &block.inodes[inode_number % INODES_PER_BLOCK];
+    assert(inode->indirect);
+    uint32_t first = POINTER_BLOCK(inode->direct[0]);
+    for (size_t i = 0; i < POINTERS_PER_INODE; i++) {
+        assert(inode->direct[i] & POINTER_UNWRITTEN);
+        assert(POINTER_BLOCK(inode->direct[i]) == first + i);
+    }
+
+    debug("Check unwritten blocks read as zeros");
+    char data[3*BLOCK_SIZE];
+    assert(fs_read(&fs, inode_number, data, sizeof(data), 4*BLOCK_SIZE) == sizeof(data));
+    for (size_t i = 0; i < sizeof(data); i++) {
+        assert(data[i] == 0);
+    }
+
+    debug("Check partial write into unwritten block");
+    memset(data, 'x', 100);
+    assert(fs_write(&fs, inode_number, data, 100, 5000) == 100);
+    assert(fs_read(&fs, inode_number, data, 2*BLOCK_SIZE, BLOCK_SIZE) == 2*BLOCK_SIZE);
+    for (size_t i = 0; i < 2*BLOCK_SIZE; i++) {
+        assert(data[i] == ((i >= 5000 - BLOCK_SIZE && i < 5100 - BLOCK_SIZE) ? 'x' : 0));
+    }
+    assert(disk_read(disk, 1 + inode_number / INODES_PER_BLOCK, block.data) == BLOCK_SIZE);
+    assert(!(inode->direct[1] & POINTER_UNWRITTEN));
+    assert(inode->direct[0] & POINTER_UNWRITTEN);
+    assert(inode->direct[2] & POINTER_UNWRITTEN);
+
+    debug("Check preallocated blocks survive remount");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+    for (size_t i = 0; i < 10; i++) {
+        assert(!fs.free_blocks[first + i]);
+    }
+    assert(fs_read(&fs, inode_number, data, BLOCK_SIZE, 9*BLOCK_SIZE) == BLOCK_SIZE);
+    assert(data[0] == 0 && data[BLOCK_SIZE - 1] == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_09_fs_delalloc() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 1000);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount_options(&fs, disk, FS_MOUNT_DELALLOC));
+    fs_wait_ready(&fs);
+
+    size_t free_before = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_before += fs.free_blocks[b];
+    }
+
+    debug("Check interleaved writers do not allocate");
+    ssize_t inodes[2] = {fs_create(&fs), fs_create(&fs)};
+    char    data[1024];
+    for (size_t offset = 0; offset < 20*BLOCK_SIZE; offset += sizeof(data)) {
+        for (size_t i = 0; i < 2; i++) {
+            memset(data, 'a' + i + offset / BLOCK_SIZE, sizeof(data));
+            assert(fs_write(&fs, inodes[i], data, sizeof(data), offset) == sizeof(data));
+        }
+    }
+
+    size_t free_after = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_after += fs.free_blocks[b];
+    }
+    assert(free_before == free_after);
+    assert(fs_stat(&fs, inodes[0]) == 20*BLOCK_SIZE);
+    assert(fs_read(&fs, inodes[1], data, sizeof(data), 7*BLOCK_SIZE) == sizeof(data));
+    assert(data[0] == 'b' + 7 && data[sizeof(data) - 1] == 'b' + 7);
+
+    debug("Check temporary file never reaches the disk");
+    size_t  writes = disk->writes;
+    ssize_t temporary = fs_create(&fs);
+    assert(fs_write(&fs, temporary, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_remove(&fs, temporary));
+    assert(disk->writes == writes + 2);
+
+    debug("Check writeback places each file contiguously");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    Block block;
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    for (size_t i = 0; i < 2; i++) {
+        Inode  *inode = &block.inodes[inodes[i]];
+        Block   indirect;
+        assert(inode->size == 20*BLOCK_SIZE);
+        assert(disk_read(disk, inode->indirect, indirect.data) == BLOCK_SIZE);
+        assert(inode->direct[0] == inode->indirect + 1);
+        for (size_t k = 1; k < POINTERS_PER_INODE; k++) {
+            assert(inode->direct[k] == inode->direct[0] + k);
+        }
+        for (size_t k = 0; k < 20 - POINTERS_PER_INODE; k++) {
+            assert(indirect.pointers[k] == inode->direct[0] + POINTERS_PER_INODE + k);
+        }
+
+        for (size_t k = 0; k < 20; k++) {
+            assert(fs_read(&fs, inodes[i], data, sizeof(data), k*BLOCK_SIZE + 96) == sizeof(data));
+            assert(data[0] == 'a' + i + k && data[sizeof(data) - 1] == 'a' + i + k);
+        }
+    }
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_10_fs_extents() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 3000);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format_features(&fs, disk, FS_FEATURE_EXTENTS));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check contiguous file needs one extent");
+    ssize_t contiguous = fs_create(&fs);
+    char    data[4*BLOCK_SIZE];
+    for (size_t offset = 0; offset < 1024*BLOCK_SIZE; offset += sizeof(data)) {
+        memset(data, 'a' + (offset / sizeof(data)) % 26, sizeof(data));
+        assert(fs_write(&fs, contiguous, data, sizeof(data), offset) == sizeof(data));
+    }
+
+    Block block;
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    Inode *inode = &block.inodes[contiguous];
+    assert(inode->valid & INODE_EXTENTS);
+    assert(INODE_DEPTH(inode->valid) == 0);
+    assert(inode->extents[0].logical == 0);
+    assert(inode->extents[0].length == 1024);
+    assert(inode->extents[1].length == 0);
+
+    debug("Check fragmented files spill into an extent tree");
+    ssize_t fragmented[2] = {fs_create(&fs), fs_create(&fs)};
+    for (size_t b = 0; b < 400; b++) {
+        for (size_t i = 0; i < 2; i++) {
+            memset(data, 'A' + i, BLOCK_SIZE);
+            memcpy(data, &b, sizeof(b));
+            assert(fs_write(&fs, fragmented[i], data, BLOCK_SIZE, b*BLOCK_SIZE) == BLOCK_SIZE);
+        }
+    }
+
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    inode = &block.inodes[fragmented[0]];
+    assert(INODE_DEPTH(inode->valid) == 1);
+    assert(inode->index[0].logical == 0 && inode->index[0].block);
+    assert(inode->index[1].logical == EXTENTS_PER_BLOCK && inode->index[1].block);
+    assert(inode->index[2].block == 0);
+
+    debug("Check extent mapped files after remount");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    size_t free_before = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_before += fs.free_blocks[b];
+    }
+    assert(free_before == 3000 - 1 - 300 - 1024 - 2*(400 + 2));
+
+    assert(fs_read(&fs, contiguous, data, sizeof(data), 777*BLOCK_SIZE) == sizeof(data));
+    assert(data[0] == 'a' + (777 / 4) % 26 && data[sizeof(data) - 1] == 'a' + (780 / 4) % 26);
+    for (size_t b = 0; b < 400; b++) {
+        size_t value;
+        assert(fs_read(&fs, fragmented[1], data, BLOCK_SIZE, b*BLOCK_SIZE) == BLOCK_SIZE);
+        memcpy(&value, data, sizeof(value));
+        assert(value == b && data[BLOCK_SIZE - 1] == 'B');
+    }
+
+    debug("Check fs_remove releases extents and tree blocks");
+    assert(fs_remove(&fs, fragmented[0]));
+    size_t free_after = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_after += fs.free_blocks[b];
+    }
+    assert(free_after == free_before + 400 + 2);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_11_fs_large_files() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 2000);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check files grow past the single indirect block");
+    ssize_t inode_number = fs_create(&fs);
+    char    data[16*BLOCK_SIZE];
+    for (size_t b = 0; b < 1500; b += 16) {
+        for (size_t k = 0; k < 16; k++) {
+            size_t stamp = b + k;
+            memset(data + k*BLOCK_SIZE, 'a' + stamp % 26, BLOCK_SIZE);
+            memcpy(data + k*BLOCK_SIZE, &stamp, sizeof(stamp));
+        }
+        size_t length = (1500 - b < 16 ? 1500 - b : 16)*BLOCK_SIZE;
+        assert(fs_write(&fs, inode_number, data, length, b*BLOCK_SIZE) == (ssize_t)length);
+    }
+    assert(fs_stat(&fs, inode_number) == 1500*BLOCK_SIZE);
+
+    Block block;
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    Inode *inode = &block.inodes[inode_number];
+    assert(inode->valid & INODE_INDIRECT3);
+    assert(inode->double_indirect && !inode->triple_indirect);
+    assert(fs.meta_data.features & FS_FEATURE_LARGE_FILES);
+
+    debug("Check sequential reads need one data read per block");
+    assert(fs_read(&fs, inode_number, data, BLOCK_SIZE, 1100*BLOCK_SIZE) == BLOCK_SIZE);
+    size_t reads = disk->reads;
+    for (size_t b = 1101; b < 1200; b++) {
+        assert(fs_read(&fs, inode_number, data, BLOCK_SIZE, b*BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(disk->reads - reads == 99);
+
+    debug("Check large file after remount");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    size_t free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 2000 - 1 - 200 - 1500 - 3);
+
+    for (size_t b = 0; b < 1500; b++) {
+        size_t stamp;
+        assert(fs_read(&fs, inode_number, data, BLOCK_SIZE, b*BLOCK_SIZE) == BLOCK_SIZE);
+        memcpy(&stamp, data, sizeof(stamp));
+        assert(stamp == b && data[BLOCK_SIZE - 1] == 'a' + b % 26);
+    }
+
+    debug("Check fs_remove releases the indirect trees");
+    assert(fs_remove(&fs, inode_number));
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 2000 - 1 - 200);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_12_fs_inline_data() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format_features(&fs, disk, FS_FEATURE_INLINE_DATA));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check tiny files do not allocate data blocks");
+    char   data[2*BLOCK_SIZE];
+    char   copy[2*BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number == 0);
+    assert(fs_write(&fs, inode_number, data, 10, 0) == 10);
+    assert(fs_write(&fs, inode_number, data + 10, 70, 10) == 70);
+    assert(fs_stat(&fs, inode_number) == 80);
+
+    size_t free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 20 - 1 - 2);
+
+    Block block;
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(block.inodes[0].valid & INODE_INLINE);
+    assert(block.slots[1].valid == INODE_SLOT && block.slots[2].valid == INODE_SLOT);
+    assert(!fs.free_inodes[1] && !fs.free_inodes[2] && fs.free_inodes[3]);
+    assert(fs_create(&fs) == 3);
+
+    debug("Check reading a tiny file costs no disk read");
+    size_t reads = disk->reads;
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), 0) == 80);
+    assert(disk->reads - reads == 0);
+    assert(memcmp(copy, data, 80) == 0);
+
+    debug("Check inline data after remount");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+    assert(!fs.free_inodes[1] && !fs.free_inodes[2]);
+    assert(fs_stat(&fs, 1) < 0 && !fs_remove(&fs, 1));
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), 0) == 80);
+    assert(memcmp(copy, data, 80) == 0);
+
+    debug("Check growing past INLINE_MAX moves data to a block");
+    assert(fs_write(&fs, inode_number, data + 80, 120, 80) == 120);
+    assert(fs_stat(&fs, inode_number) == 200);
+    assert(fs.free_inodes[1] && fs.free_inodes[2]);
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(!(block.inodes[0].valid & INODE_INLINE) && block.inodes[0].direct[0]);
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), 0) == 200);
+    assert(memcmp(copy, data, 200) == 0);
+
+    debug("Check fs_remove frees the slots of an inline file");
+    assert(fs_write(&fs, 3, data, INLINE_MAX, 0) == INLINE_MAX);
+    assert(!fs.free_inodes[1] && !fs.free_inodes[2] && !fs.free_inodes[4]);
+    assert(fs_remove(&fs, 3));
+    assert(fs.free_inodes[1] && fs.free_inodes[2] && fs.free_inodes[3] && fs.free_inodes[4]);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_13_fs_sparse_files() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check writes far beyond EOF only allocate the blocks they touch");
+    char   data[BLOCK_SIZE];
+    char  *copy = calloc(101, BLOCK_SIZE);
+    assert(copy);
+    memset(data, 'x', sizeof(data));
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(fs_write(&fs, inode_number, data, 10, 100*BLOCK_SIZE + 5) == 10);
+    assert(fs_stat(&fs, inode_number) == 100*BLOCK_SIZE + 15);
+
+    size_t free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 2);
+
+    debug("Check holes read as zeros without disk reads");
+    size_t reads = disk->reads;
+    assert(fs_read(&fs, inode_number, copy, 100*BLOCK_SIZE, 0) == 100*BLOCK_SIZE);
+    assert(disk->reads - reads <= 2);
+    for (size_t i = 0; i < 100*BLOCK_SIZE; i++) {
+        assert(copy[i] == 0);
+    }
+
+    debug("Check filling a hole");
+    assert(fs_write(&fs, inode_number, data, 1, 2*BLOCK_SIZE + 7) == 1);
+    assert(fs_read(&fs, inode_number, copy, 101*BLOCK_SIZE, 0) == 100*BLOCK_SIZE + 15);
+    for (size_t i = 0; i < 100*BLOCK_SIZE + 15; i++) {
+        bool written = i == 2*BLOCK_SIZE + 7 || (i >= 100*BLOCK_SIZE + 5);
+        assert(copy[i] == (written ? 'x' : 0));
+    }
+
+    debug("Check sparse file after remount");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 3);
+    assert(fs_read(&fs, inode_number, copy, BLOCK_SIZE, 2*BLOCK_SIZE) == BLOCK_SIZE);
+    assert(copy[7] == 'x' && copy[6] == 0 && copy[8] == 0);
+
+    assert(fs_remove(&fs, inode_number));
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20);
+    fs_unmount(&fs);
+
+    debug("Check delayed allocation leaves holes unallocated");
+    assert(fs_mount_options(&fs, disk, FS_MOUNT_DELALLOC));
+    fs_wait_ready(&fs);
+    inode_number = fs_create(&fs);
+    assert(fs_write(&fs, inode_number, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_write(&fs, inode_number, data, BLOCK_SIZE, 50*BLOCK_SIZE) == BLOCK_SIZE);
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 3);
+    assert(fs_read(&fs, inode_number, copy, 51*BLOCK_SIZE, 0) == 51*BLOCK_SIZE);
+    assert(copy[0] == 'x' && copy[BLOCK_SIZE] == 0 && copy[50*BLOCK_SIZE] == 'x');
+
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check extent mapped files keep holes out of their extents");
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+    disk = disk_open("data/image.unit", 200);
+    assert(disk);
+    assert(fs_format_features(&fs, disk, FS_FEATURE_EXTENTS));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    inode_number = fs_create(&fs);
+    assert(fs_write(&fs, inode_number, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_write(&fs, inode_number, data, BLOCK_SIZE, 1000*BLOCK_SIZE) == BLOCK_SIZE);
+
+    Block block;
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    Inode *inode = &block.inodes[inode_number];
+    assert(INODE_DEPTH(inode->valid) == 0);
+    assert(inode->extents[0].logical == 0 && inode->extents[0].length == 1);
+    assert(inode->extents[1].logical == 1000 && inode->extents[1].length == 1);
+    assert(fs_read(&fs, inode_number, copy, BLOCK_SIZE, 500*BLOCK_SIZE) == BLOCK_SIZE);
+    assert(copy[0] == 0 && copy[BLOCK_SIZE - 1] == 0);
+
+    free(copy);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_14_fs_full_block_writes() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check new blocks are written without reading them");
+    char data[5*BLOCK_SIZE];
+    char copy[5*BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    ssize_t inode_number = fs_create(&fs);
+    size_t  reads  = disk->reads;
+    size_t  writes = disk->writes;
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    assert(disk->reads - reads == 0);           // inode block is cached
+    assert(disk->writes - writes == 2);         // one run of 5 blocks and the inode
+
+    debug("Check overwriting whole blocks skips read-modify-write");
+    reads  = disk->reads;
+    writes = disk->writes;
+    assert(fs_write(&fs, inode_number, data + BLOCK_SIZE, 3*BLOCK_SIZE, BLOCK_SIZE) == 3*BLOCK_SIZE);
+    assert(disk->reads - reads == 0);
+    assert(disk->writes - writes == 2);
+
+    debug("Check partial blocks still merge with their old contents");
+    reads  = disk->reads;
+    assert(fs_write(&fs, inode_number, data, 2*BLOCK_SIZE, BLOCK_SIZE/2) == 2*BLOCK_SIZE);
+    assert(disk->reads - reads == 2);
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), 0) == sizeof(copy));
+    assert(memcmp(copy, data, BLOCK_SIZE/2) == 0);
+    assert(memcmp(copy + BLOCK_SIZE/2, data, 2*BLOCK_SIZE) == 0);
+    assert(memcmp(copy + 5*BLOCK_SIZE/2, data + 5*BLOCK_SIZE/2, 5*BLOCK_SIZE/2) == 0);
+
+    debug("Check a new partial block is zero-filled in memory");
+    reads = disk->reads;
+    assert(fs_write(&fs, inode_number, data, 10, 5*BLOCK_SIZE + 100) == 10);
+    assert(disk->reads - reads == 0);
+    assert(fs_read(&fs, inode_number, copy, BLOCK_SIZE, 5*BLOCK_SIZE) == 110);
+    for (size_t i = 0; i < 100; i++) {
+        assert(copy[i] == 0);
+    }
+    assert(memcmp(copy + 100, data, 10) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_15_fs_open() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 1200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check fs_open rejects invalid inodes");
+    assert(fs_open(&fs, 0) == NULL);
+    assert(fs_open(&fs, fs.meta_data.inodes) == NULL);
+
+    debug("Check streaming writes through a handle");
+    ssize_t inode_number = fs_create(&fs);
+    File   *file = fs_open(&fs, inode_number);
+    assert(file);
+
+    char   data[4*BLOCK_SIZE];
+    size_t reads = disk->reads;
+    for (size_t b = 0; b < 1024; b += 4) {
+        for (size_t k = 0; k < 4; k++) {
+            size_t stamp = b + k;
+            memset(data + k*BLOCK_SIZE, 'a' + stamp % 26, BLOCK_SIZE);
+            memcpy(data + k*BLOCK_SIZE, &stamp, sizeof(stamp));
+        }
+        assert(fs_pwrite(file, data, sizeof(data), b*BLOCK_SIZE) == sizeof(data));
+    }
+    assert(disk->reads - reads <= 1024/4 * 2);
+    assert(fs_stat(&fs, inode_number) == 1024*BLOCK_SIZE);
+    assert(fs_close(file));
+
+    debug("Check streaming reads cost at most one disk read per chunk");
+    file = fs_open(&fs, inode_number);
+    assert(file);
+    reads = disk->reads;
+    for (size_t b = 0; b < 1024; b += 4) {
+        assert(fs_pread(file, data, sizeof(data), b*BLOCK_SIZE) == sizeof(data));
+        for (size_t k = 0; k < 4; k++) {
+            size_t stamp;
+            memcpy(&stamp, data + k*BLOCK_SIZE, sizeof(stamp));
+            assert(stamp == b + k && data[BLOCK_SIZE - 1 + k*BLOCK_SIZE] == 'a' + stamp % 26);
+        }
+    }
+    assert(disk->reads - reads <= 1024/4 + 1);
+    assert(fs_pread(file, data, sizeof(data), 1024*BLOCK_SIZE) == 0);
+    assert(fs_close(file));
+
+    debug("Check handles pick up changes made by other handles and by inode number");
+    size_t free_before = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_before += fs.free_blocks[b];
+    }
+    ssize_t other = fs_create(&fs);
+    File   *a     = fs_open(&fs, other);
+    File   *b     = fs_open(&fs, other);
+    assert(a && b);
+    memset(data, 'x', sizeof(data));
+    for (size_t k = 0; k < 20; k += 4) {
+        assert(fs_pwrite(a, data, sizeof(data), k*BLOCK_SIZE) == sizeof(data));
+    }
+    memset(data, 'y', BLOCK_SIZE);
+    assert(fs_pwrite(b, data, BLOCK_SIZE, 30*BLOCK_SIZE) == BLOCK_SIZE);
+    memset(data, 'z', BLOCK_SIZE);
+    assert(fs_write(&fs, other, data, BLOCK_SIZE, 10*BLOCK_SIZE) == BLOCK_SIZE);
+    assert(fs_stat(&fs, other) == 31*BLOCK_SIZE);
+    for (size_t k = 0; k < 31; k++) {
+        char expected = k == 10 ? 'z' : k < 20 ? 'x' : k == 30 ? 'y' : 0;
+        assert(fs_pread(a, data, BLOCK_SIZE, k*BLOCK_SIZE) == BLOCK_SIZE);
+        assert(data[0] == expected && data[BLOCK_SIZE - 1] == expected);
+    }
+    assert(fs_truncate(&fs, other, 0));
+    memset(data, 'q', BLOCK_SIZE);
+    assert(fs_pwrite(b, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_stat(&fs, other) == BLOCK_SIZE);
+    assert(fs_pread(a, data, sizeof(data), 0) == BLOCK_SIZE && data[0] == 'q');
+    assert(fs_close(a) && fs_close(b));
+    assert(fs_remove(&fs, other));
+    size_t free_after = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_after += fs.free_blocks[b];
+    }
+    assert(free_after == free_before);
+
+    debug("Check handle writes are visible after remount");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+    assert(fs_read(&fs, inode_number, data, BLOCK_SIZE, 1000*BLOCK_SIZE) == BLOCK_SIZE);
+    size_t stamp;
+    memcpy(&stamp, data, sizeof(stamp));
+    assert(stamp == 1000);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_16_fs_read_view() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    char data[4*BLOCK_SIZE];
+    char copy[8*BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    ssize_t inode_number = fs_create(&fs);
+    File   *file = fs_open(&fs, inode_number);
+    assert(file);
+    assert(fs_pwrite(file, data, 4*BLOCK_SIZE, 0) == 4*BLOCK_SIZE);
+    assert(fs_pwrite(file, data, 100, 7*BLOCK_SIZE) == 100);
+
+    debug("Check views of contiguous blocks come from one disk read");
+    FileView view;
+    size_t   reads = disk->reads;
+    assert(fs_read_view(file, 3*BLOCK_SIZE, 10, &view) == 3*BLOCK_SIZE);
+    assert(disk->reads - reads == 1);
+    assert(view.iovcnt == 1 && view.iov[0].iov_len == 3*BLOCK_SIZE);
+    assert(memcmp(view.iov[0].iov_base, data + 10, 3*BLOCK_SIZE) == 0);
+    fs_release_view(&view);
+    assert(!view.iov && !view.blocks);
+
+    debug("Check holes share one zero block");
+    reads = disk->reads;
+    assert(fs_read_view(file, sizeof(copy), 0, &view) == 7*BLOCK_SIZE + 100);
+    assert(disk->reads - reads == 2);
+    assert(view.iovcnt == 5);
+    assert(view.iov[1].iov_base == view.iov[2].iov_base && view.iov[2].iov_base == view.iov[3].iov_base);
+
+    size_t total = 0;
+    for (size_t i = 0; i < view.iovcnt; i++) {
+        memcpy(copy + total, view.iov[i].iov_base, view.iov[i].iov_len);
+        total += view.iov[i].iov_len;
+    }
+    fs_release_view(&view);
+    assert(total == 7*BLOCK_SIZE + 100);
+    assert(memcmp(copy, data, 4*BLOCK_SIZE) == 0);
+    for (size_t i = 4*BLOCK_SIZE; i < 7*BLOCK_SIZE; i++) {
+        assert(copy[i] == 0);
+    }
+    assert(memcmp(copy + 7*BLOCK_SIZE, data, 100) == 0);
+
+    debug("Check views past EOF");
+    assert(fs_read_view(file, BLOCK_SIZE, 8*BLOCK_SIZE, &view) == 0);
+    assert(view.iovcnt == 0);
+
+    assert(fs_close(file));
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_17_fs_writev() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check fs_writev batches small records");
+    char         records[100][100];
+    struct iovec iov[100];
+    for (size_t r = 0; r < 100; r++) {
+        memset(records[r], 'a' + r % 26, sizeof(records[r]));
+        memcpy(records[r], &r, sizeof(r));
+        iov[r].iov_base = records[r];
+        iov[r].iov_len  = sizeof(records[r]);
+    }
+
+    ssize_t inode_number = fs_create(&fs);
+    size_t  reads  = disk->reads;
+    size_t  writes = disk->writes;
+    assert(fs_writev(&fs, inode_number, iov, 100, 0) == 100*100);
+    assert(disk->reads - reads == 0);           // inode block is cached
+    assert(disk->writes - writes == 3);         // two whole blocks, the tail and the inode
+    assert(fs_stat(&fs, inode_number) == 100*100);
+
+    debug("Check fs_readv scatters records back");
+    char         copies[100][100];
+    struct iovec out[100];
+    for (size_t r = 0; r < 100; r++) {
+        out[r].iov_base = copies[r];
+        out[r].iov_len  = sizeof(copies[r]);
+    }
+    reads = disk->reads;
+    assert(fs_readv(&fs, inode_number, out, 100, 0) == 100*100);
+    assert(disk->reads - reads == 2);           // two whole blocks and the tail
+    assert(memcmp(copies, records, sizeof(records)) == 0);
+
+    debug("Check fs_readv stops at EOF");
+    memset(copies, 0, sizeof(copies));
+    assert(fs_readv(&fs, inode_number, out, 100, 50*100) == 50*100);
+    assert(memcmp(copies, records[50], 50*100) == 0);
+    assert(copies[50][0] == 0);
+    assert(fs_readv(&fs, inode_number, out, 0, 0) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check fs_writev on an inline file");
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+    disk = disk_open("data/image.unit", 200);
+    assert(disk);
+    assert(fs_format_features(&fs, disk, FS_FEATURE_INLINE_DATA));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    inode_number = fs_create(&fs);
+    for (size_t r = 0; r < 100; r++) {
+        iov[r].iov_len = 10;
+    }
+    assert(fs_writev(&fs, inode_number, iov, 10, 0) == 10*10);
+    assert(fs_writev(&fs, inode_number, iov, 100, 100) == 100*10);
+    assert(fs_stat(&fs, inode_number) == 100*10 + 100);
+    assert(fs_readv(&fs, inode_number, out, 10, 0) == 10*100);
+    for (size_t r = 0; r < 10; r++) {
+        assert(memcmp(copies[0] + r*10, records[r], 10) == 0);
+        assert(memcmp(copies[1] + r*10, records[r], 10) == 0);
+    }
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_18_fs_truncate() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check shrinking frees the tail blocks and the indirect block");
+    char *data = malloc(20*BLOCK_SIZE);
+    char *copy = malloc(20*BLOCK_SIZE);
+    assert(data && copy);
+    for (size_t i = 0; i < 20*BLOCK_SIZE; i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(fs_write(&fs, inode_number, data, 20*BLOCK_SIZE, 0) == 20*BLOCK_SIZE);
+
+    size_t free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 21);
+
+    assert(fs_truncate(&fs, inode_number, 3*BLOCK_SIZE + 100));
+    assert(fs_stat(&fs, inode_number) == 3*BLOCK_SIZE + 100);
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 4);
+
+    Block block;
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(block.inodes[inode_number].indirect == 0 && block.inodes[inode_number].direct[4] == 0);
+    assert(fs_read(&fs, inode_number, copy, 20*BLOCK_SIZE, 0) == 3*BLOCK_SIZE + 100);
+    assert(memcmp(copy, data, 3*BLOCK_SIZE + 100) == 0);
+
+    debug("Check growing leaves a hole that reads as zeros");
+    assert(fs_truncate(&fs, inode_number, 6*BLOCK_SIZE));
+    assert(fs_stat(&fs, inode_number) == 6*BLOCK_SIZE);
+    assert(fs_read(&fs, inode_number, copy, 20*BLOCK_SIZE, 0) == 6*BLOCK_SIZE);
+    assert(memcmp(copy, data, 3*BLOCK_SIZE + 100) == 0);
+    for (size_t i = 3*BLOCK_SIZE + 100; i < 6*BLOCK_SIZE; i++) {
+        assert(copy[i] == 0);
+    }
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 4);
+
+    debug("Check truncating to zero frees every block");
+    assert(fs_truncate(&fs, inode_number, 0));
+    assert(fs_stat(&fs, inode_number) == 0);
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20);
+    assert(!fs_truncate(&fs, inode_number + 1, 0));
+
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check shrinking an extent mapped file");
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+    disk = disk_open("data/image.unit", 200);
+    assert(disk);
+    assert(fs_format_features(&fs, disk, FS_FEATURE_EXTENTS | FS_FEATURE_INLINE_DATA));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    inode_number = fs_create(&fs);
+    assert(fs_write(&fs, inode_number, data, 20*BLOCK_SIZE, 0) == 20*BLOCK_SIZE);
+    assert(fs_truncate(&fs, inode_number, 5*BLOCK_SIZE));
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(block.inodes[inode_number].extents[0].length == 5);
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 5);
+    assert(fs_read(&fs, inode_number, copy, 20*BLOCK_SIZE, 0) == 5*BLOCK_SIZE);
+    assert(memcmp(copy, data, 5*BLOCK_SIZE) == 0);
+    assert(fs_truncate(&fs, inode_number, 0));
+    assert(fs_stat(&fs, inode_number) == 0);
+    assert(fs_read(&fs, inode_number, copy, BLOCK_SIZE, 0) == 0);
+    assert(fs_remove(&fs, inode_number));
+
+    debug("Check resizing an extent mapped file without extents");
+    inode_number = fs_create(&fs);
+    assert(fs_truncate(&fs, inode_number, 5*BLOCK_SIZE));
+    assert(fs_stat(&fs, inode_number) == 5*BLOCK_SIZE);
+    assert(fs_truncate(&fs, inode_number, 0));
+    assert(fs_stat(&fs, inode_number) == 0);
+    assert(fs_remove(&fs, inode_number));
+
+    debug("Check resizing an inline file frees its slots");
+    inode_number = fs_create(&fs);
+    assert(fs_write(&fs, inode_number, data, INLINE_MAX, 0) == INLINE_MAX);
+    assert(!fs.free_inodes[inode_number + 3]);
+    assert(fs_truncate(&fs, inode_number, 30));
+    assert(fs.free_inodes[inode_number + 2] && fs.free_inodes[inode_number + 3]);
+    assert(fs_truncate(&fs, inode_number, 60));
+    assert(fs_read(&fs, inode_number, copy, 20*BLOCK_SIZE, 0) == 60);
+    assert(memcmp(copy, data, 30) == 0);
+    for (size_t i = 30; i < 60; i++) {
+        assert(copy[i] == 0);
+    }
+
+    debug("Check growing an inline file past INLINE_MAX");
+    assert(fs_truncate(&fs, inode_number, 1000));
+    assert(fs_stat(&fs, inode_number) == 1000);
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(!(block.inodes[inode_number].valid & INODE_INLINE));
+    assert(fs_read(&fs, inode_number, copy, 20*BLOCK_SIZE, 0) == 1000);
+    assert(memcmp(copy, data, 30) == 0);
+    for (size_t i = 30; i < 1000; i++) {
+        assert(copy[i] == 0);
+    }
+
+    free(data);
+    free(copy);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_19_fs_clone() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check clones share data blocks");
+    char *data = malloc(20*BLOCK_SIZE);
+    char *copy = malloc(20*BLOCK_SIZE);
+    assert(data && copy);
+    for (size_t i = 0; i < 20*BLOCK_SIZE; i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(fs_write(&fs, inode_number, data, 20*BLOCK_SIZE, 0) == 20*BLOCK_SIZE);
+
+    ssize_t clone = fs_clone(&fs, inode_number);
+    assert(clone >= 0 && clone != inode_number);
+    assert(fs_stat(&fs, clone) == 20*BLOCK_SIZE);
+    assert(fs_read(&fs, clone, copy, 20*BLOCK_SIZE, 0) == 20*BLOCK_SIZE);
+    assert(memcmp(copy, data, 20*BLOCK_SIZE) == 0);
+
+    size_t free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 21 - 1);  // only the indirect block is new
+    assert(fs.meta_data.features & FS_FEATURE_REFLINK);
+    assert(fs_clone(&fs, inode_number + 100) < 0);
+
+    debug("Check writing a shared block copies it");
+    assert(fs_write(&fs, clone, "xyz", 3, BLOCK_SIZE + 10) == 3);
+    assert(fs_write(&fs, inode_number, data, BLOCK_SIZE, 2*BLOCK_SIZE) == BLOCK_SIZE);
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 21 - 1 - 2);
+
+    assert(fs_read(&fs, inode_number, copy, 20*BLOCK_SIZE, 0) == 20*BLOCK_SIZE);
+    assert(memcmp(copy, data, 2*BLOCK_SIZE) == 0);
+    assert(memcmp(copy + 2*BLOCK_SIZE, data, BLOCK_SIZE) == 0);
+    assert(memcmp(copy + 3*BLOCK_SIZE, data + 3*BLOCK_SIZE, 17*BLOCK_SIZE) == 0);
+    assert(fs_read(&fs, clone, copy, 20*BLOCK_SIZE, 0) == 20*BLOCK_SIZE);
+    assert(memcmp(copy, data, BLOCK_SIZE + 10) == 0);
+    assert(memcmp(copy + BLOCK_SIZE + 10, "xyz", 3) == 0);
+    assert(memcmp(copy + BLOCK_SIZE + 13, data + BLOCK_SIZE + 13, 19*BLOCK_SIZE - 13) == 0);
+
+    debug("Check shared blocks after remount");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 21 - 1 - 2);
+
+    debug("Check removing a file keeps the blocks its clone uses");
+    assert(fs_remove(&fs, inode_number));
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 21);
+    assert(fs_read(&fs, clone, copy, 20*BLOCK_SIZE, 0) == 20*BLOCK_SIZE);
+    assert(memcmp(copy + BLOCK_SIZE + 10, "xyz", 3) == 0);
+    assert(memcmp(copy + 2*BLOCK_SIZE, data + 2*BLOCK_SIZE, 18*BLOCK_SIZE) == 0);
+
+    assert(fs_truncate(&fs, clone, BLOCK_SIZE));
+    assert(fs_remove(&fs, clone));
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check cloning an extent mapped file only writes its inode");
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+    disk = disk_open("data/image.unit", 200);
+    assert(disk);
+    assert(fs_format_features(&fs, disk, FS_FEATURE_EXTENTS | FS_FEATURE_INLINE_DATA | FS_FEATURE_REFLINK));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    inode_number = fs_create(&fs);
+    assert(fs_write(&fs, inode_number, data, 20*BLOCK_SIZE, 0) == 20*BLOCK_SIZE);
+    size_t writes = disk->writes;
+    clone = fs_clone(&fs, inode_number);
+    assert(clone >= 0);
+    assert(disk->writes - writes == 2);         // new inode and its mapping
+    assert(fs_read(&fs, clone, copy, 20*BLOCK_SIZE, 0) == 20*BLOCK_SIZE);
+    assert(memcmp(copy, data, 20*BLOCK_SIZE) == 0);
+
+    debug("Check overwriting whole shared blocks does not copy them");
+    size_t reads = disk->reads;
+    writes = disk->writes;
+    assert(fs_write(&fs, clone, data + BLOCK_SIZE, 4*BLOCK_SIZE, 0) == 4*BLOCK_SIZE);
+    assert(disk->reads - reads == 0);           // inode block is cached
+    assert(disk->writes - writes == 2);         // the new blocks and the inode
+    assert(fs_read(&fs, inode_number, copy, 20*BLOCK_SIZE, 0) == 20*BLOCK_SIZE);
+    assert(memcmp(copy, data, 20*BLOCK_SIZE) == 0);
+    assert(fs_read(&fs, clone, copy, 4*BLOCK_SIZE, 0) == 4*BLOCK_SIZE);
+    assert(memcmp(copy, data + BLOCK_SIZE, 4*BLOCK_SIZE) == 0);
+
+    debug("Check cloning an inline file copies it");
+    inode_number = fs_create(&fs);
+    assert(fs_write(&fs, inode_number, data, 50, 0) == 50);
+    clone = fs_clone(&fs, inode_number);
+    assert(clone >= 0 && fs_stat(&fs, clone) == 50);
+    assert(fs_write(&fs, inode_number, "xyz", 3, 0) == 3);
+    assert(fs_read(&fs, clone, copy, BLOCK_SIZE, 0) == 50);
+    assert(memcmp(copy, data, 50) == 0);
+
+    free(data);
+    free(copy);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_20_fs_copy_range() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check copying whole blocks");
+    char *data = malloc(20*BLOCK_SIZE);
+    char *copy = malloc(20*BLOCK_SIZE);
+    assert(data && copy);
+    for (size_t i = 0; i < 20*BLOCK_SIZE; i++) {
+        data[i] = 'a' + i % 26 + i / BLOCK_SIZE;
+    }
+
+    ssize_t source = fs_create(&fs);
+    ssize_t target = fs_create(&fs);
+    assert(fs_write(&fs, source, data, 10*BLOCK_SIZE, 0) == 10*BLOCK_SIZE);
+    assert(fs_copy_range(&fs, source, 0, target, 0, 10*BLOCK_SIZE) == 10*BLOCK_SIZE);
+    assert(fs_stat(&fs, target) == 10*BLOCK_SIZE);
+    assert(fs_read(&fs, target, copy, 20*BLOCK_SIZE, 0) == 10*BLOCK_SIZE);
+    assert(memcmp(copy, data, 10*BLOCK_SIZE) == 0);
+
+    debug("Check copying with partial blocks at either end");
+    assert(fs_copy_range(&fs, source, 100, target, BLOCK_SIZE + 100, 3*BLOCK_SIZE) == 3*BLOCK_SIZE);
+    assert(fs_read(&fs, target, copy, 20*BLOCK_SIZE, 0) == 10*BLOCK_SIZE);
+    assert(memcmp(copy, data, BLOCK_SIZE + 100) == 0);
+    assert(memcmp(copy + BLOCK_SIZE + 100, data + 100, 3*BLOCK_SIZE) == 0);
+    assert(memcmp(copy + 4*BLOCK_SIZE + 100, data + 4*BLOCK_SIZE + 100, 6*BLOCK_SIZE - 100) == 0);
+
+    debug("Check copying between different block offsets");
+    assert(fs_copy_range(&fs, source, 7, target, 9*BLOCK_SIZE + 3, 2*BLOCK_SIZE) == 2*BLOCK_SIZE);
+    assert(fs_stat(&fs, target) == 11*BLOCK_SIZE + 3);
+    assert(fs_read(&fs, target, copy, 2*BLOCK_SIZE, 9*BLOCK_SIZE + 3) == 2*BLOCK_SIZE);
+    assert(memcmp(copy, data + 7, 2*BLOCK_SIZE) == 0);
+
+    debug("Check copies stop at the end of the source");
+    assert(fs_copy_range(&fs, source, 9*BLOCK_SIZE, target, 0, 5*BLOCK_SIZE) == BLOCK_SIZE);
+    assert(fs_copy_range(&fs, source, 10*BLOCK_SIZE, target, 0, BLOCK_SIZE) == 0);
+    assert(fs_copy_range(&fs, source, 0, target + 100, 0, BLOCK_SIZE) < 0);
+
+    debug("Check holes stay zero in the copy");
+    ssize_t sparse = fs_create(&fs);
+    assert(fs_write(&fs, sparse, data, BLOCK_SIZE, 5*BLOCK_SIZE) == BLOCK_SIZE);
+    assert(fs_copy_range(&fs, sparse, 0, target, 0, 6*BLOCK_SIZE) == 6*BLOCK_SIZE);
+    assert(fs_read(&fs, target, copy, 6*BLOCK_SIZE, 0) == 6*BLOCK_SIZE);
+    for (size_t i = 0; i < 5*BLOCK_SIZE; i++) {
+        assert(copy[i] == 0);
+    }
+    assert(memcmp(copy + 5*BLOCK_SIZE, data, BLOCK_SIZE) == 0);
+
+    debug("Check overlapping copies inside one file");
+    assert(fs_copy_range(&fs, source, 0, source, 100, 3*BLOCK_SIZE) == 3*BLOCK_SIZE);
+    assert(fs_read(&fs, source, copy, 4*BLOCK_SIZE, 0) == 4*BLOCK_SIZE);
+    assert(memcmp(copy, data, 100) == 0);
+    assert(memcmp(copy + 100, data, 3*BLOCK_SIZE) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+
+    debug("Check whole extents are copied with one disk request");
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+    disk = disk_open("data/image.unit", 200);
+    assert(disk);
+    assert(fs_format_features(&fs, disk, FS_FEATURE_EXTENTS));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    source = fs_create(&fs);
+    target = fs_create(&fs);
+    assert(fs_write(&fs, source, data, 20*BLOCK_SIZE, 0) == 20*BLOCK_SIZE);
+    size_t reads  = disk->reads;
+    size_t writes = disk->writes;
+    assert(fs_copy_range(&fs, source, 0, target, 0, 20*BLOCK_SIZE) == 20*BLOCK_SIZE);
+    assert(disk->reads - reads == 1);           // the copy (inode blocks are cached)
+    assert(disk->writes - writes == 2);         // the copy and the inode
+    assert(fs_read(&fs, target, copy, 20*BLOCK_SIZE, 0) == 20*BLOCK_SIZE);
+    assert(memcmp(copy, data, 20*BLOCK_SIZE) == 0);
+    fs_unmount(&fs);
+
+    debug("Check copies see data buffered by delayed allocation");
+    assert(fs_mount_options(&fs, disk, FS_MOUNT_DELALLOC));
+    fs_wait_ready(&fs);
+    source = fs_create(&fs);
+    target = fs_create(&fs);
+    assert(fs_write(&fs, source, data, 2*BLOCK_SIZE, 0) == 2*BLOCK_SIZE);
+    assert(fs_copy_range(&fs, source, 0, target, 0, 2*BLOCK_SIZE) == 2*BLOCK_SIZE);
+    assert(fs_stat(&fs, source) == 2*BLOCK_SIZE);
+    assert(fs_stat(&fs, target) == 2*BLOCK_SIZE);
+    assert(fs_read(&fs, target, copy, 2*BLOCK_SIZE, 0) == 2*BLOCK_SIZE);
+    assert(memcmp(copy, data, 2*BLOCK_SIZE) == 0);
+
+    free(data);
+    free(copy);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_21_fs_dedup() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check identical blocks are shared");
+    char *data = malloc(8*BLOCK_SIZE);
+    char *copy = malloc(8*BLOCK_SIZE);
+    assert(data && copy);
+    for (size_t i = 0; i < 8*BLOCK_SIZE; i++) {
+        data[i] = 'a' + i % 26 + i / BLOCK_SIZE;
+    }
+    memcpy(data + 3*BLOCK_SIZE, data, BLOCK_SIZE);
+
+    ssize_t first  = fs_create(&fs);
+    ssize_t second = fs_create(&fs);
+    assert(fs_write(&fs, first, data, 4*BLOCK_SIZE, 0) == 4*BLOCK_SIZE);
+    assert(fs_write(&fs, second, data, 2*BLOCK_SIZE, 0) == 2*BLOCK_SIZE);
+    assert(fs_write(&fs, second, data + 4*BLOCK_SIZE, 2*BLOCK_SIZE + 10, 2*BLOCK_SIZE) == 2*BLOCK_SIZE + 10);
+
+    size_t free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 9);
+
+    assert(fs_dedup(&fs) == 3);                 // first[3], second[0] and second[1]
+    assert(fs.meta_data.features & FS_FEATURE_REFLINK);
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 6);
+    assert(fs_read(&fs, first, copy, 8*BLOCK_SIZE, 0) == 4*BLOCK_SIZE);
+    assert(memcmp(copy, data, 4*BLOCK_SIZE) == 0);
+    assert(fs_read(&fs, second, copy, 8*BLOCK_SIZE, 0) == 4*BLOCK_SIZE + 10);
+    assert(memcmp(copy, data, 2*BLOCK_SIZE) == 0);
+    assert(memcmp(copy + 2*BLOCK_SIZE, data + 4*BLOCK_SIZE, 2*BLOCK_SIZE + 10) == 0);
+
+    Block block;
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(block.inodes[first].direct[3] == block.inodes[first].direct[0]);
+    assert(block.inodes[second].direct[0] == block.inodes[first].direct[0]);
+    assert(fs_dedup(&fs) == 0);
+
+    debug("Check writing a deduplicated block copies it");
+    assert(fs_write(&fs, second, "xyz", 3, 0) == 3);
+    assert(fs_read(&fs, first, copy, 8*BLOCK_SIZE, 0) == 4*BLOCK_SIZE);
+    assert(memcmp(copy, data, 4*BLOCK_SIZE) == 0);
+    assert(fs_read(&fs, second, copy, 3, 0) == 3);
+    assert(memcmp(copy, "xyz", 3) == 0);
+
+    debug("Check shared blocks are freed with their last file");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 7);
+    assert(fs_remove(&fs, first));
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 5);
+    assert(fs_read(&fs, second, copy, 8*BLOCK_SIZE, 0) == 4*BLOCK_SIZE + 10);
+    assert(memcmp(copy + BLOCK_SIZE, data + BLOCK_SIZE, BLOCK_SIZE) == 0);
+    assert(fs_remove(&fs, second));
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20);
+
+    free(data);
+    free(copy);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_22_fs_snapshot() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format_features(&fs, disk, FS_FEATURE_INLINE_DATA));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check snapshot shares data blocks");
+    char *data = malloc(8*BLOCK_SIZE);
+    char *copy = malloc(8*BLOCK_SIZE);
+    assert(data && copy);
+    for (size_t i = 0; i < 8*BLOCK_SIZE; i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    ssize_t big  = fs_create(&fs);
+    ssize_t tiny = fs_create(&fs);
+    assert(fs_write(&fs, big, data, 8*BLOCK_SIZE, 0) == 8*BLOCK_SIZE);
+    assert(fs_write(&fs, tiny, "hello", 5, 0) == 5);
+
+    assert(!fs_snapshot(&fs, ""));
+    assert(!fs_snapshot(&fs, "a-name-that-is-far-too-long"));
+    assert(fs_snapshot(&fs, "backup"));
+    assert(!fs_snapshot(&fs, "backup"));
+    assert(fs.meta_data.features & FS_FEATURE_SNAPSHOTS);
+
+    size_t free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    // data and indirect, directory, index, zero block, inode block and indirect copies
+    assert(free_blocks == 200 - 1 - 20 - 9 - 5);
+
+    debug("Check live writes do not change the snapshot");
+    assert(fs_write(&fs, big, "XYZ", 3, 0) == 3);
+    assert(fs_write(&fs, tiny, "bye", 3, 0) == 3);
+    ssize_t third = fs_create(&fs);
+    assert(third >= 0);
+
+    FileSystem snap = {0};
+    assert(!fs_mount_snapshot(&snap, disk, "nothing"));
+    fs_unmount(&snap);
+    assert(fs_mount_snapshot(&snap, disk, "backup"));
+    fs_wait_ready(&snap);
+    assert(fs_read(&snap, big, copy, 8*BLOCK_SIZE, 0) == 8*BLOCK_SIZE);
+    assert(memcmp(copy, data, 8*BLOCK_SIZE) == 0);
+    assert(fs_read(&snap, tiny, copy, 8, 0) == 5);
+    assert(memcmp(copy, "hello", 5) == 0);
+    assert(fs_stat(&snap, third) == -1);
+
+    assert(fs_read(&fs, big, copy, 8*BLOCK_SIZE, 0) == 8*BLOCK_SIZE);
+    assert(memcmp(copy, "XYZ", 3) == 0);
+    assert(memcmp(copy + 3, data + 3, 8*BLOCK_SIZE - 3) == 0);
+    assert(fs_read(&fs, tiny, copy, 8, 0) == 5);
+    assert(memcmp(copy, "byelo", 5) == 0);
+
+    debug("Check snapshot is read-only");
+    assert(fs_write(&snap, big, "XYZ", 3, 0) == -1);
+    assert(fs_create(&snap) == -1);
+    assert(!fs_remove(&snap, tiny));
+    assert(!fs_truncate(&snap, big, 0));
+    assert(!fs_snapshot(&snap, "nested"));
+    fs_unmount(&snap);
+
+    debug("Check remount counts snapshot blocks");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 9 - 5 - 1);
+    assert(fs_remove(&fs, big));
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 8 - 5);
+
+    debug("Check deleting snapshot frees its blocks");
+    assert(!fs_delete_snapshot(&fs, "nothing"));
+    assert(fs_delete_snapshot(&fs, "backup"));
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 1);    // directory
+    assert(!fs_mount_snapshot(&snap, disk, "backup"));
+    assert(fs_read(&fs, tiny, copy, 8, 0) == 5);
+    assert(memcmp(copy, "byelo", 5) == 0);
+
+    free(data);
+    free(copy);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_23_fs_journal() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format_features(&fs, disk, FS_FEATURE_JOURNAL));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+
+    debug("Check journal is reserved");
+    assert(fs.meta_data.journal == 21);
+    assert(fs.meta_data.journal_blocks == 44);
+    size_t free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 44);
+
+    debug("Check small operations share one commit");
+    Block block;
+    size_t writes = disk->writes;
+    for (size_t i = 0; i < 4; i++) {
+        assert(fs_create(&fs) == (ssize_t)i);
+        assert(fs_write(&fs, i, "journaled", 9, 0) == 9);
+    }
+    assert(disk->writes - writes == 4);     // data blocks only
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(!block.inodes[0].valid);
+    assert(fs_stat(&fs, 3) == 9);
+
+    fs_unmount(&fs);
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(block.inodes[3].valid && block.inodes[3].size == 9);
+    assert(fs_mount(&fs, disk));
+    char buffer[16] = {0};
+    assert(fs_read(&fs, 2, buffer, sizeof(buffer), 0) == 9);
+    assert(memcmp(buffer, "journaled", 9) == 0);
+    fs_unmount(&fs);
+
+    debug("Check unfinished commit is replayed");
+    Block header;
+    Block descriptor;
+    assert(disk_read(disk, 21, header.data) == BLOCK_SIZE);
+    assert(disk_read(disk, 22, descriptor.data) == BLOCK_SIZE);
+    assert(header.journal.magic == JOURNAL_MAGIC && descriptor.journal.magic == JOURNAL_MAGIC);
+    assert(descriptor.journal.sequence + 1 == header.journal.sequence);
+
+    header.journal.sequence = descriptor.journal.sequence;
+    memset(block.data, 0, BLOCK_SIZE);
+    assert(disk_write(disk, 1, block.data) == BLOCK_SIZE);
+    assert(disk_write(disk, 21, header.data) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(fs_stat(&fs, 3) == 9);
+    fs_unmount(&fs);
+    assert(disk_read(disk, 21, header.data) == BLOCK_SIZE);
+    assert(descriptor.journal.sequence + 1 == header.journal.sequence);
+
+    debug("Check torn commit is not replayed");
+    header.journal.sequence = descriptor.journal.sequence;
+    assert(disk_write(disk, 1, block.data) == BLOCK_SIZE);
+    assert(disk_write(disk, 21, header.data) == BLOCK_SIZE);
+    assert(disk_read(disk, 23, block.data) == BLOCK_SIZE);
+    block.data[0] ^= 1;
+    assert(disk_write(disk, 23, block.data) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(fs_stat(&fs, 3) == -1);
+    fs_unmount(&fs);
+
+    debug("Check freed blocks are reused after commit");
+    assert(fs_format_features(&fs, disk, FS_FEATURE_JOURNAL));
+    assert(fs_mount(&fs, disk));
+    fs_wait_ready(&fs);
+    char *data = calloc(100, BLOCK_SIZE);
+    assert(data);
+    ssize_t first = fs_create(&fs);
+    assert(fs_write(&fs, first, data, 100*BLOCK_SIZE, 0) == 100*BLOCK_SIZE);
+    assert(fs_remove(&fs, first));
+    free_blocks = 0;
+    for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+        free_blocks += fs.free_blocks[b];
+    }
+    assert(free_blocks == 200 - 1 - 20 - 44 - 101);
+    ssize_t second = fs_create(&fs);
+    assert(fs_write(&fs, second, data, 100*BLOCK_SIZE, 0) == 100*BLOCK_SIZE);
+    fs_unmount(&fs);
+
+    assert(fs_mount(&fs, disk));
+    assert(fs_stat(&fs, second) == 100*BLOCK_SIZE);
+    fs_unmount(&fs);
+
+    debug("Check a bad journal header fails the mount cleanly");
+    Block saved;
+    uint32_t journal = fs.meta_data.journal;
+    assert(disk_read(disk, journal, saved.data) == BLOCK_SIZE);
+    assert(disk_write(disk, journal, data) == BLOCK_SIZE);
+    assert(!fs_mount(&fs, disk));
+    assert(fs.disk == NULL && fs.table_locks == NULL && fs.inode_locks == NULL);
+    assert(disk_write(disk, journal, saved.data) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(fs_stat(&fs, second) == 100*BLOCK_SIZE);
+
+    free(data);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_24_fs_log() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount_options(&fs, disk, FS_MOUNT_LOG));
+    fs_wait_ready(&fs);
+
+    debug("Check blocks are appended in order");
+    char *data = malloc(60*BLOCK_SIZE);
+    char *copy = malloc(60*BLOCK_SIZE);
+    assert(data && copy);
+    for (size_t i = 0; i < 60*BLOCK_SIZE; i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    ssize_t first  = fs_create(&fs);
+    ssize_t second = fs_create(&fs);
+    assert(fs_write(&fs, first, data, 4*BLOCK_SIZE, 0) == 4*BLOCK_SIZE);
+    assert(fs_write(&fs, second, data, 4*BLOCK_SIZE, 0) == 4*BLOCK_SIZE);
+    for (size_t b = 21; b < 29; b++) {
+        assert(!fs.free_blocks[b]);
+    }
+    assert(fs.free_blocks[29]);
+
+    debug("Check overwrites move to the log head");
+    size_t writes = disk->writes;
+    assert(fs_write(&fs, first, "XYZ", 3, 100) == 3);
+    assert(disk->writes - writes == 2);     // data block and inode block
+    assert(fs.free_blocks[21] && !fs.free_blocks[29]);
+    assert(fs_write(&fs, second, data + 8, 2*BLOCK_SIZE, 0) == 2*BLOCK_SIZE);
+    assert(fs.free_blocks[25] && fs.free_blocks[26] && !fs.free_blocks[30] && !fs.free_blocks[31]);
+
+    assert(fs_read(&fs, first, copy, 4*BLOCK_SIZE, 0) == 4*BLOCK_SIZE);
+    assert(memcmp(copy, data, 100) == 0);
+    assert(memcmp(copy + 100, "XYZ", 3) == 0);
+    assert(memcmp(copy + 103, data + 103, 4*BLOCK_SIZE - 103) == 0);
+    assert(fs_read(&fs, second, copy, 4*BLOCK_SIZE, 0) == 4*BLOCK_SIZE);
+    assert(memcmp(copy, data + 8, 2*BLOCK_SIZE) == 0);
+    assert(memcmp(copy + 2*BLOCK_SIZE, data + 2*BLOCK_SIZE, 2*BLOCK_SIZE) == 0);
+
+    debug("Check cleaner empties sparse segments");
+    ssize_t third = fs_create(&fs);
+    assert(fs_write(&fs, third, data, 53*BLOCK_SIZE, 0) == 53*BLOCK_SIZE);
+    assert(fs.log_head == 86);
+    assert(fs_remove(&fs, third));
+    assert(fs_clean(&fs) == 8);
+    for (size_t b = 21; b < 85; b++) {
+        assert(fs.free_blocks[b]);
+    }
+    assert(fs_clean(&fs) == 0);
+
+    debug("Check truncating and writing shared blocks keeps clones");
+    ssize_t fourth = fs_create(&fs);
+    assert(fs_write(&fs, fourth, data, 2*BLOCK_SIZE, 0) == 2*BLOCK_SIZE);
+    ssize_t clone = fs_clone(&fs, fourth);
+    assert(clone >= 0);
+    assert(fs_truncate(&fs, fourth, 100));
+    assert(fs_write(&fs, fourth, "XYZ", 3, 10) == 3);
+    assert(fs_read(&fs, clone, copy, 2*BLOCK_SIZE, 0) == 2*BLOCK_SIZE);
+    assert(memcmp(copy, data, 2*BLOCK_SIZE) == 0);
+    assert(fs_stat(&fs, fourth) == 100);
+    assert(fs_read(&fs, fourth, copy, 100, 0) == 100);
+    assert(memcmp(copy, data, 10) == 0 && memcmp(copy + 10, "XYZ", 3) == 0);
+    assert(memcmp(copy + 13, data + 13, 87) == 0);
+
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_clean(&fs) == -1);
+    assert(fs_read(&fs, clone, copy, 2*BLOCK_SIZE, 0) == 2*BLOCK_SIZE);
+    assert(memcmp(copy, data, 2*BLOCK_SIZE) == 0);
+    assert(fs_read(&fs, first, copy, 4*BLOCK_SIZE, 0) == 4*BLOCK_SIZE);
+    assert(memcmp(copy + 100, "XYZ", 3) == 0);
+    assert(memcmp(copy + 103, data + 103, 4*BLOCK_SIZE - 103) == 0);
+    assert(fs_read(&fs, second, copy, 4*BLOCK_SIZE, 0) == 4*BLOCK_SIZE);
+    assert(memcmp(copy, data + 8, 2*BLOCK_SIZE) == 0);
+    assert(memcmp(copy + 2*BLOCK_SIZE, data + 2*BLOCK_SIZE, 2*BLOCK_SIZE) == 0);
+
+    free(data);
+    free(copy);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_25_fs_inode_cache() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 700);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount_options(&fs, disk, FS_MOUNT_WRITEBACK));
+    fs_wait_ready(&fs);
+
+    debug("Check inode block changes stay cached until sync");
+    size_t reads  = disk->reads;
+    size_t writes = disk->writes;
+    for (size_t i = 0; i < INODES_PER_BLOCK; i++) {
+        assert(fs_create(&fs) == (ssize_t)i);
+    }
+    assert(fs_write(&fs, 5, "cached", 6, 0) == 6);
+    assert(fs_stat(&fs, 127) == 0);
+    assert(disk->reads - reads == 1);           // the scan left block 65 in its cache slot
+    assert(disk->writes - writes == 1);         // data block only
+
+    Block block;
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(!block.inodes[0].valid);
+    writes = disk->writes;
+    assert(fs_sync(&fs));
+    assert(disk->writes - writes == 1);
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(block.inodes[127].valid && block.inodes[5].size == 6);
+    writes = disk->writes;
+    assert(fs_sync(&fs));
+    assert(disk->writes - writes == 0);
+
+    debug("Check a full cache writes back the block it evicts");
+    for (size_t i = INODES_PER_BLOCK; i < INODE_CACHE_BLOCKS*INODES_PER_BLOCK; i++) {
+        assert(fs_create(&fs) == (ssize_t)i);
+    }
+    assert(fs_write(&fs, 5, "cached", 6, 6) == 6);
+    writes = disk->writes;
+    assert(fs_create(&fs) == INODE_CACHE_BLOCKS*INODES_PER_BLOCK);
+    assert(disk->writes - writes == 1);         // block 1 leaves the cache
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(block.inodes[5].size == 12);
+
+    debug("Check sync writes consecutive blocks with one request");
+    writes = disk->writes;
+    assert(fs_sync(&fs));
+    assert(disk->writes - writes == 1);         // blocks 2 to 65
+    assert(disk_read(disk, 1 + INODE_CACHE_BLOCKS, block.data) == BLOCK_SIZE);
+    assert(block.inodes[0].valid);
+
+    assert(fs_remove(&fs, 5));
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_stat(&fs, 5) == -1);
+    assert(fs_stat(&fs, INODE_CACHE_BLOCKS*INODES_PER_BLOCK) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+void *test_fsync(void *arg) {
+    TestWriter *w = (TestWriter *)arg;
+    assert(fs_fsync(w->fs, w->inode_number, false));
+    return NULL;
+}
+
+int test_26_fs_fsync() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount_options(&fs, disk, FS_MOUNT_DELALLOC | FS_MOUNT_WRITEBACK));
+    fs_wait_ready(&fs);
+
+    char data[BLOCK_SIZE];
+    memset(data, 'f', sizeof(data));
+    assert(fs_create(&fs) == 0);
+    assert(fs_create(&fs) == 1);
+    assert(fs_write(&fs, 0, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_write(&fs, 1, data, sizeof(data), 0) == sizeof(data));
+
+    debug("Check data_only writes the file data but not its inode");
+    size_t writes = disk->writes;
+    size_t syncs  = disk->syncs;
+    assert(fs_fsync(&fs, 0, true));
+    assert(disk->writes - writes == 1);
+    assert(disk->syncs - syncs == 1);
+
+    Block block;
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(!block.inodes[0].valid);
+    assert(disk_read(disk, 21, block.data) == BLOCK_SIZE);
+    assert(block.data[0] == 'f');
+
+    debug("Check fsync writes the inode block too");
+    writes = disk->writes;
+    assert(fs_fsync(&fs, 0, false));
+    assert(disk->writes - writes == 1);
+    assert(disk_read(disk, 1, block.data) == BLOCK_SIZE);
+    assert(block.inodes[0].valid && block.inodes[0].size == BLOCK_SIZE);
+    assert(block.inodes[1].valid && block.inodes[1].size == 0);   // still buffered
+    assert(fs_stat(&fs, 1) == BLOCK_SIZE);
+
+    assert(!fs_fsync(&fs, 2, false));
+    assert(!fs_fsync(&fs, fs.meta_data.inodes, false));
+
+    debug("Check concurrent callers share one flush");
+    TestWriter callers[8];
+    pthread_t  threads[8];
+    pthread_mutex_lock(&fs.sync_lock);
+    fs.sync_busy = true;                        // hold off flushes until every caller waits
+    pthread_mutex_unlock(&fs.sync_lock);
+    size_t requested = fs.sync_requested;
+    syncs = disk->syncs;
+    for (size_t i = 0; i < 8; i++) {
+        callers[i].fs           = &fs;
+        callers[i].inode_number = i % 2;
+        assert(pthread_create(&threads[i], NULL, test_fsync, &callers[i]) == 0);
+    }
+    for (bool waiting = false; !waiting; usleep(1000)) {
+        pthread_mutex_lock(&fs.sync_lock);
+        waiting = fs.sync_requested - requested == 8;
+        pthread_mutex_unlock(&fs.sync_lock);
+    }
+    pthread_mutex_lock(&fs.sync_lock);
+    fs.sync_busy = false;
+    pthread_cond_broadcast(&fs.sync_cond);
+    pthread_mutex_unlock(&fs.sync_lock);
+    for (size_t i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(disk->syncs - syncs == 1);
+
+    debug("Check sync flushes everything");
+    syncs = disk->syncs;
+    assert(fs_sync(&fs));
+    assert(disk->syncs - syncs == 1);
+    fs_unmount(&fs);
+
+    assert(fs_mount_options(&fs, disk, FS_MOUNT_READONLY));
+    assert(fs_stat(&fs, 0) == BLOCK_SIZE);
+    assert(fs_stat(&fs, 1) == BLOCK_SIZE);
+    assert(fs_fsync(&fs, 1, true));
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+void test_async_removed(AsyncRequest *request, void *arg) {
+    size_t *removed = (size_t *)arg;
+    assert(request->type == ASYNC_REMOVE && request->result == 1);
+    __sync_fetch_and_add(removed, 1);
+}
+
+int test_27_fs_async() {
+    assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    AsyncQueue *queue = async_open(&fs, 4);
+    assert(queue);
+
+    debug("Check completions are pollable");
+    struct pollfd pfd = {.fd = async_fd(queue), .events = POLLIN};
+    assert(poll(&pfd, 1, 0) == 0);
+    AsyncRequest *request = async_create(queue, NULL, NULL);
+    assert(request);
+    assert(poll(&pfd, 1, 5000) == 1 && pfd.revents & POLLIN);
+    assert(async_poll(queue, false) == request);
+    assert(request->type == ASYNC_CREATE && request->result == 0);
+    async_release(request);
+    assert(poll(&pfd, 1, 0) == 0);
+    assert(async_poll(queue, false) == NULL);
+    assert(async_poll(queue, true) == NULL);
+
+    debug("Check creates complete through the queue");
+    bool created[8] = {false};
+    for (size_t i = 1; i < 8; i++) {
+        assert(async_create(queue, NULL, NULL));
+    }
+    created[0] = true;
+    for (size_t i = 1; i < 8; i++) {
+        request = async_poll(queue, true);
+        assert(request && request->result > 0 && request->result < 8);
+        assert(!created[request->result]);
+        created[request->result] = true;
+        async_release(request);
+    }
+
+    debug("Check requests on one inode run in submission order");
+    char data[8][BLOCK_SIZE];
+    char copy[8][BLOCK_SIZE];
+    for (size_t i = 0; i < 8; i++) {
+        memset(data[i], 'a' + i, BLOCK_SIZE);
+        assert(async_write(queue, i, data[i], BLOCK_SIZE, 0, NULL, NULL));
+        assert(async_read(queue, i, copy[i], BLOCK_SIZE, 0, NULL, NULL));
+    }
+    for (size_t i = 0; i < 16; i++) {
+        request = async_poll(queue, true);
+        assert(request && request->result == BLOCK_SIZE);
+        async_release(request);
+    }
+    for (size_t i = 0; i < 8; i++) {
+        assert(memcmp(data[i], copy[i], BLOCK_SIZE) == 0);
+    }
+
+    debug("Check callbacks and close running what was submitted");
+    size_t removed = 0;
+    for (size_t i = 0; i < 8; i++) {
+        assert(async_remove(queue, i, test_async_removed, &removed));
+    }
+    async_close(queue);
+    assert(removed == 8);
+    for (size_t i = 0; i < 8; i++) {
+        assert(fs_stat(&fs, i) == -1);
+    }
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+void *test_churn(void *arg) {
+    TestWriter *w = (TestWriter *)arg;
+    char data[8*BLOCK_SIZE];
+    char copy[8*BLOCK_SIZE];
+
+    for (size_t round = 0; round < 40; round++) {
+        ssize_t inode_number = fs_create(w->fs);
+        assert(inode_number >= 0);
+
+        size_t size = (round * 977 + w->inode_number * 131) % sizeof(data) + 1;
+        memset(data, 'A' + (inode_number + round) % 26, size);
+        assert(fs_write(w->fs, inode_number, data, size, 0) == (ssize_t)size);
+        assert(fs_stat(w->fs, inode_number) == (ssize_t)size);
+        assert(fs_read(w->fs, inode_number, copy, size, 0) == (ssize_t)size);
+        assert(memcmp(data, copy, size) == 0);
+
+        assert(fs_truncate(w->fs, inode_number, size / 2));
+        assert(fs_read(w->fs, inode_number, copy, size, 0) == (ssize_t)(size / 2));
+        assert(memcmp(data, copy, size / 2) == 0);
+        assert(fs_remove(w->fs, inode_number));
+    }
+    return NULL;
+}
+
+void *test_shared_reader(void *arg) {
+    TestWriter *w = (TestWriter *)arg;
+    char copy[4*BLOCK_SIZE];
+
+    for (size_t round = 0; round < 200; round++) {
+        assert(fs_read(w->fs, w->inode_number, copy, sizeof(copy), 0) == sizeof(copy));
+        for (size_t i = 0; i < sizeof(copy); i++) {
+            assert(copy[i] == 's' || copy[i] == 'S');
+        }
+        assert(copy[0] == copy[sizeof(copy) - 1]);
+    }
+    return NULL;
+}
+
+void *test_shared_writer(void *arg) {
+    TestWriter *w = (TestWriter *)arg;
+    char data[4*BLOCK_SIZE];
+
+    for (size_t round = 0; round < 100; round++) {
+        memset(data, round % 2 ? 'S' : 's', sizeof(data));
+        assert(fs_write(w->fs, w->inode_number, data, sizeof(data), 0) == sizeof(data));
+    }
+    return NULL;
+}
+
+int test_28_fs_threads() {
+    uint32_t features[] = {0, FS_FEATURE_INLINE_DATA | FS_FEATURE_JOURNAL, FS_FEATURE_EXTENTS, 0};
+    uint32_t options[]  = {FS_MOUNT_WRITEBACK, 0, FS_MOUNT_DELALLOC, FS_MOUNT_LOG};
+
+    for (size_t k = 0; k < 4; k++) {
+        assert(system("truncate -s 0 data/image.unit") == EXIT_SUCCESS);
+
+        Disk *disk = disk_open("data/image.unit", 2000);
+        assert(disk);
+
+        FileSystem fs = {0};
+        assert(fs_format_features(&fs, disk, features[k]));
+        assert(fs_mount_options(&fs, disk, options[k]));
+        fs_wait_ready(&fs);
+
+        char data[4*BLOCK_SIZE];
+        memset(data, 's', sizeof(data));
+        ssize_t shared = fs_create(&fs);
+        assert(shared >= 0);
+        assert(fs_write(&fs, shared, data, sizeof(data), 0) == sizeof(data));
+        assert(fs_sync(&fs));
+
+        size_t free_before = 0;
+        for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+            free_before += fs.free_blocks[b];
+        }
+
+        debug("Check concurrent create/write/truncate/remove and readers of one file (features 0x%x)",
+              features[k]);
+        TestWriter args[13];
+        pthread_t  threads[13];
+        for (size_t i = 0; i < 13; i++) {
+            args[i].fs           = &fs;
+            args[i].inode_number = i < 8 ? i : (size_t)shared;
+            void *(*body)(void *) = i < 8 ? test_churn : i < 12 ? test_shared_reader : test_shared_writer;
+            assert(pthread_create(&threads[i], NULL, body, &args[i]) == 0);
+        }
+        assert(fs_snapshot(&fs, "busy"));
+        for (size_t i = 0; i < 13; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        debug("Check a snapshot taken during the writes holds one whole write");
+        FileSystem snap = {0};
+        char       copy[sizeof(data)];
+        assert(fs_mount_snapshot(&snap, disk, "busy"));
+        fs_wait_ready(&snap);
+        assert(fs_read(&snap, shared, copy, sizeof(copy), 0) == sizeof(copy));
+        for (size_t i = 0; i < sizeof(copy); i++) {
+            assert(copy[i] == copy[0] && (copy[0] == 's' || copy[0] == 'S'));
+        }
+        fs_unmount(&snap);
+        assert(fs_delete_snapshot(&fs, "busy"));
+
+        debug("Check every block and inode came back");
+        assert(fs_sync(&fs));
+        size_t free_after = 0;
+        for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+            free_after += fs.free_blocks[b];
+        }
+        assert(free_after == free_before - 1);      // snapshot directory
+        fs_unmount(&fs);
+
+        assert(fs_mount(&fs, disk));
+        fs_wait_ready(&fs);
+        size_t free_remount = 0;
+        for (size_t b = 0; b < fs.meta_data.blocks; b++) {
+            free_remount += fs.free_blocks[b];
+        }
+        assert(free_remount == free_before - 1);
+        for (size_t i = 0; i < fs.meta_data.inodes; i++) {
+            assert(fs.free_inodes[i] == (i != (size_t)shared));
+        }
+        assert(fs_stat(&fs, shared) == sizeof(data));
+
+        fs_unmount(&fs);
+        disk_close(disk);
+    }
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -174,6 +2257,31 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    1. Test fs_create\n");
         fprintf(stderr, "    2. Test fs_remove\n");
         fprintf(stderr, "    3. Test fs_stat\n");
+        fprintf(stderr, "    4. Test fs_lazy_mount\n");
+        fprintf(stderr, "    5. Test fs_free_inodes\n");
+        fprintf(stderr, "    6. Test fs_block_groups\n");
+        fprintf(stderr, "    7. Test fs_arenas\n");
+        fprintf(stderr, "    8. Test fs_fallocate\n");
+        fprintf(stderr, "    9. Test fs_delalloc\n");
+        fprintf(stderr, "    10. Test fs_extents\n");
+        fprintf(stderr, "    11. Test fs_large_files\n");
+        fprintf(stderr, "    12. Test fs_inline_data\n");
+        fprintf(stderr, "    13. Test fs_sparse_files\n");
+        fprintf(stderr, "    14. Test fs_full_block_writes\n");
+        fprintf(stderr, "    15. Test fs_open\n");
+        fprintf(stderr, "    16. Test fs_read_view\n");
+        fprintf(stderr, "    17. Test fs_writev\n");
+        fprintf(stderr, "    18. Test fs_truncate\n");
+        fprintf(stderr, "    19. Test fs_clone\n");
+        fprintf(stderr, "    20. Test fs_copy_range\n");
+        fprintf(stderr, "    21. Test fs_dedup\n");
+        fprintf(stderr, "    22. Test fs_snapshot\n");
+        fprintf(stderr, "    23. Test fs_journal\n");
+        fprintf(stderr, "    24. Test fs_log\n");
+        fprintf(stderr, "    25. Test fs_inode_cache\n");
+        fprintf(stderr, "    26. Test fs_fsync\n");
+        fprintf(stderr, "    27. Test fs_async\n");
+        fprintf(stderr, "    28. Test fs_threads\n");
         return EXIT_FAILURE;
     }
 
@@ -187,6 +2295,31 @@ int main(int argc, char *argv[]) {
         case 1:  status = test_01_fs_create(); break;
         case 2:  status = test_02_fs_remove(); break;
         case 3:  status = test_03_fs_stat(); break;
+        case 4:  status = test_04_fs_lazy_mount(); break;
+        case 5:  status = test_05_fs_free_inodes(); break;
+        case 6:  status = test_06_fs_block_groups(); break;
+        case 7:  status = test_07_fs_arenas(); break;
+        case 8:  status = test_08_fs_fallocate(); break;
+        case 9:  status = test_09_fs_delalloc(); break;
+        case 10: status = test_10_fs_extents(); break;
+        case 11: status = test_11_fs_large_files(); break;
+        case 12: status = test_12_fs_inline_data(); break;
+        case 13: status = test_13_fs_sparse_files(); break;
+        case 14: status = test_14_fs_full_block_writes(); break;
+        case 15: status = test_15_fs_open(); break;
+        case 16: status = test_16_fs_read_view(); break;
+        case 17: status = test_17_fs_writev(); break;
+        case 18: status = test_18_fs_truncate(); break;
+        case 19: status = test_19_fs_clone(); break;
+        case 20: status = test_20_fs_copy_range(); break;
+        case 21: status = test_21_fs_dedup(); break;
+        case 22: status = test_22_fs_snapshot(); break;
+        case 23: status = test_23_fs_journal(); break;
+        case 24: status = test_24_fs_log(); break;
+        case 25: status = test_25_fs_inode_cache(); break;
+        case 26: status = test_26_fs_fsync(); break;
+        case 27: status = test_27_fs_async(); break;
+        case 28: status = test_28_fs_threads(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }
 